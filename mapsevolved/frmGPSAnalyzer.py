@@ -611,17 +611,21 @@ class GPSTrackAnalyzerFrame(wx.Frame):
 
     def augment_gpx_data(self):
         first_point = self.gpx.tracks[0].segments[0].points[0]
+        points = []
         for point, track_idx, seg_idx, point_idx in self.gpx.walk():
             point.abs_name = "%s:%d:%d:%d" % (self.gpx_basename, track_idx,
                                               seg_idx, point_idx)
-
-            latlon = pymaplib.LatLon(point.latitude, point.longitude)
-            ok, terraininfo = self.heightfinder.calc_terrain(latlon)
-            if not ok:
-                terraininfo.height_m = -1
-            point.dhm_elevation = terraininfo.height_m
-
             point.secs_after_start = point.time_difference(first_point)
+            points.append(point)
+
+        latlons = [pymaplib.LatLon(point.latitude, point.longitude)
+                   for point in points]
+        terraininfos = self.heightfinder.calc_terrain_batch(latlons)
+        for point, terraininfo in zip(points, terraininfos):
+            if terraininfo is None:
+                point.dhm_elevation = -1
+            else:
+                point.dhm_elevation = terraininfo.height_m
 
     def populate_pointlistbox(self):
         self.pointlistbox.AppendColumn(_("Time"))
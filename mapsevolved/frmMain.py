@@ -122,6 +122,10 @@ class MainFrame(wx.Frame):
         util.bind_decorator_events(self, post_event_hook=self.updateui)
         util.bind_decorator_pubsubs(self)
 
+        # Keep expensive tiles (GVG, gradient/steepness views) across sessions.
+        pymaplib.PersistentTileStore.Instance().SetDirectory(
+                util.get_tile_store_dir())
+
         self.ogldisplay = pymaplib.CreateOGLDisplay(self.panel.GetHandle())
 
         self.mapview = pymaplib.MapView(self.ogldisplay)
@@ -190,6 +190,7 @@ class MapManagerFrame(wx.Frame):
             pymaplib.GeoDrawable.TYPE_IMAGE: _("Plain image"),
             pymaplib.GeoDrawable.TYPE_GPSTRACK: _("GPS track"),
             pymaplib.GeoDrawable.TYPE_POI_DB: _("POI database"),
+            pymaplib.GeoDrawable.TYPE_HILLSHADE_MAP: _("DHM Hillshade"),
             pymaplib.GeoDrawable.TYPE_ERROR: _("Error"),
         }
         if drawable:
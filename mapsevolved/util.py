@@ -15,6 +15,7 @@
 import sys
 import os
 import imp
+import tempfile
 import math
 import functools
 import contextlib
@@ -44,6 +45,16 @@ def get_mapsevolved_dir():
         return os.path.join(os.path.dirname(sys.executable), 'mapsevolved')
     return os.path.dirname(os.path.realpath(__file__))
 
+def get_tile_store_dir():
+    """Get the directory for persistently cached map tiles
+
+    The directory is created if it doesn't exist yet.
+    """
+    base = os.environ.get('LOCALAPPDATA') or tempfile.gettempdir()
+    path = os.path.join(base, 'MapsEvolved', 'TileStore')
+    os.makedirs(path, exist_ok=True)
+    return path
+
 def get_xrc_path_default(xrc_name):
     """Resolve the name of an XRC file to a full path"""
     if not xrc_name.endswith('.xrc'):
@@ -171,6 +171,10 @@ class HeightFinder:
     # Cf. https://www.google.com/search?q=32768+srtm
     INVALID_DHM_VALUE = -2**15
 
+    # Edge length of the DHM pixel blocks sharing one resolution in
+    # ``calc_terrain_batch()``.
+    RANK_BLOCK_PIXELS = 256
+
     def __init__(self, maps):
         """HeightFinder constructor
 
@@ -223,6 +227,62 @@ class HeightFinder:
                 return ok, res
         return False, None
 
+    def calc_terrain_batch(self, latlons):
+        """Calculate terrain info for many locations at once
+
+        Returns a list with the ``terrain_info`` for each location, or None
+        where no valid information is available. Cf. ``calc_terrain()``.
+
+        Every location uses the DHMs covering it, ranked by resolution as in
+        ``find_best_dhms()``. Computing a resolution is expensive, so it is
+        done once per block of ``RANK_BLOCK_PIXELS`` squared DHM pixels, not
+        per location. Locations preferring the same DHMs are grouped, and
+        each DHM is queried once per group for all locations it hasn't
+        provided a valid height for yet.
+        """
+
+        latlons = list(latlons)
+        results = [None] * len(latlons)
+
+        type_dhm = maplib_sip.GeoDrawable.TYPE_DHM
+        dhms = [container.drawable for container in self.maps
+                if container.drawable.GetType() == type_dhm]
+        # (mpp, DHM index) of the DHMs covering each location.
+        rankings = [[] for latlon in latlons]
+        for n, dhm in enumerate(dhms):
+            block_mpps = {}
+            for i, latlon in enumerate(latlons):
+                ok, coord = dhm.LatLonToPixel(latlon)
+                if not ok or not coord.IsInRect(MapPixelCoordInt(0, 0),
+                                                dhm.GetSize()):
+                    continue
+                block = (int(coord.x) // self.RANK_BLOCK_PIXELS,
+                         int(coord.y) // self.RANK_BLOCK_PIXELS)
+                if block not in block_mpps:
+                    block_mpps[block] = self._mpp_or_inf(dhm, latlon)
+                rankings[i].append((block_mpps[block], n))
+
+        groups = {}
+        for i, ranking in enumerate(rankings):
+            # Equal resolutions keep the map order, as in find_best_dhms().
+            key = tuple(n for mpp, n in sorted(ranking))
+            groups.setdefault(key, []).append(i)
+
+        for key, pending in groups.items():
+            for n in key:
+                if not pending:
+                    break
+                valid, infos = maplib_sip.CalcTerrainInfoBatch(
+                        dhms[n], [latlons[i] for i in pending])
+                still_pending = []
+                for i, ok, info in zip(pending, valid, infos):
+                    if ok and info.height_m != self.INVALID_DHM_VALUE:
+                        results[i] = info
+                    else:
+                        still_pending.append(i)
+                pending = still_pending
+        return results
+
 
 def is_within_map(latlon, drawable):
     """Return True if the point latlon lies within drawable"""
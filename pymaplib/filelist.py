@@ -24,6 +24,7 @@ class FileListEntry:
     TYPE_GPSTRACK = maplib_sip.GeoDrawable.TYPE_GPSTRACK
     TYPE_GRIDLINES = maplib_sip.GeoDrawable.TYPE_GRIDLINES
     TYPE_POI_DB = maplib_sip.GeoDrawable.TYPE_POI_DB
+    TYPE_HILLSHADE_MAP = maplib_sip.GeoDrawable.TYPE_HILLSHADE_MAP
     TYPE_ERROR = maplib_sip.GeoDrawable.TYPE_ERROR
 
     def __init__(self):
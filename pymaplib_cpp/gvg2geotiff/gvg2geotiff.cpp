@@ -1,10 +1,24 @@
 // gvg2geotiff.cpp: Convert GVG maps to GeoTIFF
 
+#include <algorithm>
 #include <array>
+#include <map>
 #include <string>
+#include <vector>
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include "../include/map_gvg.h"
+#include "../include/memjpeg.h"
 #include "../include/util.h"
 
 #include "tiff.h"
@@ -16,6 +30,10 @@
 
 const char * const DEFAULT_ENCODING = "UTF-8";
 const int DEFAULT_JPEG_COMPRESSION = 75;
+// Decoded tiles a worker may run ahead of the writer, per worker.
+const int TILES_AHEAD_PER_WORKER = 4;
+// Upper bound for -j, more threads than this are certainly a typo.
+const long MAX_JOBS = 1024;
 
 
 typedef std::unique_ptr<TIFF, decltype(&XTIFFClose)> TIFF_unique_ptr;
@@ -30,6 +48,8 @@ struct compression_def {
     int jpegcolormode;
     int jpegquality;
     uint16 predictor;
+    // Write the GMP JPEG data without decoding and re-encoding it.
+    bool jpeg_passthrough;
 };
 
 
@@ -131,22 +151,226 @@ void set_tiff_keys(GVGMap *map, TIFF *tif, const compression_def *comp) {
     TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, desc);
 }
 
-void copy_tiles(GVGMap *map, TIFF *tif) {
+// A tile ready for writing. Either `pixels` for libtiff to encode, or a
+// complete `jpeg` to be stored as-is.
+struct TileData {
+    TileData() : pixels(), jpeg(), reencoded(false) {};
+
+    PixelBuf pixels;
+    std::vector<unsigned char> jpeg;
+    // Passthrough was requested, but the tile had to be re-encoded.
+    bool reencoded;
+};
+
+TileData load_tile(GVGMap *map, int tx, int ty, bool passthrough) {
+    TileData result;
+    if (passthrough) {
+        // Decrypt the GMP tile and fix up its channel order. GMP tiles
+        // store red and blue swapped, which can only be fixed without
+        // re-encoding for RGB-coded JPEGs. Maps may mix tiles from
+        // different encoders, so fall back to re-encoding tile by tile.
+        std::vector<unsigned char> tile;
+        if (map->GetGMPImage().ReadCompressedTile(tx, ty, &tile)) {
+            if (jpeg_swap_rb_lossless(&tile[0], tile.size(), &result.jpeg)) {
+                return result;
+            }
+            result.reencoded = true;
+        }
+        // Missing tiles are left to libtiff, just as below. The TIFF is
+        // RGB-coded, so re-encoded tiles match the passed-through ones.
+    }
+    // Decrypt and decode a GMP tile, and convert it to TIFF row order and
+    // pixel format.
+    result.pixels = map->GetGMPImage().LoadTile(tx, ty);
+    invert_y(result.pixels);
+    rgb32_to_rgb24(result.pixels);
+    return result;
+}
+
+void write_tile(GVGMap *map, TIFF *tif, int tx, int ty, TileData &tile,
+                int *reencoded)
+{
+    auto num_tiles_x = map->GetGMPImage().NumTilesX();
+    if (tile.reencoded) {
+        (*reencoded)++;
+    }
+    if (!tile.jpeg.empty()) {
+        TIFFWriteRawTile(tif, tx + ty*num_tiles_x,
+                         &tile.jpeg[0], tile.jpeg.size());
+        return;
+    }
+    auto &pb = tile.pixels;
+    int tile_size = pb.GetWidth() * pb.GetHeight() * 3;
+    TIFFWriteEncodedTile(tif, tx + ty*num_tiles_x,
+                         pb.GetRawData(), tile_size);
+}
+
+/** Decoded tiles passed from the workers to the writer.
+ *
+ * Workers claim tile numbers in increasing order and must not run more
+ * than `max_ahead` tiles ahead of the writer. This bounds the memory held
+ * by decoded tiles, no matter how slow writing is.
+ *
+ * @locking `m_mutex` protects all members except `m_next_claim`. It is
+ * never held while decoding or writing tiles.
+ */
+class TilePipeline {
+    public:
+        TilePipeline(int num_tiles, int max_ahead)
+            : m_num_tiles(num_tiles), m_max_ahead(max_ahead),
+              m_next_claim(0), m_next_write(0), m_failed(false)
+        {};
+
+        /** Get the next tile to decode, or -1 if there's nothing left. */
+        int Claim() {
+            int tile = m_next_claim++;
+            if (tile >= m_num_tiles) {
+                return -1;
+            }
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            while (!m_failed && tile >= m_next_write + m_max_ahead) {
+                m_writer_progress.wait(lock);
+            }
+            return m_failed ? -1 : tile;
+        }
+
+        /** Hand over the decoded tile `tile`. */
+        void Done(int tile, const TileData &data) {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_done[tile] = data;
+            m_tile_done.notify_all();
+        }
+
+        /** Stop all workers, e.g. because decoding failed. */
+        void Fail(const std::string &error) {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            if (!m_failed) {
+                m_failed = true;
+                m_error = error;
+            }
+            m_tile_done.notify_all();
+            m_writer_progress.notify_all();
+        }
+
+        /** Wait for the next tile in order, return `false` on failure. */
+        bool Next(int *tile, TileData *data) {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            std::map<int, TileData>::iterator it;
+            while (!m_failed &&
+                   (it = m_done.find(m_next_write)) == m_done.end())
+            {
+                m_tile_done.wait(lock);
+            }
+            if (m_failed) {
+                return false;
+            }
+            *tile = it->first;
+            *data = it->second;
+            m_done.erase(it);
+            m_next_write++;
+            m_writer_progress.notify_all();
+            return true;
+        }
+
+        const std::string &GetError() const { return m_error; }
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TilePipeline);
+
+        const int m_num_tiles;
+        const int m_max_ahead;
+        boost::atomic<int> m_next_claim;
+
+        boost::mutex m_mutex;
+        boost::condition_variable m_tile_done;
+        boost::condition_variable m_writer_progress;
+        std::map<int, TileData> m_done;
+        int m_next_write;
+        bool m_failed;
+        std::string m_error;
+};
+
+void decode_tiles_worker(GVGMap *map, bool passthrough,
+                         TilePipeline *pipeline)
+{
+    auto num_tiles_x = map->GetGMPImage().NumTilesX();
+    try {
+        int tile;
+        while ((tile = pipeline->Claim()) >= 0) {
+            pipeline->Done(tile, load_tile(map, tile % num_tiles_x,
+                                           tile / num_tiles_x, passthrough));
+        }
+    } catch (const std::exception &e) {
+        pipeline->Fail(e.what());
+    }
+}
+
+bool copy_tiles(GVGMap *map, TIFF *tif, const compression_def *comp,
+                unsigned int jobs)
+{
+    bool passthrough = comp->jpeg_passthrough;
     wcerr << L"Converting: ";
+    auto start = boost::chrono::steady_clock::now();
     auto num_tiles_x = map->GetGMPImage().NumTilesX();
     auto num_tiles_y = map->GetGMPImage().NumTilesY();
-    for (int ty = 0; ty < num_tiles_y; ty++) {
-        wcerr << L".";
-        for (int tx = 0; tx < num_tiles_x; tx++) {
-            auto pb = map->GetGMPImage().LoadTile(tx, ty);
-            invert_y(pb);
-            rgb32_to_rgb24(pb);
-            int tile_size = pb.GetWidth() * pb.GetHeight() * 3;
-            TIFFWriteEncodedTile(tif, tx + ty*num_tiles_x,
-                                 pb.GetRawData(), tile_size);
+    int num_tiles = num_tiles_x * num_tiles_y;
+    int reencoded = 0;
+    if (jobs <= 1) {
+        try {
+            for (int ty = 0; ty < num_tiles_y; ty++) {
+                wcerr << L".";
+                for (int tx = 0; tx < num_tiles_x; tx++) {
+                    auto tile = load_tile(map, tx, ty, passthrough);
+                    write_tile(map, tif, tx, ty, tile, &reencoded);
+                }
+            }
+        } catch (const std::exception &e) {
+            wcerr << endl << L"Failed to load tiles: "
+                  << WStringFromString(e.what(), DEFAULT_ENCODING) << endl;
+            return false;
+        }
+    } else {
+        // Workers decode tiles in parallel, this thread writes them in
+        // order. libtiff handles are not thread-safe, so encoding happens
+        // here as well.
+        TilePipeline pipeline(num_tiles, jobs * TILES_AHEAD_PER_WORKER);
+        boost::thread_group workers;
+        for (unsigned int i = 0; i < jobs; i++) {
+            workers.create_thread([map, passthrough, &pipeline]() {
+                decode_tiles_worker(map, passthrough, &pipeline);
+            });
+        }
+        for (int written = 0; written < num_tiles; written++) {
+            int tile;
+            TileData data;
+            if (!pipeline.Next(&tile, &data)) {
+                break;
+            }
+            if (tile % num_tiles_x == 0) {
+                wcerr << L".";
+            }
+            write_tile(map, tif, tile % num_tiles_x, tile / num_tiles_x, data,
+                       &reencoded);
+        }
+        workers.join_all();
+        if (!pipeline.GetError().empty()) {
+            wcerr << endl << L"Failed to load tiles: "
+                  << WStringFromString(pipeline.GetError(), DEFAULT_ENCODING)
+                  << endl;
+            return false;
         }
     }
     wcerr << endl;
+
+    boost::chrono::duration<double> seconds =
+            boost::chrono::steady_clock::now() - start;
+    wcerr << num_tiles << L" tiles in " << seconds.count() << L" s ("
+          << num_tiles / std::max(seconds.count(), 1e-3) << L" tiles/s)"
+          << endl;
+    if (reencoded) {
+        wcerr << reencoded << L" tiles couldn't be passed through, "
+              << L"re-encoded them instead." << endl;
+    }
+    return true;
 }
 
 std::array<double, 16>
@@ -234,19 +458,38 @@ bool set_geotiff_keys(GVGMap *map, TIFF *tif) {
 int wmain(int argc, wchar_t* argv[]) {
     std::wstring user_output_fname;
     bool info_only = false;
+    unsigned int jobs = 1;
     struct compression_def comp = {
             COMPRESSION_PACKBITS,
             JPEGCOLORMODE_RGB,
             DEFAULT_JPEG_COMPRESSION,
             0,
+            false,
     };
 
     int c;
-    while ((c = getopt(argc, argv, L"c:o:hi")) != -1) {
+    while ((c = getopt(argc, argv, L"c:o:j:hi")) != -1) {
         switch (c) {
         case 'c':
             parse_compress_opts(optarg, &comp);
             break;
+        case 'j': {
+            wchar_t *end;
+            errno = 0;
+            long value = wcstol(optarg, &end, 10);
+            if (end == optarg || *end != L'\0' || errno == ERANGE ||
+                value < 0 || value > MAX_JOBS)
+            {
+                wcerr << L"Invalid number of jobs: "
+                      << L"'" << optarg << L"'" << endl;
+                usage();
+            }
+            jobs = static_cast<unsigned int>(value);
+            if (jobs == 0) {
+                jobs = std::max(1u, boost::thread::hardware_concurrency());
+            }
+            break;
+        }
         case 'o':
             user_output_fname = optarg;
             break;
@@ -305,9 +548,18 @@ int wmain(int argc, wchar_t* argv[]) {
         }
 
         set_tiff_keys(map.get(), tif.get(), &comp);
-        copy_tiles(map.get(), tif.get());
-        if (!set_geotiff_keys(map.get(), tif.get())) {
+        if (!copy_tiles(map.get(), tif.get(), &comp, jobs) ||
+            !set_geotiff_keys(map.get(), tif.get()))
+        {
+            // Don't leave a truncated TIFF behind, it would look like a
+            // valid conversion result.
+            tif.reset();
+            if (_wremove(ofname.c_str()) != 0) {
+                wcerr << L"Could not remove incomplete output file: "
+                      << L"'" << ofname << L"'" << endl;
+            }
             exitval |= 1;
+            break;
         }
     }
     return exitval;
@@ -328,6 +580,8 @@ static void parse_compress_opts(wchar_t* opt, compression_def *comp) {
                 comp->jpegquality = _wtoi(cp+1);
             } else if (cp[1] == 'r' ) {
                 comp->jpegcolormode = JPEGCOLORMODE_RAW;
+            } else if (cp[1] == 'p' ) {
+                comp->jpeg_passthrough = true;
             } else {
                 wcerr << L"Invalid JPEG compression spec: "
                       << L"'" << opt << L"'" << endl;
@@ -360,6 +614,7 @@ L"Available options:",
 L" -h                Show this help message",
 L" -i                Show information about the map and exit",
 L" -o out.tif        Write output to out.tif",
+L" -j N              Decode tiles in N threads (0: one per CPU, default 1)",
 L" -c lzw[:opts]     Compress output with LZW encoding",
 L" -c zip[:opts]     Compress output with deflate encoding",
 L" -c jpeg[:opts]    Compress output with JPEG encoding",
@@ -369,6 +624,7 @@ L"",
 L"JPEG options:",
 L" #     Set compression quality level (0-100, default 75)",
 L" r     Output color image as RGB rather than YCbCr",
+L" p     Pass the map's JPEG data through without re-encoding, if possible",
 L"Example: -c jpeg:r:65 gives JPEG-encoded RGB data with quality level 65",
 L"",
 L"LZW and deflate options:",
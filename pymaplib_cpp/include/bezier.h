@@ -1,6 +1,8 @@
 #ifndef ODM__BEZIER_H
 #define ODM__BEZIER_H
 
+#include <cstdint>
+
 #include "coordinates.h"
 
 class FromControlPoints {
@@ -82,7 +84,13 @@ Fast3x3CenterGradient(const T *src,
     return MapBezierGradient(src21 - src01, src12 - src10);
 }
 
-bool Gradient3x3(const unsigned int *src,
+/** Gradient of the Bezier surface through a 3x3 block of heights.
+ *
+ * `src` is a row-major buffer of `src_size`, e.g. from an `ElevationBuf`.
+ * Instantiated for `int16_t`.
+ */
+template <typename T>
+bool Gradient3x3(const T *src,
                  const MapPixelDeltaInt &src_size,
                  const MapPixelCoordInt &center,
                  const UnitSquareCoord &bezier_pos,
@@ -93,7 +101,12 @@ bool Gradient3x3(const class RasterMap &map,
                  const UnitSquareCoord &bezier_pos,
                  MapBezierGradient *gradient);
 
-bool Value3x3(const unsigned int *src,
+/** Value of the Bezier surface through a 3x3 block of heights.
+ *
+ * Cf. `Gradient3x3()`.
+ */
+template <typename T>
+bool Value3x3(const T *src,
               const MapPixelDeltaInt &src_size,
               const MapPixelCoordInt &center,
               const UnitSquareCoord &bezier_pos,
@@ -0,0 +1,94 @@
+#ifndef ODM__ELEVATIONBUF_H
+#define ODM__ELEVATIONBUF_H
+
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+#include "util.h"
+#include "pixelbuf.h"
+#include "coordinates.h"
+
+/** A rectangular area of terrain heights in meters.
+ *
+ * This is the DHM counterpart to `PixelBuf`: rather than packing every
+ * height into a 32 bit RGBX pixel, values are stored in their natural type.
+ * `ElevationBuf16` holds the 16 bit integers found in DHM files.
+ *
+ * Rows are stored bottom-up, just like in `PixelBuf`, so that algorithms
+ * and coordinates carry over unchanged.
+ */
+template <typename T>
+class ElevationBuf {
+    public:
+        typedef T value_type;
+
+        ElevationBuf() : m_data(), m_width(0), m_height(0) {};
+        ElevationBuf(int width, int height)
+            : m_data(), m_width(width), m_height(height)
+        {
+            if (width < 0 || height < 0) {
+                throw std::runtime_error(
+                    "ElevationBuf width and height must be positive.");
+            }
+            // Zero-initialize the memory block (notice the parentheses).
+            m_data.reset(new T[width * height](), ArrayDeleter<T>());
+        }
+
+        /** Convert heights sign-extended into the pixels of a `PixelBuf`.
+         *
+         * This is the format `GetRegion()` of DHMs returns.
+         */
+        static ElevationBuf FromPixelBuf(const PixelBuf &pixels) {
+            ElevationBuf result(pixels.GetWidth(), pixels.GetHeight());
+            const unsigned int *src = pixels.GetRawData();
+            T *dest = result.GetRawData();
+            int count = result.m_width * result.m_height;
+            for (int i = 0; i < count; i++) {
+                dest[i] = static_cast<T>(static_cast<int>(src[i]));
+            }
+            return result;
+        }
+
+        inline T *GetRawData() { return m_data.get(); }
+        inline const T *GetRawData() const { return m_data.get(); }
+        inline int GetWidth() const { return m_width; }
+        inline int GetHeight() const { return m_height; }
+        inline T *GetValuePtr(int x, int y) {
+            return &m_data.get()[x + y*m_width];
+        }
+        inline const T *GetValuePtr(int x, int y) const {
+            return &m_data.get()[x + y*m_width];
+        }
+        inline T GetValue(int x, int y) const {
+            return m_data.get()[x + y*m_width];
+        }
+
+        /** Copy `source` into this buffer, its bottom-left corner at `pos`.
+         *
+         * Parts outside of this buffer are clipped, cf. `PixelBuf::Insert`.
+         */
+        void Insert(const PixelBufCoord &pos, const ElevationBuf &source) {
+            int x_dst_start = std::max(pos.x, 0);
+            int y_dst_start = std::max(pos.y, 0);
+            int x_dst_end = std::min(pos.x + source.GetWidth(), m_width);
+            int y_dst_end = std::min(pos.y + source.GetHeight(), m_height);
+            if (x_dst_end <= x_dst_start) {
+                return;
+            }
+            for (int y = y_dst_start; y < y_dst_end; y++) {
+                std::copy(source.GetValuePtr(x_dst_start - pos.x, y - pos.y),
+                          source.GetValuePtr(x_dst_end - pos.x, y - pos.y),
+                          GetValuePtr(x_dst_start, y));
+            }
+        }
+    private:
+        std::shared_ptr<T> m_data;
+        int m_width;
+        int m_height;
+};
+
+typedef ElevationBuf<int16_t> ElevationBuf16;
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef ODM__LRUCACHE_H
+#define ODM__LRUCACHE_H
+
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include "util.h"
+
+
+/** Usage counters of a cache.
+ *
+ * Snapshots of these values are returned by the `GetStats()` method of
+ * caches, the counters are not updated after the snapshot was taken.
+ */
+struct EXPORT CacheStats {
+    CacheStats()
+        : hits(0), misses(0), insertions(0), evictions(0),
+          entries(0), bytes(0), budget(0)
+    {};
+
+    /** Number of successful lookups. */
+    uint64_t hits;
+    /** Number of lookups that did not find a cache entry. */
+    uint64_t misses;
+    /** Number of entries added to the cache. */
+    uint64_t insertions;
+    /** Number of entries dropped to stay within the memory budget. */
+    uint64_t evictions;
+    /** Number of entries currently held. */
+    uint64_t entries;
+    /** Memory currently used by all entries, in bytes. */
+    uint64_t bytes;
+    /** Maximum memory the cache may occupy, in bytes. */
+    uint64_t budget;
+};
+
+
+/** A thread-safe, memory-bounded least-recently-used cache.
+ *
+ * Values are stored together with their cost in bytes, as given to `Put()`.
+ * Whenever the sum of all costs exceeds the budget, the least recently used
+ * entries are dropped until the cache fits again. A `Get()` hit marks the
+ * entry as most recently used.
+ *
+ * `Key` must be copyable and support `operator<`, `Value` must be copyable.
+ * Values are returned by copy, so cheap-to-copy handles (such as `PixelBuf`
+ * or `std::shared_ptr`) should be used for large data.
+ *
+ * @locking All public methods lock `m_mutex`. No outside code is called
+ * with the lock held, except for copy constructors and destructors of `Key`
+ * and `Value`.
+ */
+template <typename Key, typename Value>
+class LRUCache {
+public:
+    /** Create a cache that holds at most `budget_bytes` worth of values. */
+    explicit LRUCache(size_t budget_bytes)
+        : m_mutex(), m_lru(), m_index(), m_stats()
+    {
+        m_stats.budget = budget_bytes;
+    }
+
+    /** Look up `key` and store the cached value in `result`.
+     *
+     * Returns `false` and leaves `result` untouched if `key` is not cached.
+     */
+    bool Get(const Key &key, Value *result) {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            ++m_stats.misses;
+            return false;
+        }
+        // Move the entry to the front of the LRU list.
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        ++m_stats.hits;
+        *result = it->second->value;
+        return true;
+    }
+
+    /** Return `true` if `key` is cached.
+     *
+     * This neither updates the usage order nor the hit/miss counters.
+     */
+    bool Contains(const Key &key) const {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return m_index.find(key) != m_index.end();
+    }
+
+    /** Add or replace the value stored for `key`.
+     *
+     * `cost` is the memory used by `value` in bytes. Values larger than the
+     * whole budget are not cached at all.
+     *
+     * If `evicted_keys` is given, the keys of all entries dropped to stay
+     * within the budget are appended to it.
+     */
+    void Put(const Key &key, const Value &value, size_t cost,
+             std::vector<Key> *evicted_keys = nullptr)
+    {
+        // Destroy evicted values after releasing the lock.
+        std::list<Entry> evicted;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            auto it = m_index.find(key);
+            if (it != m_index.end()) {
+                m_stats.bytes -= it->second->cost;
+                evicted.splice(evicted.end(), m_lru, it->second);
+                m_index.erase(it);
+                --m_stats.entries;
+            }
+            if (cost > m_stats.budget) {
+                return;
+            }
+            m_lru.push_front(Entry(key, value, cost));
+            m_index.insert(std::make_pair(key, m_lru.begin()));
+            m_stats.bytes += cost;
+            ++m_stats.entries;
+            ++m_stats.insertions;
+            EvictToBudget(&evicted);
+        }
+        if (evicted_keys) {
+            for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+                if (!(it->key < key) && !(key < it->key)) {
+                    continue;  // Replaced, not evicted.
+                }
+                evicted_keys->push_back(it->key);
+            }
+        }
+    }
+
+    /** Remove the entry for `key`, return `false` if there was none. */
+    bool Erase(const Key &key) {
+        std::list<Entry> evicted;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            auto it = m_index.find(key);
+            if (it == m_index.end()) {
+                return false;
+            }
+            m_stats.bytes -= it->second->cost;
+            --m_stats.entries;
+            evicted.splice(evicted.end(), m_lru, it->second);
+            m_index.erase(it);
+        }
+        return true;
+    }
+
+    /** Remove all entries for which `pred(key)` returns `true`. */
+    template <typename Predicate>
+    void EraseIf(Predicate pred) {
+        std::list<Entry> evicted;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            auto it = m_lru.begin();
+            while (it != m_lru.end()) {
+                auto cur = it++;
+                if (pred(cur->key)) {
+                    m_stats.bytes -= cur->cost;
+                    --m_stats.entries;
+                    m_index.erase(cur->key);
+                    evicted.splice(evicted.end(), m_lru, cur);
+                }
+            }
+        }
+    }
+
+    /** Remove all entries. Counters other than size and bytes are kept. */
+    void Clear() {
+        std::list<Entry> evicted;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            evicted.swap(m_lru);
+            m_index.clear();
+            m_stats.entries = 0;
+            m_stats.bytes = 0;
+        }
+    }
+
+    /** Get the memory budget in bytes. */
+    size_t GetBudget() const {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return static_cast<size_t>(m_stats.budget);
+    }
+
+    /** Change the memory budget, evicting entries if necessary.
+     *
+     * If `evicted_keys` is given, the keys of all dropped entries are
+     * appended to it.
+     */
+    void SetBudget(size_t budget_bytes,
+                   std::vector<Key> *evicted_keys = nullptr)
+    {
+        std::list<Entry> evicted;
+        {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_stats.budget = budget_bytes;
+            EvictToBudget(&evicted);
+        }
+        if (evicted_keys) {
+            for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+                evicted_keys->push_back(it->key);
+            }
+        }
+    }
+
+    /** Get a snapshot of the usage counters. */
+    CacheStats GetStats() const {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return m_stats;
+    }
+
+    /** Reset hit/miss/insertion/eviction counters to zero. */
+    void ResetStats() {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_stats.hits = 0;
+        m_stats.misses = 0;
+        m_stats.insertions = 0;
+        m_stats.evictions = 0;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LRUCache);
+
+    struct Entry {
+        Entry(const Key &key_, const Value &value_, size_t cost_)
+            : key(key_), value(value_), cost(cost_)
+        {};
+        Key key;
+        Value value;
+        size_t cost;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::map<Key, typename EntryList::iterator> EntryIndex;
+
+    /** Drop LRU entries into `evicted` until we are within budget.
+     *
+     * Must be called with `m_mutex` held.
+     */
+    void EvictToBudget(EntryList *evicted) {
+        while (m_stats.bytes > m_stats.budget && !m_lru.empty()) {
+            auto last = --m_lru.end();
+            m_stats.bytes -= last->cost;
+            --m_stats.entries;
+            ++m_stats.evictions;
+            m_index.erase(last->key);
+            evicted->splice(evicted->end(), m_lru, last);
+        }
+    }
+
+    mutable boost::mutex m_mutex;
+    EntryList m_lru;
+    EntryIndex m_index;
+    CacheStats m_stats;
+};
+
+#endif
@@ -2,6 +2,50 @@
 #define ODM__MAP_DHM_ADVANCED_H
 
 #include "rastermap.h"
+#include "elevationbuf.h"
+
+/** Implementations of the DHM coloring kernels below. */
+enum DHMKernelImpl {
+    /** The original per-pixel code, kept for comparison. */
+    DHM_KERNEL_REFERENCE = 0,
+    /** Row sweep using SSE2 and lookup tables. */
+    DHM_KERNEL_VECTORIZED,
+    /** Like `DHM_KERNEL_VECTORIZED`, large regions are split into bands
+     * which are processed on the `ThreadPool`. */
+    DHM_KERNEL_THREADED,
+    DHM_KERNEL_BEST = DHM_KERNEL_THREADED
+};
+
+/** Color the gradient map of a region.
+ *
+ * `heights` must extend one pixel beyond the region on every side. The
+ * result is two pixels narrower and lower than `heights`. All
+ * implementations produce identical pixels.
+ */
+EXPORT PixelBuf ColorGradient(const ElevationBuf16 &heights,
+                              DHMKernelImpl impl = DHM_KERNEL_BEST);
+
+/** Color the steepness map of a region.
+ *
+ * `heights` must extend one pixel beyond the region on every side, `mpp`
+ * is the pixel size in meters. The result is two pixels narrower and lower
+ * than `heights`.
+ */
+EXPORT PixelBuf ColorSteepness(const ElevationBuf16 &heights, double mpp,
+                               DHMKernelImpl impl = DHM_KERNEL_BEST);
+
+/** Shade the relief of a region in gray, lit from `azimuth` and `altitude`.
+ *
+ * Slopes are computed with Horn's 3x3 kernel. `heights` must extend one
+ * pixel beyond the region on every side, `mpp` is the pixel size in meters.
+ * The azimuth is in degrees clockwise from north, the altitude in degrees
+ * above the horizon. The result is two pixels narrower and lower than
+ * `heights`. The reference implementation computes in double precision,
+ * so results may differ from the others by one in each color component.
+ */
+EXPORT PixelBuf ColorHillshade(const ElevationBuf16 &heights, double mpp,
+                               double azimuth, double altitude,
+                               DHMKernelImpl impl = DHM_KERNEL_BEST);
 
 /** Construct a 3D gradient map from a DEM
  *
@@ -35,6 +79,9 @@ class EXPORT GradientMap : public RasterMap {
         virtual bool SupportsConcurrentGetRegion() const {
             return m_orig_map->SupportsConcurrentGetRegion();
         }
+        virtual bool SupportsPersistentCache() const { return true; }
+        /** The DHM's identity and the version of the coloring. */
+        virtual std::wstring GetCacheIdentity() const;
     private:
         const std::shared_ptr<RasterMap> m_orig_map;
 };
@@ -71,7 +118,56 @@ class EXPORT SteepnessMap : public RasterMap {
         virtual bool SupportsConcurrentGetRegion() const {
             return m_orig_map->SupportsConcurrentGetRegion();
         }
+        virtual bool SupportsPersistentCache() const { return true; }
+        /** The DHM's identity and the version of the coloring. */
+        virtual std::wstring GetCacheIdentity() const;
+    private:
+        const std::shared_ptr<RasterMap> m_orig_map;
+};
+
+/** Construct a shaded relief map from a DEM
+ *
+ * Computing it is cheap, tiles are not kept in the persistent cache.
+ *
+ * @locking Although concurrent `GetRegion` calls are enabled, no locking is
+ * performed. Requests are passed to the DEM and the results are transformed
+ * into a color image without modification of per-instance state.
+ */
+class EXPORT HillshadeMap : public RasterMap {
+    public:
+        /** Light comes from `azimuth` degrees clockwise from north,
+         * `altitude` degrees above the horizon. */
+        explicit HillshadeMap(const std::shared_ptr<RasterMap> &orig_map,
+                              double azimuth = 315, double altitude = 45);
+        virtual GeoDrawable::DrawableType GetType() const;
+        virtual unsigned int GetWidth() const;
+        virtual unsigned int GetHeight() const;
+        virtual MapPixelDeltaInt GetSize() const;
+        virtual PixelBuf
+            GetRegion(const MapPixelCoordInt &pos,
+                      const MapPixelDeltaInt &size) const;
+
+        virtual Projection GetProj() const;
+        virtual bool
+        PixelToLatLon(const MapPixelCoord &pos, LatLon *result) const;
+        virtual bool
+        LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const;
+
+        virtual const std::wstring &GetFname() const;
+        virtual const std::wstring &GetTitle() const;
+        virtual const std::wstring &GetDescription() const;
+        virtual ODMPixelFormat GetPixelFormat() const {
+            return ODM_PIX_RGBX4;
+        }
+        virtual bool SupportsConcurrentGetRegion() const {
+            return m_orig_map->SupportsConcurrentGetRegion();
+        }
+
+        double GetAzimuth() const { return m_azimuth; }
+        double GetAltitude() const { return m_altitude; }
     private:
         const std::shared_ptr<RasterMap> m_orig_map;
+        const double m_azimuth;
+        const double m_altitude;
 };
 #endif
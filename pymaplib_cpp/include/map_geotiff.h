@@ -3,21 +3,24 @@
 
 #include "rastermap.h"
 #include "projection.h"
-
-#include <boost/thread/mutex.hpp>
+#include "lrucache.h"
 
 /** A map in TIFF file format
  *
  * Can contain either normal topographic data or DEM data.
  *
- * @locking Concurrent `GetRegion` calls are enabled. Data access in
- * `GetRegion` is protected by a per-instance mutex `m_getregion_mutex`.
- * No external calls are made with this mutex held. Internally, the
- * `CSVFileOverride` mutex may be taken with `m_getregion_mutex` held.
- * Deadlocks are prevented by strict ordering `getregion > csv`.
+ * @locking Concurrent `GetRegion` calls are enabled. Each call reads via
+ * a separate libtiff handle, borrowed from a per-image `TiffHandlePool`.
+ * The pool's mutex is only held to hand out and return handles. No
+ * external calls are made with it held. The strip cache does its own
+ * locking.
  */
 class EXPORT TiffMap : public RasterMap {
     public:
+        /** Memory budget of the strip cache shared by all TIFF maps. Enough
+         * for a few rows of display tiles over a scan 10000 pixels wide. */
+        static const size_t STRIP_CACHE_BUDGET = 128 * 1024 * 1024;
+
         explicit TiffMap(const wchar_t *fname);
         virtual GeoDrawable::DrawableType GetType() const;
         virtual unsigned int GetWidth() const;
@@ -27,6 +30,22 @@ class EXPORT TiffMap : public RasterMap {
             GetRegion(const MapPixelCoordInt &pos,
                       const MapPixelDeltaInt &size) const;
 
+        /** Get a reduced-resolution region from the TIFF's overviews.
+         *
+         * Internal overviews are found in the main IFD chain (as written
+         * by `gdaladdo`) and in SubIFDs of the main image. The closest
+         * overview not exceeding `reduction` is used and scaled down
+         * further if necessary.
+         */
+        virtual PixelBuf
+            GetRegionReduced(const MapPixelCoordInt &pos,
+                             const MapPixelDeltaInt &size,
+                             unsigned int reduction) const;
+        virtual unsigned int
+            GetNativeReduction(unsigned int reduction) const;
+        virtual ElevationBuf16
+            GetElevationRegion(const MapPixelCoordInt &pos,
+                               const MapPixelDeltaInt &size) const;
 
         virtual Projection GetProj() const;
         virtual bool
@@ -41,10 +60,28 @@ class EXPORT TiffMap : public RasterMap {
             return ODM_PIX_RGBX4;
         }
         virtual bool SupportsConcurrentGetRegion() const { return true; }
+
+        /** Usage counters of the decoded strip cache.
+         *
+         * Stripped (non-tiled) TIFFs can only be decoded in full-width
+         * strips. These are cached, so that horizontally adjacent regions
+         * don't decode the same strips again. Tiled TIFFs don't use the
+         * cache. It is shared by all `TiffMap`s, the counters and the
+         * budget are process-wide.
+         */
+        static CacheStats GetStripCacheStats();
+        static void SetStripCacheBudget(size_t budget_bytes);
+
+        /** Read common tiled layouts via `TIFFReadTile()` (the default).
+         *
+         * If disabled, all TIFFs are decoded by TIFFRGBAImage, whose output
+         * the direct reads reproduce exactly. The setting is process-wide,
+         * it exists to compare both paths in tests.
+         */
+        static void SetDirectTileReads(bool enabled);
     private:
         DISALLOW_COPY_AND_ASSIGN(TiffMap);
 
-        mutable boost::mutex m_getregion_mutex;
         const std::shared_ptr<class GeoTiff> m_geotiff;
         Projection m_proj;
 
@@ -4,15 +4,42 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <cstdint>
 
-#include <boost/thread/mutex.hpp>
-
 #include "odm_config.h"
 #include "pixelbuf.h"
 #include "rastermap.h"
+#include "mappedfile.h"
+#include "lrucache.h"
+
+/** Implementations of the GVG/GMP decryption, see `GVGDecrypt()`. */
+enum GVGDecryptImpl {
+    /** Byte by byte, the reference implementation. */
+    GVG_DECRYPT_SCALAR = 0,
+    /** Eight bytes (one full salt period) per iteration. */
+    GVG_DECRYPT_UNROLLED,
+    /** 32 bytes per iteration via AVX2 gathers. */
+    GVG_DECRYPT_AVX2,
+    /** The fastest implementation supported by the CPU. */
+    GVG_DECRYPT_BEST,
+};
+
+/** Return `true` if `impl` is compiled in and supported by the CPU. */
+EXPORT bool GVGDecryptSupported(GVGDecryptImpl impl);
+
+/** Decrypt `size` bytes of GVG/GMP data from `src` into `dest`.
+ *
+ * `salt` selects the key for the first byte, it is the tile length for GMP
+ * tiles and 0 for GVG files. `src` and `dest` may be the same buffer, but
+ * must not overlap otherwise. All implementations produce identical
+ * results; unsupported ones throw `std::runtime_error`.
+ */
+EXPORT void GVGDecrypt(const unsigned char *src, unsigned char *dest,
+                       size_t size, unsigned long long int salt,
+                       GVGDecryptImpl impl = GVG_DECRYPT_BEST);
 
 struct EXPORT GVGHeader {
     float FileVersion;
@@ -153,6 +180,9 @@ struct GMPTileOffset {
 class EXPORT GMPImage {
     public:
         GMPImage(const std::wstring &fname, int index, int64_t foffset);
+        /** Read image `index` at `foffset` of an already opened file. */
+        GMPImage(const std::shared_ptr<MappedFile> &file,
+                 int index, int64_t foffset);
         GMPImage(const GMPImage &other);
         friend void swap(GMPImage &lhs, GMPImage &rhs) {
             using std::swap;  // Enable ADL.
@@ -176,9 +206,24 @@ class EXPORT GMPImage {
             return *this;
         }
 
-        PixelBuf LoadTile(long tx, long ty) const;
+        /** Decode a tile, scaled down by `reduction` (1, 2, 4 or 8).
+         *
+         * The reduction is applied while decoding the JPEG data. The
+         * result is `TileWidth() / reduction` by `TileHeight() / reduction`
+         * pixels, rounded up.
+         */
+        PixelBuf LoadTile(long tx, long ty, unsigned int reduction = 1) const;
         std::string LoadCompressedTile(long tx, long ty) const;
 
+        /** Decrypt the compressed data of a tile into `buffer`.
+         *
+         * The memory of `buffer` is reused, so reading many tiles into the
+         * same buffer does not allocate. Returns `false` (and leaves
+         * `buffer` untouched) for tiles outside of the image.
+         */
+        bool ReadCompressedTile(long tx, long ty,
+                                std::vector<unsigned char> *buffer) const;
+
         std::wstring DebugData() const;
         int AnnouncedWidth() const;
         int AnnouncedHeight() const;
@@ -191,8 +236,12 @@ class EXPORT GMPImage {
         int BitsPerPixel() const;
         int64_t NextImageOffset() const;
 
+        const MappedFile &GetFile() const { return *m_file; };
+        int64_t GetFileOffset() const { return m_foffset; };
+
     private:
-        mutable std::ifstream m_file;
+        /** Shared by copies, reads don't depend on a file position. */
+        std::shared_ptr<MappedFile> m_file;
         std::wstring m_fname;
         int m_findex;
         int64_t m_foffset;
@@ -207,6 +256,8 @@ class EXPORT GMPImage {
         bool m_topdown;
 
         void Init();
+        /** Map the encrypted data of a tile, or return an empty view. */
+        MappedFile::View MapTile(long tx, long ty) const;
         bool IsSupportedBPP(unsigned int bpp) const {
             return bpp == 1 || bpp == 4 || bpp == 8 || bpp == 24 || bpp == 32;
         }
@@ -216,17 +267,58 @@ EXPORT GMPImage MakeGmpImage(const std::wstring& path,
                              unsigned int gmp_image_idx);
 EXPORT GMPImage MakeBestResolutionGmpImage(const GVGFile &gvgfile);
 
+/** Decoded GMP tiles of several maps, in one memory-bounded LRU cache.
+ *
+ * Tiles are keyed by (map, tx, ty, reduction). Maps are identified by
+ * serial numbers rather than by address, so a new map never sees the
+ * tiles of a deleted one; maps drop their tiles with `EraseMap()`.
+ *
+ * @locking Thread-safe, `decode` is called without holding a lock.
+ * Concurrent misses for the same tile may decode it more than once.
+ */
+class EXPORT GMPTileCache {
+    public:
+        explicit GMPTileCache(size_t budget_bytes) : m_tiles(budget_bytes) {};
+
+        /** Return a cached tile, or `decode()` and cache it. */
+        PixelBuf Get(unsigned long long map_id,
+                     long tx, long ty, unsigned int reduction,
+                     const std::function<PixelBuf()> &decode);
+        /** Drop all tiles of a map. */
+        void EraseMap(unsigned long long map_id);
+
+        CacheStats GetStats() const { return m_tiles.GetStats(); };
+        void SetBudget(size_t budget_bytes) {
+            m_tiles.SetBudget(budget_bytes);
+        };
+    private:
+        DISALLOW_COPY_AND_ASSIGN(GMPTileCache);
+
+        typedef std::tuple<unsigned long long, long, long, unsigned int> Key;
+        LRUCache<Key, PixelBuf> m_tiles;
+};
+
 /** A map in GVG file format
  *
  * GVG files can in principle contain both normal topographic data and DEM
  * data. DEM's are currently not supported, though.
  *
- * @locking Concurrent `GetRegion` calls are enabled. Data access in
- * `GetRegion` is protected by a per-instance mutex `m_getregion_mutex`.
- * No external calls are made with this mutex held.
+ * Decoded GMP tiles are kept in a `GMPTileCache` shared by all maps. GMP
+ * tiles usually don't line up with the tiles requested by the display, so
+ * neighboring requests would otherwise decode the tiles along their border
+ * twice.
+ *
+ * @locking Concurrent `GetRegion` calls are enabled. `GMPImage` reads tiles
+ * at explicit file offsets and keeps no other mutable state, the tile cache
+ * does its own locking. The GMP tiles covered by one `GetRegion` call are
+ * decoded in parallel on the process-wide `ThreadPool`. Concurrent misses
+ * for the same tile may decode it more than once.
  */
 class EXPORT GVGMap : public RasterMap {
     public:
+        /** Memory budget of the GMP tile cache shared by all GVG maps. */
+        static const size_t TILE_CACHE_BUDGET = 64 * 1024 * 1024;
+
         explicit GVGMap(const std::wstring &fname);
         virtual ~GVGMap();
 
@@ -243,6 +335,18 @@ class EXPORT GVGMap : public RasterMap {
         GetRegion(const MapPixelCoordInt &pos,
                   const MapPixelDeltaInt &size) const;
 
+        /** Get a specific area of the map at reduced resolution.
+         *
+         * Reductions up to 8 are performed by the JPEG decoder, cf.
+         * `GMPImage::LoadTile()`, larger ones are shrunk from there.
+         */
+        virtual PixelBuf
+        GetRegionReduced(const MapPixelCoordInt &pos,
+                         const MapPixelDeltaInt &size,
+                         unsigned int reduction) const;
+        virtual unsigned int
+        GetNativeReduction(unsigned int reduction) const;
+
         virtual Projection GetProj() const;
         virtual const std::wstring &GetFname() const;
         virtual const std::wstring &GetTitle() const;
@@ -264,6 +368,9 @@ class EXPORT GVGMap : public RasterMap {
 
         virtual ODMPixelFormat GetPixelFormat() const;
         virtual bool SupportsConcurrentGetRegion() const { return true; }
+        virtual bool SupportsPersistentCache() const { return true; }
+        /** Identify the GMP file holding the image data. */
+        virtual std::wstring GetCacheIdentity() const;
 
         virtual bool
         PixelToLatLon(const MapPixelCoord &pos, LatLon *result) const;
@@ -274,11 +381,18 @@ class EXPORT GVGMap : public RasterMap {
         const GMPImage &GetGMPImage() const { return m_image; };
         const GVGHeader *GetGVGHeader() const { return m_gvgheader; };
         const GVGMapInfo *GetGVGMapInfo() const { return m_gvgmapinfo; };
+
+        /** Usage counters of the decoded GMP tile cache.
+         *
+         * Every hit is a GMP tile decode that was avoided. The cache is
+         * shared by all `GVGMap`s, the counters and the budget are
+         * process-wide.
+         */
+        static CacheStats GetTileCacheStats();
+        static void SetTileCacheBudget(size_t budget_bytes);
     private:
         DISALLOW_COPY_AND_ASSIGN(GVGMap);
 
-        mutable boost::mutex m_getregion_mutex;
-
         GVGFile m_gvgfile;
         GMPImage m_image;
         const GVGHeader* m_gvgheader;
@@ -296,7 +410,23 @@ class EXPORT GVGMap : public RasterMap {
         std::string m_proj_str;
         Projection m_proj;
 
+        /** Identifies our tiles in the shared `GMPTileCache`. */
+        const unsigned long long m_tile_cache_id;
+
         std::string MakeProjString() const;
+
+        /** Get a decoded GMP tile, from the tile cache if possible. */
+        PixelBuf LoadGMPTile(long tx, long ty, unsigned int reduction) const;
+
+        /** Decode the tiles covering a region at `reduction`.
+         *
+         * `pos` and `size` are in full-resolution pixels and must be
+         * divisible by `reduction`. Areas outside of the map are left
+         * blank.
+         */
+        PixelBuf LoadRegion(const MapPixelCoordInt &pos,
+                            const MapPixelDeltaInt &size,
+                            unsigned int reduction) const;
 };
 
 #endif
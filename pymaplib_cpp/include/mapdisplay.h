@@ -3,6 +3,14 @@
 
 #include <list>
 #include <map>
+#include <deque>
+#include <vector>
+#include <cstdint>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/chrono.hpp>
 
 #include "util.h"
 #include "coordinates.h"
@@ -177,6 +185,76 @@ class EXPORT MapViewModel {
 };
 
 
+/** Counters of a `RepaintCoalescer`.
+ *
+ * Snapshots of these values are returned by `GetStats()`, the counters are
+ * not updated after the snapshot was taken.
+ */
+struct EXPORT RepaintStats {
+    RepaintStats()
+        : repaints(0), completions(0), last_absorbed(0), max_absorbed(0)
+    {};
+
+    /** Number of repaints requested from the display. */
+    uint64_t repaints;
+    /** Number of tile completions reported. */
+    uint64_t completions;
+    /** Tile completions covered by the most recent repaint. */
+    unsigned int last_absorbed;
+    /** Maximum number of tile completions covered by one repaint. */
+    unsigned int max_absorbed;
+};
+
+/** Merge bursts of repaint requests from background tile loads.
+ *
+ * Tile loads tend to complete in bursts. Repainting the display for each
+ * one redraws all display orders over and over again. Instead, completed
+ * loads are reported via `TileLoaded()`, and a background thread calls
+ * `Display::ForceRepaint()` at most once per interval, covering all
+ * completions since the previous repaint. If the display was idle for
+ * longer than the interval, the repaint happens immediately.
+ *
+ * @locking `m_mutex` protects all members except for `m_display` and
+ * `m_thread`. `ForceRepaint()` is called without the lock held.
+ */
+class EXPORT RepaintCoalescer {
+public:
+    /** Default minimum time between repaints, about one frame at 60 Hz. */
+    static const unsigned int DEFAULT_INTERVAL_MSECS = 16;
+
+    explicit RepaintCoalescer(
+            const std::weak_ptr<class Display> &display,
+            unsigned int interval_msecs = DEFAULT_INTERVAL_MSECS);
+    ~RepaintCoalescer();
+
+    /** Report a completed tile load. May be called from any thread. */
+    void TileLoaded();
+
+    unsigned int GetInterval() const;
+    void SetInterval(unsigned int interval_msecs);
+
+    RepaintStats GetStats() const;
+    void ResetStats();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RepaintCoalescer);
+
+    void threadproc();
+
+    const std::weak_ptr<class Display> m_display;
+
+    mutable boost::mutex m_mutex;
+    boost::condition_variable m_cond;
+    unsigned int m_interval_msecs;
+    unsigned int m_completions;
+    boost::chrono::steady_clock::time_point m_last_repaint;
+    RepaintStats m_stats;
+    bool m_exitthread;
+
+    std::unique_ptr<boost::thread> m_thread;
+};
+
+
 /** A view object responsible for painting the current data model. */
 class EXPORT MapView {
 DISALLOW_COPY_AND_ASSIGN(MapView);
@@ -193,16 +271,50 @@ public:
     /** Schedule a full repaint of the display. */
     void ForceFullRepaint();
 
+    /** Enable or disable loading tiles ahead of the current navigation.
+     *
+     * When enabled (the default), `Paint()` tracks how center and zoom
+     * change over time. Tiles just beyond the display in the direction of
+     * travel are then loaded in the background, as far as the drawable
+     * supports concurrent `GetRegion()` calls.
+     */
+    void SetPrefetchEnabled(bool enabled);
+    bool GetPrefetchEnabled() const { return m_prefetch_enabled; }
+
+    /** Set the minimum time between repaints caused by background loads.
+     *
+     * Tiles loaded within one interval are shown with a single repaint.
+     */
+    void SetRepaintInterval(unsigned int interval_msecs);
+    unsigned int GetRepaintInterval() const;
+
+    /** Get statistics on repaints caused by background tile loads. */
+    RepaintStats GetRepaintStats() const;
+
 private:
     static const int TILE_SIZE = 512;
 
+    /** A snapshot of the view position, recorded on each full repaint. */
+    struct MotionSample {
+        double time;
+        BaseMapCoord center;
+        double zoom;
+    };
+
     const std::shared_ptr<class Display> m_display;
+    // Shared with background tile loads, which may outlive us.
+    const std::shared_ptr<RepaintCoalescer> m_repaint;
 
     bool m_need_full_repaint;
 
     std::map<const TileCode, std::shared_ptr<class PixelPromise>
             > m_old_promise_cache, m_new_promise_cache;
 
+    bool m_prefetch_enabled;
+    std::deque<MotionSample> m_motion;
+    const GeoDrawable *m_motion_basemap;
+    TilePrefetcher m_prefetcher;
+
 
     // IMPLEMENTATION FUNCTIONS
     ///////////////////////////
@@ -258,6 +370,51 @@ private:
         const MapPixelDelta &half_disp_size,
         double transparency);
 
+    /** Record the current view position and prefetch tiles accordingly.
+     *
+     * The view motion over the last few repaints is extrapolated to predict
+     * where the display will be shortly. Tiles needed there but not yet
+     * shown are handed to `m_prefetcher`.
+     */
+    void SchedulePrefetch(const MapViewModel &mdm,
+                          const MapPixelDeltaInt &tile_size);
+
+    /** Find tiles needed for showing `center` at `zoom` but not yet shown.
+     *
+     * Only layers drawn with `PaintLayerTiled` and supporting concurrent
+     * `GetRegion()` calls are considered. Tiles closer to the current
+     * display are returned first.
+     */
+    void CollectPrefetchTiles(const MapViewModel &mdm,
+                              const BaseMapCoord &center, double zoom,
+                              const MapPixelDeltaInt &tile_size,
+                              std::vector<TileCode> *tiles);
+
+    /** Choose the tiles and level of detail for drawing a tiled map layer.
+     *
+     * The display area between `base_tl` and `base_br` is mapped onto
+     * `map` via `CalcOverlayRect`. When zoomed out, several map pixels end
+     * up on one display pixel, so tiles are requested at reduced
+     * resolution via `GetRegionReduced()`. The reduction is the largest
+     * power of two not exceeding the number of map pixels per display
+     * pixel.
+     *
+     * Tiles cover `tile_size * reduction` map pixels each; that footprint
+     * is returned in `tile_footprint`, the tile range in `tile_tl` and
+     * `tile_br`. If more than `MAX_TILES` tiles would be necessary, the
+     * reduction is increased further.
+     */
+    bool CalcLayerTiling(
+        const MapViewModel &mdm,
+        const std::shared_ptr<GeoDrawable> &map,
+        const MapPixelCoordInt &base_tl,
+        const MapPixelCoordInt &base_br,
+        const MapPixelDeltaInt &tile_size,
+        MapPixelCoordInt *tile_tl,
+        MapPixelCoordInt *tile_br,
+        MapPixelDeltaInt *tile_footprint,
+        unsigned int *reduction);
+
     /** Get the map region of an overlay map required to fill the display area.
      *
      * Overlays may have any spatial relation to the base map, they can be
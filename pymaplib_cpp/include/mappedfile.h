@@ -0,0 +1,84 @@
+#ifndef ODM__MAPPEDFILE_H
+#define ODM__MAPPEDFILE_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "util.h"
+
+/** Read-only, memory-mapped access to files of arbitrary size.
+ *
+ * Mapping multi-GB files as a whole would exhaust the address space of
+ * 32 bit processes. Instead, files are mapped in windows of `WINDOW_SIZE`
+ * bytes. The most recently used windows of all `MappedFile`s are kept
+ * mapped, up to a process-wide budget; the others are unmapped as soon as
+ * they go out of use. Ranges crossing a window boundary get a window of
+ * their own.
+ *
+ * Data is accessed via `View` objects, which keep their window mapped for
+ * as long as they exist, regardless of the budget. Reading from a `View`
+ * involves no copies, system calls, or locking.
+ *
+ * @locking A process-wide mutex protects the list of mapped windows. It is
+ * only held to look up and map windows, not while data is accessed.
+ */
+class EXPORT MappedFile {
+    public:
+        /** Size of the mapped windows, a multiple of the 64 KiB Windows
+         * allocation granularity. */
+        static const size_t WINDOW_SIZE = 4 * 1024 * 1024;
+        /** Bytes of windows kept mapped while not in use, for all files. */
+        static const size_t DEFAULT_WINDOW_BUDGET = 128 * 1024 * 1024;
+
+        /** A mapped range of the file. Cheap to copy. */
+        class View {
+            public:
+                View() : m_window(), m_data(nullptr), m_size(0) {};
+                const unsigned char *GetData() const { return m_data; };
+                size_t GetSize() const { return m_size; };
+            private:
+                friend class MappedFile;
+                View(const std::shared_ptr<const void> &window,
+                     const unsigned char *data, size_t size)
+                    : m_window(window), m_data(data), m_size(size)
+                {};
+                std::shared_ptr<const void> m_window;
+                const unsigned char *m_data;
+                size_t m_size;
+        };
+
+        explicit MappedFile(const std::wstring &fname);
+        ~MappedFile();
+
+        /** Map `length` bytes at `offset`, throw if beyond the file end. */
+        View Map(int64_t offset, size_t length) const;
+
+        /** Copy `length` bytes at `offset` into `buffer`. */
+        void ReadAt(int64_t offset, void *buffer, size_t length) const;
+
+        int64_t GetSize() const { return m_size; };
+        /** Last write time of the file when it was opened (a `FILETIME`). */
+        uint64_t GetModificationTime() const { return m_mtime; };
+        const std::wstring &GetFname() const { return m_fname; };
+
+        /** Change the process-wide budget, unmapping windows beyond it. */
+        static void SetWindowBudget(size_t budget_bytes);
+        /** Bytes of the windows kept mapped for reuse, for all files.
+         *
+         * Windows that have been evicted but are still held by a `View`
+         * aren't counted.
+         */
+        static size_t GetMappedBytes();
+    private:
+        DISALLOW_COPY_AND_ASSIGN(MappedFile);
+
+        const std::wstring m_fname;
+        void *m_file;
+        void *m_mapping;
+        int64_t m_size;
+        uint64_t m_mtime;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define ODM__MEMJPEG_H
 
 #include <string>
+#include <vector>
 
 #include "odm_config.h"
 #include "pixelbuf.h"
@@ -9,6 +10,27 @@
 // Generate a PixelBuf from an in-memory jpeg ``buf``.
 // If ``swap_rb`` is true, the red and blue channels are swapped.
 // This is usually not needed, however, it is required for GVG maps.
-EXPORT PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb=false);
+// The X channel of the resulting pixels is unspecified.
+//
+// ``reduction`` (1, 2, 4 or 8) scales the image down while decoding, which
+// is much faster than decoding at full size and shrinking afterwards.
+// The result is ``ceil(width / reduction)`` by ``ceil(height / reduction)``.
+EXPORT PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb=false,
+                                unsigned int reduction=1);
+
+// Generate a PixelBuf from the in-memory jpeg at ``data`` of ``size`` bytes.
+EXPORT PixelBuf decompress_jpeg(const unsigned char *data, size_t size,
+                                bool swap_rb=false, unsigned int reduction=1);
+
+// Swap the red and blue channels of the in-memory jpeg at ``data`` without
+// decoding it to pixels, and store the new jpeg in ``result``.
+//
+// The DCT coefficients of the components are exchanged as they are, so the
+// image quality is fully preserved. Only the Huffman coding is redone.
+// This works for jpegs coded in RGB (i.e. without YCbCr color transform)
+// with three components and without subsampling. For other jpegs,
+// ``false`` is returned and ``result`` is left untouched.
+EXPORT bool jpeg_swap_rb_lossless(const unsigned char *data, size_t size,
+                                  std::vector<unsigned char> *result);
 
 #endif
@@ -25,6 +25,12 @@
 // ahead and suppress the warning.
 #pragma warning( disable : 4251 )
 
+// AVX2 intrinsics are available from Visual Studio 2012 on. Code using them
+// has to check `CPUSupportsAVX2()` before running them.
+#if _MSC_VER >= 1700
+#  define ODM_HAVE_AVX2_INTRINSICS
+#endif
+
 #elif defined(__GNUC__)
 #  error missing implementation for gcc
 #else
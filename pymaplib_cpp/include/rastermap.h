@@ -4,6 +4,7 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <functional>
 
 #include <boost/optional.hpp>
 
@@ -12,6 +13,7 @@
 #include "coordinates.h"
 #include "projection.h"
 #include "pixelbuf.h"
+#include "elevationbuf.h"
 
 
 /* Georeferenced pixels.
@@ -56,6 +58,7 @@ class EXPORT GeoDrawable : public GeoPixels {
             TYPE_GPSTRACK,
             TYPE_GRIDLINES,
             TYPE_POI_DB,
+            TYPE_HILLSHADE_MAP,
             TYPE_ERROR,
         };
         virtual ~GeoDrawable();
@@ -77,6 +80,50 @@ class EXPORT GeoDrawable : public GeoPixels {
         GetRegion(const MapPixelCoordInt &pos,
                   const MapPixelDeltaInt &size) const = 0;
 
+        /** Get a specific area of the map at reduced resolution.
+         *
+         * `pos` and `size` are given in native map pixels, just as for
+         * `GetRegion()`. The result is scaled down by `reduction`, which
+         * must be a power of two. Both `pos` and `size` must be divisible by
+         * `reduction`, the returned PixelBuf has dimensions
+         * `size / reduction`.
+         *
+         * The default implementation reads full-resolution data via
+         * `GetRegion()` and averages blocks of pixels. Subclasses with
+         * cheaper ways to get at reduced data should override this.
+         * Averaging the color channels makes no sense for DHM heights,
+         * so `TYPE_DHM` drawables subsample them instead.
+         */
+        virtual PixelBuf
+        GetRegionReduced(const MapPixelCoordInt &pos,
+                         const MapPixelDeltaInt &size,
+                         unsigned int reduction) const;
+
+        /** Find the reduction natively supported by `GetRegionReduced()`.
+         *
+         * Return the largest power of two not exceeding `reduction` for
+         * which reduced-resolution data is available without scaling down
+         * full-resolution pixels (e.g. from image overviews). The default
+         * implementation returns 1.
+         */
+        virtual unsigned int
+        GetNativeReduction(unsigned int reduction) const { return 1; }
+
+        /** Get the terrain heights of a specific area of a DHM.
+         *
+         * `pos` and `size` work as for `GetRegion()`. Areas outside the
+         * map are filled with zeros. Heights take half the memory of the
+         * packed pixels returned from `GetRegion()` for `TYPE_DHM`
+         * drawables, and can be processed without reinterpretation.
+         *
+         * The default implementation converts the result of `GetRegion()`.
+         * DHMs that can read heights directly should override this.
+         * Drawables of other types throw.
+         */
+        virtual ElevationBuf16
+        GetElevationRegion(const MapPixelCoordInt &pos,
+                           const MapPixelDeltaInt &size) const;
+
         virtual Projection GetProj() const = 0;
         virtual const std::wstring &GetFname() const = 0;
         virtual const std::wstring &GetTitle() const = 0;
@@ -113,6 +160,26 @@ class EXPORT GeoDrawable : public GeoPixels {
          * employ any synchronization.
          */
         virtual bool SupportsConcurrentGetRegion() const { return false; }
+
+        /** Return whether tiles may be kept in the `PersistentTileStore`.
+         *
+         * This is worthwhile for maps that are expensive to decode or
+         * compute. Stored tiles are identified by `GetFname()`, the
+         * modification time of that file, `GetType()`, and
+         * `GetCacheIdentity()`. These must uniquely determine the pixel
+         * data of the map.
+         */
+        virtual bool SupportsPersistentCache() const { return false; }
+
+        /** Identify data files other than `GetFname()` for the tile store.
+         *
+         * Maps reading their pixels from further files must return e.g.
+         * their names, sizes and modification times, so that stored tiles
+         * are invalidated when those files change.
+         */
+        virtual std::wstring GetCacheIdentity() const {
+            return std::wstring();
+        }
 };
 
 /** Helper function for `GetRegion()`
@@ -125,6 +192,48 @@ PixelBuf EXPORT GetRegion_BoundsHelper(const GeoDrawable &drawable,
                                        const MapPixelCoordInt &pos,
                                        const MapPixelDeltaInt &size);
 
+/** Helper function for `GetElevationRegion()`
+ *
+ * The counterpart to `GetRegion_BoundsHelper()`, it may call
+ * `drawable.GetElevationRegion()` again with updated `pos` and `size`.
+ */
+ElevationBuf16 EXPORT
+GetElevationRegion_BoundsHelper(const GeoDrawable &drawable,
+                                const MapPixelCoordInt &pos,
+                                const MapPixelDeltaInt &size);
+
+/** Helper function for `GetRegionReduced()`
+ *
+ * Reads the region in horizontal bands via `get_region()` and scales each
+ * band down to the final resolution using `ShrinkImage()`. This keeps memory
+ * use bounded, no matter how large the region is.
+ *
+ * `get_region()` is called with `pos` and `size` in native map pixels,
+ * aligned to `reduction`. It must return data reduced by
+ * `source_reduction`, which must divide `reduction`.
+ */
+typedef std::function<PixelBuf (const MapPixelCoordInt &pos,
+                                const MapPixelDeltaInt &size)> RegionReader;
+PixelBuf EXPORT GetRegionReduced_ShrinkHelper(
+        const RegionReader &get_region,
+        const MapPixelCoordInt &pos,
+        const MapPixelDeltaInt &size,
+        unsigned int reduction,
+        unsigned int source_reduction = 1);
+
+/** Implement `GetRegionReduced()` by subsampling full-resolution pixels.
+ *
+ * Keeps the top-left pixel of each `reduction` x `reduction` block, which
+ * is suitable for data that can't be averaged, such as DHM heights.
+ * `get_region` is called for bands of the region, as for
+ * `GetRegionReduced_ShrinkHelper()`.
+ */
+PixelBuf EXPORT GetRegionReduced_SubsampleHelper(
+        const RegionReader &get_region,
+        const MapPixelCoordInt &pos,
+        const MapPixelDeltaInt &size,
+        unsigned int reduction);
+
 
 
 class EXPORT RasterMap : public GeoDrawable {
@@ -151,6 +260,21 @@ bool EXPORT
 CalcTerrainInfo(const std::shared_ptr<class RasterMap> &map,
                 const LatLon &pos, TerrainInfo *result);
 
+/** `CalcTerrainInfo()` for many positions at once.
+ *
+ * Positions are grouped by blocks of the DHM, the heights of each block are
+ * fetched only once, and the pixel size is computed once per block instead
+ * of per position. Blocks are processed on the `ThreadPool` if the map
+ * supports concurrent `GetRegion()` calls.
+ *
+ * Returns a flag for every position, nonzero if the corresponding entry in
+ * `results` is valid.
+ */
+std::vector<int> EXPORT
+CalcTerrainInfoBatch(const std::shared_ptr<class RasterMap> &map,
+                     const std::vector<LatLon> &positions,
+                     std::vector<TerrainInfo> *results);
+
 bool EXPORT
 GetMapDistance(const std::shared_ptr<class GeoDrawable> &map,
                const MapPixelCoord &pos,
@@ -17,11 +17,15 @@
 
 #include <functional>
 #include <map>
+#include <set>
+#include <vector>
 #include <memory>
 
 #include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
-#include <external/concurrent_queue.h>
 #include <util.h>
 
 
@@ -34,71 +38,181 @@
 typedef std::function<void()> Task;
 
 
-/** Run functions in a separate thread.
- *
- * For each `ThreadedTaskRunner` instance, a single worker thread is created.
- * Tasks added via the `Enqueue()` method and are executed sequentially in order
- * of addition in this thread.
+/** Bookkeeping data of a task enqueued in a `ThreadPool`. */
+struct PoolTask {
+    PoolTask(const Task &task_, double priority_, unsigned long long seq_,
+             int worker_, void *group_)
+        : task(task_), priority(priority_), seq(seq_), worker(worker_),
+          group(group_)
+    {};
+
+    Task task;
+    /** Tasks with higher priority are run first. */
+    double priority;
+    /** Order of addition, for FIFO behavior among equal priorities. */
+    unsigned long long seq;
+    /** The worker queue holding the task, or -1 if in a serial group. */
+    int worker;
+    /** The serial group of the task, or nullptr. */
+    void *group;
+};
+
+/** Sort `PoolTask`s by decreasing priority, then by order of addition. */
+struct PoolTaskOrder {
+    bool operator()(const std::shared_ptr<PoolTask> &lhs,
+                    const std::shared_ptr<PoolTask> &rhs) const
+    {
+        if (lhs->priority != rhs->priority) {
+            return lhs->priority > rhs->priority;
+        }
+        return lhs->seq < rhs->seq;
+    }
+};
+typedef std::set<std::shared_ptr<PoolTask>, PoolTaskOrder> PoolTaskQueue;
+
+
+/** A reference to a task enqueued in a `ThreadPool`.
  *
- * Removing tasks from the queue is currently not supported.
+ * Handles are cheap to copy. They can be used to remove a task that is not
+ * wanted any more, or to change its priority while it waits to be run.
+ * Both only succeed as long as the task has not started.
  *
- * @locking No manual locking used, everything is encapsulated in
- * `ConcurrentQueue`. The queue never calls outside code with locks held.
+ * Handles must not be used after their `ThreadPool` has been destroyed.
  */
-class ThreadedTaskRunner {
+class TaskHandle {
 public:
-    ThreadedTaskRunner();
-    ~ThreadedTaskRunner();
+    TaskHandle() : m_pool(nullptr), m_task() {};
 
-    /** Add tasks to be executed in the backing thread */
-    void Enqueue(const Task& f);
+    /** Remove the task, return `true` if it will never run. */
+    bool Cancel();
 
-private:
-    DISALLOW_COPY_AND_ASSIGN(ThreadedTaskRunner);
+    /** Change the priority of the task, if it has not yet started.
+     *
+     * Return `true` on success, `false` if the task is already running,
+     * done, or cancelled.
+     */
+    bool SetPriority(double priority);
 
-    void threadproc();
+private:
+    friend class ThreadPool;
+    TaskHandle(class ThreadPool *pool, const std::shared_ptr<PoolTask> &task)
+        : m_pool(pool), m_task(task)
+    {};
 
-    ConcurrentQueue<Task> m_tasks;
-    boost::atomic<bool> m_exitthread;
-    std::unique_ptr<class boost::thread> m_thread;
+    class ThreadPool *m_pool;
+    std::shared_ptr<PoolTask> m_task;
 };
 
-/** A pool of `ThreadedTaskRunner`'s
+
+/** A fixed-size pool of worker threads with work stealing.
  *
- * Tasks are categorized into task groups. For each group, a thread is created.
- * Tasks within each group are executed sequentially in order of addition on
- * the same thread. Tasks from different groups are run in parallel, each on
- * their own thread.
+ * By default, one worker thread is created per hardware thread. Each worker
+ * has its own queue, ordered by task priority. Tasks enqueued from outside
+ * the pool are distributed round-robin among the workers, tasks enqueued
+ * from within a worker go to its own queue. Tasks of equal priority are run
+ * in order of addition.
  *
- * New groups are created simply by enqueueing tasks with a group id never used
- * before.
+ * A worker picks the highest-priority task it can find, stealing it from
+ * other workers if their best task beats its own. Thus, no thread sits idle
+ * while there is work to do, and urgent tasks are not stuck behind a long
+ * queue on a busy worker.
  *
- * Removing tasks from the queue is currently not supported. Removing groups
+ * Tasks may be assigned to a serial group. Tasks within one group never run
+ * concurrently, they are run by priority (then in order of addition), while
+ * still being spread across the pool. This is useful for work on objects
+ * that are not thread-safe (e.g. `GeoDrawable`s not supporting concurrent
+ * `GetRegion()` calls).
+ *
+ * Tasks still pending when the pool is destroyed are discarded. Exceptions
+ * escaping from tasks are reported on `std::cerr` and otherwise ignored;
+ * use `RunAll()` if they are of interest.
+ *
+ * @locking Each worker queue is protected by its own mutex, the serial
+ * groups by `m_groups_mutex`. `m_idle_mutex` is only used for waiting on
+ * new work. `m_groups_mutex` may be held while taking one of the other
+ * locks, to keep the task running a group in line with it. Apart from
+ * that, at most one of these locks is held at any time, and tasks are
+ * never run with any of them held.
  */
-class ThreadedTaskGroupRunner {
+class ThreadPool {
 public:
-    /** Group IDs are currently `void*` pointers. */
+    /** Serial group IDs are `void*` pointers. */
     typedef void* GroupID;
 
-    ThreadedTaskGroupRunner() : m_tasks() {};
+    /** Create a pool with `num_threads` workers.
+     *
+     * If `num_threads` is zero, the number of hardware threads is used.
+     */
+    explicit ThreadPool(unsigned int num_threads = 0);
+    ~ThreadPool();
+
+    /** Get the process-wide pool used for loading and decoding map data. */
+    static ThreadPool &Instance();
+
+    /** Add a task that may run concurrently with any other task. */
+    TaskHandle Enqueue(const Task& f, double priority = 0);
 
-    /** Add a task to be executed
+    /** Add a task that must not run concurrently with others in `group_id`.
      *
-     * Enqueue task `f` to be executed on the thread associated with group
-     * `group_id`.
+     * If `group_id` is a `nullptr`, this is equivalent to `Enqueue(f)`.
      */
-    void Enqueue(GroupID group_id, const Task& f);
+    TaskHandle Enqueue(GroupID group_id, const Task& f, double priority = 0);
 
-private:
-    DISALLOW_COPY_AND_ASSIGN(ThreadedTaskGroupRunner);
+    /** Run all `tasks` and wait for them to finish.
+     *
+     * The tasks are spread across the pool, ahead of all other queued work.
+     * The calling thread runs tasks itself instead of sitting idle, so this
+     * is safe to use from within pool tasks.
+     *
+     * If tasks throw, the first exception is rethrown once all are done.
+     */
+    void RunAll(const std::vector<Task> &tasks);
 
-    // VS2010 can't place non-copyable objects in std::map.
-    // Work around the ancient toolchain :-/
-    typedef std::shared_ptr<ThreadedTaskRunner> ThreadedTaskRunnerPtr;
-    typedef std::map<GroupID, ThreadedTaskRunnerPtr> TaskRunnerMap;
+    unsigned int GetNumThreads() const { return m_workers.size(); }
 
-    ThreadedTaskRunner& find_or_create_runner(GroupID group_id);
-    TaskRunnerMap m_tasks;
+private:
+    DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+    friend class TaskHandle;
+
+    struct Worker;
+    struct SerialGroup {
+        SerialGroup() : tasks(), active(false), runner() {};
+        PoolTaskQueue tasks;
+        /** A task running the group is enqueued or running. */
+        bool active;
+        /** The enqueued task running the group, nullptr once started.
+         *
+         * Its priority follows the group's most urgent task.
+         */
+        std::shared_ptr<PoolTask> runner;
+    };
+
+    void threadproc(unsigned int index);
+    bool PopTask(unsigned int index, Task *task);
+    std::shared_ptr<PoolTask> MakeTask(const Task& f, double priority);
+    void PushTask(const std::shared_ptr<PoolTask> &task);
+    void StartGroupRunner(GroupID group_id, SerialGroup &group);
+    void UpdateGroupRunner(SerialGroup &group);
+    void RunSerialGroup(GroupID group_id);
+    bool CancelTask(const std::shared_ptr<PoolTask> &task);
+    bool SetTaskPriority(const std::shared_ptr<PoolTask> &task,
+                         double priority);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    boost::thread_group m_threads;
+    boost::atomic<unsigned int> m_next_worker;
+    boost::atomic<unsigned long long> m_next_seq;
+
+    // Number of tasks in all worker queues. May be transiently negative,
+    // as tasks can be popped before the count is incremented.
+    boost::atomic<int> m_pending;
+    boost::atomic<bool> m_exitthreads;
+    boost::mutex m_idle_mutex;
+    boost::condition_variable m_idle_cond;
+
+    // Inactive groups without tasks are removed.
+    boost::mutex m_groups_mutex;
+    std::map<GroupID, SerialGroup> m_groups;
 };
 
 #endif
@@ -3,33 +3,62 @@
 
 #include <memory>
 #include <functional>
+#include <vector>
+
+#include <boost/atomic.hpp>
 
 #include "coordinates.h"
 #include "util.h"
 #include "pixelbuf.h"
+#include "lrucache.h"
+#include "threading.h"
 
 class TileCode {
     public:
         TileCode(const std::shared_ptr<class GeoDrawable> &map,
                  const class MapPixelCoordInt &pos,
-                 const class MapPixelDeltaInt &tilesize)
-            : m_map(map), m_pos(pos), m_tilesize(tilesize)
+                 const class MapPixelDeltaInt &tilesize,
+                 unsigned int reduction = 1)
+            : m_map(map), m_pos(pos), m_tilesize(tilesize),
+              m_reduction(reduction)
             {};
         std::shared_ptr<class GeoDrawable> GetMap() const { return m_map; };
         const MapPixelCoordInt &GetPosition() const { return m_pos; };
         const MapPixelDeltaInt &GetTileSize() const { return m_tilesize; };
+        /** Factor by which the tile is scaled down, see `GetRegionReduced`.
+         *
+         * Position and tile size are always given in native map pixels,
+         * the loaded `PixelBuf` is `GetTileSize() / GetReduction()` big.
+         */
+        unsigned int GetReduction() const { return m_reduction; };
 
+        /** Get the pixel data of the tile.
+         *
+         * The process-wide `TileCache` is consulted first. On a miss, the
+         * tile is loaded via `LoadTile()`.
+         */
         PixelBuf GetTile() const;
+
+        /** Get the pixel data of the tile, bypassing the `TileCache`.
+         *
+         * The tile is read from the `PersistentTileStore` if possible,
+         * otherwise it is loaded from the underlying map and written to the
+         * store. Either way, the result is put into the `TileCache` for
+         * later use.
+         */
+        PixelBuf LoadTile() const;
     private:
         std::shared_ptr<class GeoDrawable> m_map;
         MapPixelCoordInt m_pos;
         MapPixelDeltaInt m_tilesize;
+        unsigned int m_reduction;
 };
 
 inline bool operator==(const TileCode& lhs, const TileCode& rhs) {
-    return &lhs.GetMap() == &rhs.GetMap() &&
+    return lhs.GetMap().get() == rhs.GetMap().get() &&
            lhs.GetPosition() == rhs.GetPosition() &&
-           lhs.GetTileSize() == rhs.GetTileSize();
+           lhs.GetTileSize() == rhs.GetTileSize() &&
+           lhs.GetReduction() == rhs.GetReduction();
 }
 inline bool operator< (const TileCode& lhs, const TileCode& rhs) {
     const class GeoDrawable *lmap = lhs.GetMap().get();
@@ -48,7 +77,7 @@ inline bool operator< (const TileCode& lhs, const TileCode& rhs) {
     if (lsize.x != rsize.x) return lsize.x < rsize.x;
     if (lsize.y != rsize.y) return lsize.y < rsize.y;
 
-    return false;
+    return lhs.GetReduction() < rhs.GetReduction();
 }
 inline bool operator!=(const TileCode& lhs, const TileCode& rhs) {
     return !operator==(lhs,rhs);
@@ -63,6 +92,56 @@ inline bool operator>=(const TileCode& lhs, const TileCode& rhs) {
     return !operator< (lhs,rhs);
 }
 
+/** A process-wide cache of decoded map tiles.
+ *
+ * Decoding map data (JPEG, TIFF, derived DHM views) is expensive, so tiles
+ * are kept around after they scrolled off-screen. The cache is shared by
+ * all `MapView` instances and is bounded by a memory budget in bytes; the
+ * least recently used tiles are evicted first.
+ *
+ * Cached tiles keep their `GeoDrawable` alive. Use `EvictDrawable()` to
+ * release all tiles of a map that is not needed any more.
+ *
+ * @locking All methods are thread-safe, locking is encapsulated in
+ * `LRUCache`.
+ */
+class EXPORT TileCache {
+    public:
+        /** The budget of the process-wide instance, unless changed. */
+        static const size_t DEFAULT_BUDGET = 128 * 1024 * 1024;
+
+        /** Get the process-wide instance used by `TileCode::GetTile()`. */
+        static TileCache &Instance();
+
+        explicit TileCache(size_t budget_bytes);
+
+        /** Look up a tile, return `false` if it is not cached. */
+        bool Get(const TileCode &tilecode, PixelBuf *result);
+
+        /** Check if a tile is cached without counting a hit or miss. */
+        bool Contains(const TileCode &tilecode) const;
+
+        /** Add a tile to the cache. Empty `PixelBuf`s are ignored. */
+        void Put(const TileCode &tilecode, const PixelBuf &pixels);
+
+        /** Drop all tiles belonging to `map`. */
+        void EvictDrawable(const class GeoDrawable *map);
+
+        /** Drop all tiles. */
+        void Clear();
+
+        size_t GetBudget() const;
+        void SetBudget(size_t budget_bytes);
+
+        CacheStats GetStats() const;
+        void ResetStats();
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TileCache);
+
+        LRUCache<TileCode, PixelBuf> m_cache;
+};
+
 /**
  An interface to retrieve a PixelBuf at a later time.
 */
@@ -78,6 +157,10 @@ class PixelPromise {
             drawable.
         */
         virtual const TileCode *GetCacheKey() const = 0;
+        /** Hint how urgently the pixels are needed, higher is more urgent.
+            This only matters for promises loading data in the background.
+        */
+        virtual void SetPriority(double priority) {};
 };
 
 /**
@@ -110,9 +193,15 @@ class PixelPromiseTiledAsync : public PixelPromise {
          * On completion, the `refresh` callback is called **from the
          * background thread**. In other words, modifying application state
          * from the callback requires special care.
+         *
+         * Pending tiles with higher `priority` are loaded first. Values are
+         * relative to the other tile loads, e.g. the negative distance from
+         * the display center. Tiles still waiting when the promise is
+         * destroyed are removed from the queue.
          */
         PixelPromiseTiledAsync(const TileCode& tilecode,
-                               const std::function<void()>& refresh);
+                               const std::function<void()>& refresh,
+                               double priority = 0);
         virtual ~PixelPromiseTiledAsync();
 
         /** Get the data if available, otherwise return an empty `PixelBuf` */
@@ -127,6 +216,9 @@ class PixelPromiseTiledAsync : public PixelPromise {
          * `PixelBuf` returned until the data is ready.
          */
         virtual const TileCode *GetCacheKey() const;
+
+        /** Change the load priority, if loading has not yet started. */
+        virtual void SetPriority(double priority);
     private:
         DISALLOW_COPY_AND_ASSIGN(PixelPromiseTiledAsync);
 
@@ -134,6 +226,41 @@ class PixelPromiseTiledAsync : public PixelPromise {
 
         TileCode m_tilecode;
         std::shared_ptr<AsyncWorker> m_worker;
+        TaskHandle m_task;
+};
+
+/** Load tiles into the `TileCache` before they are actually needed.
+ *
+ * Tiles passed to `Prefetch()` are loaded in the background, in the given
+ * order. Each `Prefetch()` call cancels all tiles of the previous call that
+ * have not been loaded yet, so callers can simply pass their current
+ * prediction whenever it changes.
+ *
+ * Prefetching never competes with tiles that are actually visible: it
+ * shares the thread pool of `PixelPromiseTiledAsync`, with a priority below
+ * any visible tile. Only pass tiles of drawables that
+ * `SupportsConcurrentGetRegion()`.
+ *
+ * @locking `Prefetch()` and `Cancel()` must only be called from one thread.
+ */
+class TilePrefetcher {
+    public:
+        TilePrefetcher();
+        ~TilePrefetcher();
+
+        /** Replace the pending prefetch requests by `tiles`. */
+        void Prefetch(const std::vector<TileCode> &tiles);
+
+        /** Drop all pending prefetch requests. */
+        void Cancel();
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TilePrefetcher);
+
+        /** Pool priority of the first prefetched tile. */
+        static const double PRIORITY;
+
+        std::vector<TaskHandle> m_tasks;
 };
 
 class PixelPromiseDirect : public PixelPromise {
@@ -0,0 +1,90 @@
+#ifndef ODM__TILESTORE_H
+#define ODM__TILESTORE_H
+
+#include <string>
+#include <cstddef>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/atomic.hpp>
+
+#include "util.h"
+#include "pixelbuf.h"
+#include "lrucache.h"
+
+class TileCode;
+
+/** A persistent, size-bounded store of map tiles on disk.
+ *
+ * Some maps are expensive to decode (GVG) or compute (gradient and
+ * steepness views of DHMs). Their tiles are written to individual files in
+ * a cache directory, so later sessions can map them back into memory
+ * instead of recomputing them. Only maps returning `true` from
+ * `GeoDrawable::SupportsPersistentCache()` are stored.
+ *
+ * Tiles are keyed by the map file name, its modification time, the
+ * drawable type, and the position, size and reduction of the tile. Tiles of
+ * changed files are therefore never returned; they age out of the store.
+ *
+ * The total size of all tile files is bounded by a budget in bytes. The
+ * least recently used tiles are deleted first. The access order survives
+ * across sessions by way of the file modification time, which is updated
+ * on every hit.
+ *
+ * The store is disabled until `SetDirectory()` is called.
+ *
+ * @locking `m_mutex` protects the directory name. Usage order and sizes
+ * are tracked in a `LRUCache`, which does its own locking. File operations
+ * are performed without holding any lock; concurrent writers of the same
+ * tile use distinct temporary files and replace the tile file atomically.
+ */
+class EXPORT PersistentTileStore {
+    public:
+        /** The budget of the process-wide instance, unless changed. */
+        static const size_t DEFAULT_BUDGET = 1024 * 1024 * 1024;
+
+        /** Get the process-wide instance used by `TileCode::LoadTile()`. */
+        static PersistentTileStore &Instance();
+
+        explicit PersistentTileStore(size_t budget_bytes);
+
+        /** Store tiles in `directory`.
+         *
+         * The directory is created if it does not exist yet, its parent
+         * directory must exist. Tile files already present are taken over
+         * from previous sessions. An empty string disables the store.
+         */
+        void SetDirectory(const std::wstring &directory);
+        std::wstring GetDirectory() const;
+
+        /** Return `true` if `tilecode` can be held in the store. */
+        bool Supports(const TileCode &tilecode) const;
+
+        /** Look up a tile, return `false` if it is not stored. */
+        bool Get(const TileCode &tilecode, PixelBuf *result);
+
+        /** Write a tile to the store.
+         *
+         * Empty `PixelBuf`s and tiles of unsupported maps are ignored.
+         */
+        void Put(const TileCode &tilecode, const PixelBuf &pixels);
+
+        /** Delete all tile files. */
+        void Clear();
+
+        size_t GetBudget() const;
+        void SetBudget(size_t budget_bytes);
+
+        CacheStats GetStats() const;
+        void ResetStats();
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(PersistentTileStore);
+
+        mutable boost::mutex m_mutex;
+        std::wstring m_directory;
+        /** Maps file names to their size in bytes. */
+        LRUCache<std::wstring, size_t> m_files;
+        boost::atomic<unsigned int> m_tmp_counter;
+};
+
+#endif
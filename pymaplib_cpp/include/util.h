@@ -16,6 +16,11 @@
   TypeName(const TypeName&);               \
   void operator=(const TypeName&)
 
+// Process-wide state (singletons, shared caches, lookup tables) is kept in
+// namespace-scope statics, which are initialized at load time, before any
+// worker thread can reach them. Function-local statics must not be used for
+// this, their initialization isn't thread-safe in VS2010.
+
 
 template <typename T>
 class ArrayDeleter {
@@ -252,4 +257,7 @@ class TemporaryValue {
 long long int  GetFilesize(const std::wstring &filename);
 bool FileExists(const std::string &name);
 bool FileExists(const std::wstring &name);
+
+/** Return `true` if both the CPU and the OS support AVX2 instructions. */
+EXPORT bool CPUSupportsAVX2();
 #endif
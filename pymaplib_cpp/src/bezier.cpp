@@ -178,7 +178,8 @@ MapBezierPositioner::FindCreationPos(const MapPixelCoord &d_pos,
 }
 
 
-static inline double FastBezierCalc(const unsigned int *src,
+template <typename T>
+static inline double FastBezierCalc(const T *src,
                                     const MapPixelCoordInt &pos,
                                     const MapPixelDeltaInt &size,
                                     double x[3], double y[3])
@@ -189,14 +190,16 @@ static inline double FastBezierCalc(const unsigned int *src,
     double Y2 = 2.0 * y[2] - y[1];
 
 // Sample a 3x3 area around pos.x/pos.y, thus the (-1)
-#define SRC(xx,yy) ((int)src[(xx + pos.x - 1) + size.x * (yy + pos.y - 1)])
+#define SRC(xx,yy) \
+        static_cast<double>(src[(xx + pos.x - 1) + size.x * (yy + pos.y - 1)])
     return Y0 / 4 * (SRC(0, 0) * X0 + SRC(2, 0) * X2 + SRC(1, 0) * x[1] * 4) +
            Y2 / 4 * (SRC(0, 2) * X0 + SRC(2, 2) * X2 + SRC(1, 2) * x[1] * 4) +
            y[1] *   (SRC(0, 1) * X0 + SRC(2, 1) * X2 + SRC(1, 1) * 4 * x[1]);
 #undef SRC
 }
 
-bool Gradient3x3(const unsigned int *src,
+template <typename T>
+bool Gradient3x3(const T *src,
                  const MapPixelDeltaInt &src_size,
                  const MapPixelCoordInt &center,
                  const UnitSquareCoord &bezier_pos,
@@ -231,17 +234,19 @@ bool Gradient3x3(const RasterMap &map,
                                        (Bezier::N_POINTS - 1) / 2);
     MapPixelDeltaInt bezier_size(Bezier::N_POINTS, Bezier::N_POINTS);
 
-    auto orig_data = map.GetRegion(center - sampling_overhang, bezier_size);
-    return Gradient3x3(orig_data.GetRawData(), bezier_size,
+    auto heights = map.GetElevationRegion(center - sampling_overhang,
+                                          bezier_size);
+    return Gradient3x3(heights.GetRawData(), bezier_size,
                        MapPixelCoordInt(sampling_overhang), bezier_pos,
                        gradient);
 }
 
-bool Value3x3(const unsigned int *src,
-                const MapPixelDeltaInt &src_size,
-                const MapPixelCoordInt &center,
-                const UnitSquareCoord &bezier_pos,
-                double *value)
+template <typename T>
+bool Value3x3(const T *src,
+              const MapPixelDeltaInt &src_size,
+              const MapPixelCoordInt &center,
+              const UnitSquareCoord &bezier_pos,
+              double *value)
 {
     if (center.x <= 0 || center.x >= src_size.x - 1 ||
         center.y <= 0 || center.y >= src_size.y - 1 ||
@@ -267,8 +272,21 @@ bool Value3x3(const RasterMap &map,
                                        (Bezier::N_POINTS - 1) / 2);
     MapPixelDeltaInt bezier_size(Bezier::N_POINTS, Bezier::N_POINTS);
 
-    auto orig_data = map.GetRegion(center - sampling_overhang, bezier_size);
-    return Value3x3(orig_data.GetRawData(), bezier_size,
+    auto heights = map.GetElevationRegion(center - sampling_overhang,
+                                          bezier_size);
+    return Value3x3(heights.GetRawData(), bezier_size,
                     MapPixelCoordInt(sampling_overhang), bezier_pos, value);
 }
 
+template bool
+Gradient3x3<int16_t>(const int16_t *src,
+                     const MapPixelDeltaInt &src_size,
+                     const MapPixelCoordInt &center,
+                     const UnitSquareCoord &bezier_pos,
+                     MapBezierGradient *gradient);
+template bool
+Value3x3<int16_t>(const int16_t *src,
+                  const MapPixelDeltaInt &src_size,
+                  const MapPixelCoordInt &center,
+                  const UnitSquareCoord &bezier_pos,
+                  double *value);
@@ -2,11 +2,25 @@
 
 #define _USE_MATH_DEFINES
 #include <memory>
+#include <vector>
+#include <functional>
+#include <algorithm>
 #include <cassert>
 #include <math.h>
+#include <sstream>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
 
 #include "util.h"
 #include "bezier.h"
+#include "threading.h"
+
+// Versions of the coloring, part of the persistent tile store key. Increase
+// them whenever the pixels computed from the same heights change, so that
+// tiles stored by earlier versions are not reused.
+static const int GRADIENT_MAP_VERSION = 2;
+static const int STEEPNESS_MAP_VERSION = 2;
 
 GradientMap::GradientMap(const std::shared_ptr<RasterMap> &orig_map)
     : m_orig_map(orig_map)
@@ -40,6 +54,12 @@ bool GradientMap::LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const
 const std::wstring &GradientMap::GetFname() const {
     return m_orig_map->GetFname();
 }
+std::wstring GradientMap::GetCacheIdentity() const {
+    std::wostringstream identity;
+    identity << L"gradient v" << GRADIENT_MAP_VERSION << L";"
+             << m_orig_map->GetCacheIdentity();
+    return identity.str();
+}
 const std::wstring &GradientMap::GetTitle() const {
     return m_orig_map->GetTitle();
 }
@@ -48,49 +68,191 @@ const std::wstring &GradientMap::GetDescription() const {
 }
 
 
-//static TimeCounter time_counter;
-//static TimeCounter time_counter_loaddisc;
+// Split regions with more pixels than this across the thread pool.
+static const int KERNEL_THREADING_PIXELS = 512 * 512;
+// Rows per task when splitting.
+static const int KERNEL_BAND_ROWS = 64;
+
+// Call `rows(y0, y1)` for all rows of a `width` x `height` region, split
+// into bands on the thread pool if `impl` and the region size call for it.
+static void RunRowBands(int width, int height, DHMKernelImpl impl,
+                        const std::function<void(int, int)> &rows)
+{
+    if (impl != DHM_KERNEL_THREADED ||
+        width * height < KERNEL_THREADING_PIXELS)
+    {
+        rows(0, height);
+        return;
+    }
+    std::vector<Task> tasks;
+    for (int y = 0; y < height; y += KERNEL_BAND_ROWS) {
+        int y1 = std::min(y + KERNEL_BAND_ROWS, height);
+        tasks.push_back([&rows, y, y1]() { rows(y, y1); });
+    }
+    ThreadPool::Instance().RunAll(tasks);
+}
+
+// Hue of gradient map pixels, depending on the elevation.
+//
+// The arithmetic is unsigned, as it has always been. For negative heights
+// this wraps around, but changing it would change the established colors.
+static inline unsigned char ElevationHue(int elevation) {
+    unsigned int uelevation = static_cast<unsigned int>(elevation);
+    return static_cast<unsigned char>(255*240/360 - uelevation*255/4000);
+}
+
+// Hue and value of gradient map pixels are 8 bit each, the saturation is
+// fixed. Rather than calling HSV_to_RGB() per pixel, colors are looked up in
+// a table, indexed by (hue << 8) | value.
+static std::vector<unsigned int> MakeGradientColors() {
+    std::vector<unsigned int> colors(256 * 256);
+    for (int hue = 0; hue < 256; hue++) {
+        for (int value = 0; value < 256; value++) {
+            colors[(hue << 8) | value] = HSV_to_RGB(hue, 255, value);
+        }
+    }
+    return colors;
+}
+
+// Hues for all 16 bit elevations, indexed by elevation + 32768.
+static std::vector<unsigned char> MakeElevationHues() {
+    std::vector<unsigned char> hues(65536);
+    for (int elevation = -32768; elevation < 32768; elevation++) {
+        hues[elevation + 32768] = ElevationHue(elevation);
+    }
+    return hues;
+}
+
+static const std::vector<unsigned int> GradientColors = MakeGradientColors();
+static const std::vector<unsigned char> ElevationHues = MakeElevationHues();
+
+// Value (brightness) of gradient map pixels: 128 + 1.25 * d, clamped to
+// 0..255, where d = gradient x - gradient y. (512 + 5 * d) / 4 computes the
+// same without floating point math. Negative results are clamped anyway,
+// so rounding towards -inf instead of towards zero doesn't matter.
+static inline int GradientValue(int d) {
+    return ValueBetween(0, (512 + 5 * d) >> 2, 255);
+}
+
+// Sign-extend the lower or upper four int16s to int32.
+static inline __m128i widen_lo_epi16(__m128i v) {
+    return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
+static inline __m128i widen_hi_epi16(__m128i v) {
+    return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+// Color one row of the gradient map. `center` points to the height of the
+// first output pixel, `stride` is the row length of the height buffer.
+static void gradient_row(const int16_t *center, int stride, int count,
+                         unsigned int *dest)
+{
+    const unsigned int *colors = &GradientColors[0];
+    const unsigned char *hues = &ElevationHues[32768];
+    int x = 0;
+    // The gradients and values of eight pixels at a time are computed with
+    // SSE2. The color lookups are scalar, there is no gather in SSE2.
+    const __m128i offset = _mm_set1_epi32(512);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned char values[16];
+    for (; x + 8 <= count; x += 8) {
+        const int16_t *c = center + x;
+        __m128i left = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(c - 1));
+        __m128i right = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(c + 1));
+        __m128i below = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(c - stride));
+        __m128i above = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(c + stride));
+        // d = (right - left) - (above - below), in 32 bit to not overflow.
+        __m128i d_lo = _mm_sub_epi32(
+                _mm_sub_epi32(widen_lo_epi16(right), widen_lo_epi16(left)),
+                _mm_sub_epi32(widen_lo_epi16(above), widen_lo_epi16(below)));
+        __m128i d_hi = _mm_sub_epi32(
+                _mm_sub_epi32(widen_hi_epi16(right), widen_hi_epi16(left)),
+                _mm_sub_epi32(widen_hi_epi16(above), widen_hi_epi16(below)));
+        __m128i v_lo = _mm_srai_epi32(_mm_add_epi32(
+                _mm_add_epi32(_mm_slli_epi32(d_lo, 2), d_lo), offset), 2);
+        __m128i v_hi = _mm_srai_epi32(_mm_add_epi32(
+                _mm_add_epi32(_mm_slli_epi32(d_hi, 2), d_hi), offset), 2);
+        // Saturating packs do the clamping to 0..255.
+        __m128i v = _mm_packus_epi16(_mm_packs_epi32(v_lo, v_hi), zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values), v);
+        for (int i = 0; i < 8; i++) {
+            dest[x + i] = colors[(hues[c[i]] << 8) | values[i]];
+        }
+    }
+    for (; x < count; x++) {
+        const int16_t *c = center + x;
+        int d = (c[1] - c[-1]) - (c[stride] - c[-stride]);
+        dest[x] = colors[(hues[c[0]] << 8) | GradientValue(d)];
+    }
+}
 
 #define DEST(xx,yy) dest[(xx) + size.x * (yy)]
 #define SRC(xx,yy) src[(xx) + req_size.x * (yy)]
-PixelBuf GradientMap::GetRegion(
-        const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) const
+static void ColorGradientReference(const ElevationBuf16 &heights,
+                                   PixelBuf *result)
 {
-    auto fixed_bounds_pb = GetRegion_BoundsHelper(*this, pos, size);
-    if (fixed_bounds_pb.GetData())
-        return fixed_bounds_pb;
-
-    //time_counter_loaddisc.Start();
-    MapPixelCoordInt req_pos = pos - MapPixelDeltaInt(1, 1);
-    MapPixelDeltaInt req_size = size + MapPixelDeltaInt(2, 2);
-    auto orig_data = m_orig_map->GetRegion(req_pos, req_size);
-    //auto orig_data = LoadBufferFromBMP(L"example.bmp");
-    PixelBuf result(size.x, size.y);
-
-    unsigned int *src = orig_data.GetRawData();
-    unsigned int *dest = result.GetRawData();
-    //time_counter_loaddisc.Stop();
-    //time_counter.Start();
+    MapPixelDeltaInt req_size(heights.GetWidth(), heights.GetHeight());
+    MapPixelDeltaInt size(result->GetWidth(), result->GetHeight());
+    const int16_t *src = heights.GetRawData();
+    unsigned int *dest = result->GetRawData();
     for (int x=0; x < size.x; x++) {
         for (int y=0; y < size.y; y++) {
-            unsigned int elevation = SRC(x+1, y+1);
+            int elevation = SRC(x+1, y+1);
             MapPixelCoordInt pos(x+1, y+1);
             MapBezierGradient grad = Fast3x3CenterGradient(src, pos, req_size);
 
             DEST(x, y) = HSV_to_RGB(
-                      255*240/360 - elevation*255/4000,
+                      ElevationHue(elevation),
                       255,
                       ValueBetween(0,
                                    static_cast<int>(128+1.25*(grad.x-grad.y)),
                                    255));
         }
     }
-    //time_counter.Stop();
-    return result;
 }
 #undef DEST
 #undef SRC
 
+PixelBuf ColorGradient(const ElevationBuf16 &heights, DHMKernelImpl impl) {
+    int width = heights.GetWidth() - 2;
+    int height = heights.GetHeight() - 2;
+    if (width < 0 || height < 0) {
+        throw std::runtime_error(
+                "Gradient needs heights around the region.");
+    }
+    PixelBuf result(width, height);
+    if (impl == DHM_KERNEL_REFERENCE) {
+        ColorGradientReference(heights, &result);
+        return result;
+    }
+
+    int stride = heights.GetWidth();
+    auto color_rows = [&heights, &result, width, stride](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            gradient_row(heights.GetValuePtr(1, y + 1), stride, width,
+                         result.GetPixelPtr(0, y));
+        }
+    };
+    RunRowBands(width, height, impl, color_rows);
+    return result;
+}
+
+PixelBuf GradientMap::GetRegion(
+        const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) const
+{
+    auto fixed_bounds_pb = GetRegion_BoundsHelper(*this, pos, size);
+    if (fixed_bounds_pb.GetData())
+        return fixed_bounds_pb;
+
+    MapPixelCoordInt req_pos = pos - MapPixelDeltaInt(1, 1);
+    MapPixelDeltaInt req_size = size + MapPixelDeltaInt(2, 2);
+    return ColorGradient(m_orig_map->GetElevationRegion(req_pos, req_size));
+}
+
 
 SteepnessMap::SteepnessMap(const std::shared_ptr<RasterMap> &orig_map)
     : m_orig_map(orig_map)
@@ -124,6 +286,12 @@ bool SteepnessMap::LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const
 const std::wstring &SteepnessMap::GetFname() const {
     return m_orig_map->GetFname();
 }
+std::wstring SteepnessMap::GetCacheIdentity() const {
+    std::wostringstream identity;
+    identity << L"steepness v" << STEEPNESS_MAP_VERSION << L";"
+             << m_orig_map->GetCacheIdentity();
+    return identity.str();
+}
 const std::wstring &SteepnessMap::GetTitle() const {
     return m_orig_map->GetTitle();
 }
@@ -139,8 +307,184 @@ static const unsigned int steepness_colors[] = {
     0x3f3f3f, 0x272727, 0x000000,
 };
 
+static const int N_STEEPNESS_CLASSES = 18;
+
+// Meters between the outer points of the Bezier patch.
+static inline double BezierMeters(double mpp) {
+    return (Bezier::N_POINTS - 1) * mpp;
+}
+
 #define DEST(xx,yy) dest[(xx) + size.x * (yy)]
 #define SRC(xx,yy) src[(xx) + req_size.x * (yy)]
+static void ColorSteepnessReference(const ElevationBuf16 &heights,
+                                    double mpp, PixelBuf *result)
+{
+    MapPixelDeltaInt req_size(heights.GetWidth(), heights.GetHeight());
+    MapPixelDeltaInt size(result->GetWidth(), result->GetHeight());
+    double inv_bezier_meters = 1 / BezierMeters(mpp);
+    const int16_t *src = heights.GetRawData();
+    unsigned int *dest = result->GetRawData();
+    for (int x=0; x < size.x; x++) {
+        for (int y=0; y < size.y; y++) {
+            MapPixelCoordInt pos(x+1, y+1);
+            MapBezierGradient grad = Fast3x3CenterGradient(src, pos, req_size);
+            grad *= inv_bezier_meters;
+            double grad_steepness = atan(grad.Abs());
+            int color_index = static_cast<int>(
+                    grad_steepness / (M_PI / 2) * N_STEEPNESS_CLASSES);
+            DEST(x, y) = steepness_colors[color_index];
+        }
+    }
+}
+#undef DEST
+#undef SRC
+
+// Thresholds of the squared gradient gx^2 + gy^2 of the raw heights for
+// each steepness class: a pixel is at least as steep as class `i` if the
+// squared gradient is larger than `thresholds[i - 1]`.
+//
+// This is equivalent to comparing atan(|gradient| / bezier_meters) against
+// the class angles, but needs neither atan nor sqrt. The squared gradient
+// is an integer, so comparing it against the rounded up thresholds is
+// exact.
+static void SteepnessThresholds(double mpp, int64_t *thresholds) {
+    double bezier_meters = BezierMeters(mpp);
+    for (int i = 1; i < N_STEEPNESS_CLASSES; i++) {
+        double slope = tan(i * M_PI / 2 / N_STEEPNESS_CLASSES) *
+                       bezier_meters;
+        // Larger than any squared gradient of 16 bit heights.
+        double threshold = std::min(ceil(slope * slope) - 1, 1e18);
+        thresholds[i - 1] = static_cast<int64_t>(threshold);
+    }
+}
+
+static inline int SteepnessClass(int gx, int gy, const int64_t *thresholds) {
+    int64_t squared = static_cast<int64_t>(gx) * gx +
+                      static_cast<int64_t>(gy) * gy;
+    int steepness_class = 0;
+    while (steepness_class < N_STEEPNESS_CLASSES - 1 &&
+           squared > thresholds[steepness_class])
+    {
+        steepness_class++;
+    }
+    return steepness_class;
+}
+
+// Squared gradients of eight pixels. Returns false if a gradient component
+// doesn't fit into 16 bits, which only happens for nonsensical heights,
+// e.g. next to missing values.
+static inline bool squared_gradients(const int16_t *c, int stride,
+                                     __m128i *lo, __m128i *hi)
+{
+    __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c - 1));
+    __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + 1));
+    __m128i below = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(c - stride));
+    __m128i above = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(c + stride));
+    // The saturating packs map out of range values to -32768 or 32767.
+    __m128i gx = _mm_packs_epi32(
+            _mm_sub_epi32(widen_lo_epi16(right), widen_lo_epi16(left)),
+            _mm_sub_epi32(widen_hi_epi16(right), widen_hi_epi16(left)));
+    __m128i gy = _mm_packs_epi32(
+            _mm_sub_epi32(widen_lo_epi16(above), widen_lo_epi16(below)),
+            _mm_sub_epi32(widen_hi_epi16(above), widen_hi_epi16(below)));
+    const __m128i max = _mm_set1_epi16(32767);
+    const __m128i min = _mm_set1_epi16(-32768);
+    __m128i saturated = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi16(gx, max), _mm_cmpeq_epi16(gx, min)),
+            _mm_or_si128(_mm_cmpeq_epi16(gy, max), _mm_cmpeq_epi16(gy, min)));
+    if (_mm_movemask_epi8(saturated)) {
+        return false;
+    }
+    // Interleaved gx, gy pairs; madd yields gx*gx + gy*gy per pixel, at
+    // most 2 * 32766^2, which fits into 32 bits.
+    __m128i g_lo = _mm_unpacklo_epi16(gx, gy);
+    __m128i g_hi = _mm_unpackhi_epi16(gx, gy);
+    *lo = _mm_madd_epi16(g_lo, g_lo);
+    *hi = _mm_madd_epi16(g_hi, g_hi);
+    return true;
+}
+
+// Color one row of the steepness map, cf. `gradient_row()`.
+static void steepness_row(const int16_t *center, int stride, int count,
+                          const int64_t *thresholds, unsigned int *dest)
+{
+    // Thresholds beyond the 32 bit range are never exceeded by the squared
+    // gradients of the vectorized path.
+    __m128i thresholds32[N_STEEPNESS_CLASSES - 1];
+    for (int i = 0; i < N_STEEPNESS_CLASSES - 1; i++) {
+        thresholds32[i] = _mm_set1_epi32(static_cast<int32_t>(
+                std::min<int64_t>(thresholds[i], 2147483647)));
+    }
+    int x = 0;
+    uint16_t classes[8];
+    for (; x + 8 <= count; x += 8) {
+        const int16_t *c = center + x;
+        __m128i sq_lo, sq_hi;
+        if (!squared_gradients(c, stride, &sq_lo, &sq_hi)) {
+            for (int i = 0; i < 8; i++) {
+                int cls = SteepnessClass(c[i + 1] - c[i - 1],
+                                         c[i + stride] - c[i - stride],
+                                         thresholds);
+                dest[x + i] = steepness_colors[cls];
+            }
+            continue;
+        }
+        // Comparisons yield -1 per lane, so subtracting them counts the
+        // thresholds exceeded.
+        __m128i class_lo = _mm_setzero_si128();
+        __m128i class_hi = _mm_setzero_si128();
+        for (int i = 0; i < N_STEEPNESS_CLASSES - 1; i++) {
+            class_lo = _mm_sub_epi32(
+                    class_lo, _mm_cmpgt_epi32(sq_lo, thresholds32[i]));
+            class_hi = _mm_sub_epi32(
+                    class_hi, _mm_cmpgt_epi32(sq_hi, thresholds32[i]));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(classes),
+                         _mm_packs_epi32(class_lo, class_hi));
+        for (int i = 0; i < 8; i++) {
+            dest[x + i] = steepness_colors[classes[i]];
+        }
+    }
+    for (; x < count; x++) {
+        const int16_t *c = center + x;
+        int cls = SteepnessClass(c[1] - c[-1], c[stride] - c[-stride],
+                                 thresholds);
+        dest[x] = steepness_colors[cls];
+    }
+}
+
+PixelBuf ColorSteepness(const ElevationBuf16 &heights, double mpp,
+                        DHMKernelImpl impl)
+{
+    int width = heights.GetWidth() - 2;
+    int height = heights.GetHeight() - 2;
+    if (width < 0 || height < 0) {
+        throw std::runtime_error(
+                "Steepness needs heights around the region.");
+    }
+    PixelBuf result(width, height);
+    if (impl == DHM_KERNEL_REFERENCE) {
+        ColorSteepnessReference(heights, mpp, &result);
+        return result;
+    }
+
+    int64_t thresholds[N_STEEPNESS_CLASSES - 1];
+    SteepnessThresholds(mpp, thresholds);
+    int stride = heights.GetWidth();
+    auto color_rows = [&heights, &result, &thresholds, width, stride]
+                      (int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++) {
+            steepness_row(heights.GetValuePtr(1, y + 1), stride, width,
+                          thresholds, result.GetPixelPtr(0, y));
+        }
+    };
+    RunRowBands(width, height, impl, color_rows);
+    return result;
+}
+
 PixelBuf SteepnessMap::GetRegion(
         const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) const
 {
@@ -153,27 +497,224 @@ PixelBuf SteepnessMap::GetRegion(
         // Return zero-initialized memory block.
         return PixelBuf(size.x, size.y);
     }
-    unsigned int bezier_pixels = Bezier::N_POINTS - 1;
-    double inv_bezier_meters = 1 / (bezier_pixels * mpp);
-
     MapPixelCoordInt req_pos = pos - MapPixelDeltaInt(1, 1);
     MapPixelDeltaInt req_size = size + MapPixelDeltaInt(2, 2);
-    auto orig_data = m_orig_map->GetRegion(req_pos, req_size);
-    PixelBuf result(size.x, size.y);
+    return ColorSteepness(m_orig_map->GetElevationRegion(req_pos, req_size),
+                          mpp);
+}
 
-    unsigned int *src = orig_data.GetRawData();
-    unsigned int *dest = result.GetRawData();
-    for (int x=0; x < size.x; x++) {
-        for (int y=0; y < size.y; y++) {
-            MapPixelCoordInt pos(x+1, y+1);
-            MapBezierGradient grad = Fast3x3CenterGradient(src, pos, req_size);
-            grad *= inv_bezier_meters;
-            double grad_steepness = atan(grad.Abs());
-            int color_index = static_cast<int>(grad_steepness / (M_PI / 2) * 18);
-            DEST(x, y) = steepness_colors[color_index];
+
+HillshadeMap::HillshadeMap(const std::shared_ptr<RasterMap> &orig_map,
+                           double azimuth, double altitude)
+    : m_orig_map(orig_map), m_azimuth(azimuth), m_altitude(altitude)
+{
+    assert(orig_map->GetType() == RasterMap::TYPE_DHM);
+}
+
+GeoDrawable::DrawableType HillshadeMap::GetType() const {
+    return RasterMap::TYPE_HILLSHADE_MAP;
+}
+unsigned int HillshadeMap::GetWidth() const {
+    return m_orig_map->GetWidth();
+}
+unsigned int HillshadeMap::GetHeight() const {
+    return m_orig_map->GetHeight();
+}
+MapPixelDeltaInt HillshadeMap::GetSize() const {
+    return m_orig_map->GetSize();
+}
+Projection HillshadeMap::GetProj() const {
+    return m_orig_map->GetProj();
+}
+bool HillshadeMap::PixelToLatLon(const MapPixelCoord &pos, LatLon *result) const
+{
+    return m_orig_map->PixelToLatLon(pos, result);
+}
+bool HillshadeMap::LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const
+{
+    return m_orig_map->LatLonToPixel(pos, result);
+}
+const std::wstring &HillshadeMap::GetFname() const {
+    return m_orig_map->GetFname();
+}
+const std::wstring &HillshadeMap::GetTitle() const {
+    return m_orig_map->GetTitle();
+}
+const std::wstring &HillshadeMap::GetDescription() const {
+    return m_orig_map->GetDescription();
+}
+
+// With Horn's kernel, the slopes towards east and north are gx / (8 * mpp)
+// and gy / (8 * mpp), where
+//     gx = (ne + 2 e + se) - (nw + 2 w + sw)
+//     gy = (nw + 2 n + ne) - (sw + 2 s + se).
+// The brightness is the cosine of the angle between the surface normal
+// (-slope_x, -slope_y, 1) and the direction of the light, which simplifies
+// to (a + b * gx + c * gy) / sqrt(1 + s2 * (gx^2 + gy^2)).
+struct HillshadeLight {
+    HillshadeLight(double mpp, double azimuth, double altitude) {
+        double az = azimuth * M_PI / 180;
+        double alt = altitude * M_PI / 180;
+        double scale = 1 / (8 * mpp);
+        a = sin(alt);
+        b = -scale * sin(az) * cos(alt);
+        c = -scale * cos(az) * cos(alt);
+        s2 = scale * scale;
+    }
+    double a, b, c, s2;
+};
+
+static inline unsigned int GrayPixel(int value) {
+    return makeRGB(value, value, value);
+}
+
+// Horn gradients; `c` points to the center pixel, rows are bottom-up.
+static inline void HornGradient(const int16_t *c, int stride,
+                                int *gx, int *gy)
+{
+    const int16_t *n = c + stride;
+    const int16_t *s = c - stride;
+    *gx = (n[1] + 2 * c[1] + s[1]) - (n[-1] + 2 * c[-1] + s[-1]);
+    *gy = (n[-1] + 2 * n[0] + n[1]) - (s[-1] + 2 * s[0] + s[1]);
+}
+
+static void ColorHillshadeReference(const ElevationBuf16 &heights,
+                                    const HillshadeLight &light,
+                                    PixelBuf *result)
+{
+    int stride = heights.GetWidth();
+    for (int y = 0; y < result->GetHeight(); y++) {
+        for (int x = 0; x < result->GetWidth(); x++) {
+            int gx, gy;
+            HornGradient(heights.GetValuePtr(x + 1, y + 1), stride, &gx, &gy);
+            double shade = (light.a + light.b * gx + light.c * gy) /
+                           sqrt(1 + light.s2 * (double(gx) * gx +
+                                                double(gy) * gy));
+            int value = static_cast<int>(std::max(0.0, shade) * 255 + 0.5);
+            *result->GetPixelPtr(x, y) = GrayPixel(value);
         }
     }
+}
+
+// Sum of the three int16 rows `a + 2 * b + c`, as int32.
+static inline void weighted_sum(__m128i a, __m128i b, __m128i c,
+                                __m128i *lo, __m128i *hi)
+{
+    *lo = _mm_add_epi32(_mm_add_epi32(widen_lo_epi16(a), widen_lo_epi16(c)),
+                        _mm_slli_epi32(widen_lo_epi16(b), 1));
+    *hi = _mm_add_epi32(_mm_add_epi32(widen_hi_epi16(a), widen_hi_epi16(c)),
+                        _mm_slli_epi32(widen_hi_epi16(b), 1));
+}
+
+static inline __m128i load_epi16(const int16_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// Gray pixels from the Horn gradients of four pixels.
+static inline __m128i shade4(__m128i gx_i, __m128i gy_i,
+                             __m128 a, __m128 b, __m128 c, __m128 s2)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    __m128 gx = _mm_cvtepi32_ps(gx_i);
+    __m128 gy = _mm_cvtepi32_ps(gy_i);
+    __m128 num = _mm_add_ps(a, _mm_add_ps(_mm_mul_ps(b, gx),
+                                          _mm_mul_ps(c, gy)));
+    __m128 den = _mm_sqrt_ps(_mm_add_ps(one, _mm_mul_ps(s2,
+            _mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gy, gy)))));
+    __m128 shade = _mm_max_ps(_mm_setzero_ps(), _mm_div_ps(num, den));
+    __m128i value = _mm_cvtps_epi32(_mm_mul_ps(shade, scale));
+    return _mm_or_si128(value, _mm_or_si128(_mm_slli_epi32(value, 8),
+                                            _mm_slli_epi32(value, 16)));
+}
+
+// Shade one row of the hillshade map, cf. `gradient_row()`.
+static void hillshade_row(const int16_t *center, int stride, int count,
+                          const HillshadeLight &light, unsigned int *dest)
+{
+    const __m128 a = _mm_set1_ps(static_cast<float>(light.a));
+    const __m128 b = _mm_set1_ps(static_cast<float>(light.b));
+    const __m128 c = _mm_set1_ps(static_cast<float>(light.c));
+    const __m128 s2 = _mm_set1_ps(static_cast<float>(light.s2));
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        const int16_t *p = center + x;
+        const int16_t *n = p + stride;
+        const int16_t *s = p - stride;
+        __m128i east_lo, east_hi, west_lo, west_hi;
+        __m128i north_lo, north_hi, south_lo, south_hi;
+        weighted_sum(load_epi16(n + 1), load_epi16(p + 1), load_epi16(s + 1),
+                     &east_lo, &east_hi);
+        weighted_sum(load_epi16(n - 1), load_epi16(p - 1), load_epi16(s - 1),
+                     &west_lo, &west_hi);
+        weighted_sum(load_epi16(n - 1), load_epi16(n), load_epi16(n + 1),
+                     &north_lo, &north_hi);
+        weighted_sum(load_epi16(s - 1), load_epi16(s), load_epi16(s + 1),
+                     &south_lo, &south_hi);
+        __m128i *out = reinterpret_cast<__m128i*>(dest + x);
+        _mm_storeu_si128(out, shade4(_mm_sub_epi32(east_lo, west_lo),
+                                     _mm_sub_epi32(north_lo, south_lo),
+                                     a, b, c, s2));
+        _mm_storeu_si128(out + 1, shade4(_mm_sub_epi32(east_hi, west_hi),
+                                         _mm_sub_epi32(north_hi, south_hi),
+                                         a, b, c, s2));
+    }
+    for (; x < count; x++) {
+        int gx, gy;
+        HornGradient(center + x, stride, &gx, &gy);
+        float shade = (static_cast<float>(light.a) +
+                       static_cast<float>(light.b) * gx +
+                       static_cast<float>(light.c) * gy) /
+                      sqrtf(1 + static_cast<float>(light.s2) *
+                                (float(gx) * gx + float(gy) * gy));
+        int value = static_cast<int>(std::max(0.0f, shade) * 255 + 0.5f);
+        dest[x] = GrayPixel(value);
+    }
+}
+
+PixelBuf ColorHillshade(const ElevationBuf16 &heights, double mpp,
+                        double azimuth, double altitude, DHMKernelImpl impl)
+{
+    int width = heights.GetWidth() - 2;
+    int height = heights.GetHeight() - 2;
+    if (width < 0 || height < 0) {
+        throw std::runtime_error(
+                "Hillshade needs heights around the region.");
+    }
+    PixelBuf result(width, height);
+    HillshadeLight light(mpp, azimuth, altitude);
+    if (impl == DHM_KERNEL_REFERENCE) {
+        ColorHillshadeReference(heights, light, &result);
+        return result;
+    }
+
+    int stride = heights.GetWidth();
+    auto color_rows = [&heights, &result, &light, width, stride]
+                      (int y0, int y1)
+    {
+        for (int y = y0; y < y1; y++) {
+            hillshade_row(heights.GetValuePtr(1, y + 1), stride, width,
+                          light, result.GetPixelPtr(0, y));
+        }
+    };
+    RunRowBands(width, height, impl, color_rows);
     return result;
 }
-#undef DEST
-#undef SRC
+
+PixelBuf HillshadeMap::GetRegion(
+        const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) const
+{
+    auto fixed_bounds_pb = GetRegion_BoundsHelper(*this, pos, size);
+    if (fixed_bounds_pb.GetData())
+        return fixed_bounds_pb;
+
+    double mpp;
+    if (!MetersPerPixel(m_orig_map, pos + size/2, &mpp)) {
+        // Return zero-initialized memory block.
+        return PixelBuf(size.x, size.y);
+    }
+    MapPixelCoordInt req_pos = pos - MapPixelDeltaInt(1, 1);
+    MapPixelDeltaInt req_size = size + MapPixelDeltaInt(2, 2);
+    return ColorHillshade(m_orig_map->GetElevationRegion(req_pos, req_size),
+                          mpp, m_azimuth, m_altitude);
+}
@@ -5,10 +5,14 @@
 #include <algorithm>
 #include <cmath>
 #include <map>
+#include <vector>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/lock_guard.hpp>
+#include <boost/atomic.hpp>
+
+#include <emmintrin.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,10 +29,15 @@
 #include "rastermap.h"
 #include "map_geotiff.h"
 #include "projection.h"
+#include "lrucache.h"
 #include "util.h"
 
 const char * const DEFAULT_ENCODING = "UTF-8";
 
+// Stripped images are decoded in bands of at least this many rows, as every
+// TIFFRGBAImageGet() call has considerable setup costs.
+static const int MIN_STRIP_BAND_ROWS = 64;
+
 // Map between the unit square (x and y in [0, 1]) and a general
 // quadrilateral using bilinear interpolation.
 // Normalized coordinates are given as UnitSquareCoord.
@@ -132,10 +141,119 @@ class GeoTiffHandle {
         GTIF *m_gtif;
 };
 
+/** A set of interchangeable `TiffHandle`s to one image within a TIFF file.
+ *
+ * A libtiff handle tracks the current directory, decoder state and file
+ * position, so it can't be used by multiple threads at once. Readers
+ * borrow a handle of their own for the duration of a read via `Lease`.
+ * Handles are opened on first demand and kept for reuse afterwards, so
+ * the pool grows to the peak number of concurrent readers.
+ *
+ * @locking `m_mutex` protects the list of idle handles. Opening a new
+ * handle happens without holding the lock.
+ */
+class TiffHandlePool {
+    public:
+        /** Prepare handles for the image at `directory` in the main IFD
+         * chain, or at the SubIFD at `subifd_offset` if it is nonzero.
+         */
+        TiffHandlePool(const std::wstring &fname, tdir_t directory,
+                       toff_t subifd_offset)
+            : m_fname(fname), m_directory(directory),
+              m_subifd_offset(subifd_offset), m_mutex(), m_idle()
+        {};
+
+        /** Exclusive use of one handle of the pool while in scope. */
+        class Lease {
+            public:
+                explicit Lease(TiffHandlePool &pool)
+                    : m_pool(pool), m_handle(pool.Acquire())
+                {};
+                ~Lease() { m_pool.Release(m_handle); };
+                TIFF *GetTIFF() { return m_handle->GetTIFF(); };
+            private:
+                DISALLOW_COPY_AND_ASSIGN(Lease);
+                TiffHandlePool &m_pool;
+                std::shared_ptr<TiffHandle> m_handle;
+        };
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TiffHandlePool);
+
+        std::shared_ptr<TiffHandle> Acquire() {
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                if (!m_idle.empty()) {
+                    auto handle = m_idle.back();
+                    m_idle.pop_back();
+                    return handle;
+                }
+            }
+            auto handle = std::make_shared<TiffHandle>(m_fname);
+            if (m_subifd_offset) {
+                if (!TIFFSetSubDirectory(handle->GetTIFF(), m_subifd_offset)) {
+                    throw std::runtime_error("Failed to open TIFF SubIFD.");
+                }
+            } else if (m_directory) {
+                if (!TIFFSetDirectory(handle->GetTIFF(), m_directory)) {
+                    throw std::runtime_error("Failed to open TIFF directory.");
+                }
+            }
+            return handle;
+        }
+        void Release(const std::shared_ptr<TiffHandle> &handle) {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_idle.push_back(handle);
+        }
+
+        const std::wstring m_fname;
+        const tdir_t m_directory;
+        const toff_t m_subifd_offset;
+        boost::mutex m_mutex;
+        std::vector<std::shared_ptr<TiffHandle>> m_idle;
+};
+
+/** A reduced-resolution version of the main image within a TIFF file.
+ *
+ * Overviews are either stored as additional images in the main IFD chain
+ * (marked with `FILETYPE_REDUCEDIMAGE`, as GDAL does), or as SubIFDs of the
+ * main image.
+ */
+struct TiffOverview {
+    TiffOverview()
+        : reduction(0), directory(0), subifd_offset(0), width(0), height(0),
+          readers()
+    {};
+
+    /** The power-of-two factor by which the overview is scaled down. */
+    unsigned int reduction;
+    /** Index within the main IFD chain, if `subifd_offset` is zero. */
+    tdir_t directory;
+    /** File offset of the SubIFD, or zero. */
+    toff_t subifd_offset;
+    unsigned int width, height;
+    /** Handles positioned at the overview directory. */
+    std::shared_ptr<TiffHandlePool> readers;
+};
+
+/** Full-width bands of stripped images, keyed by (TIFF, reduction, band).
+ *
+ * The cache is shared by all stripped TIFFs, so that its budget bounds the
+ * total memory use. TIFFs are identified by serial numbers rather than by
+ * address, so a new TIFF never sees the bands of a deleted one.
+ */
+typedef std::tuple<unsigned long long, unsigned int, int> StripBandKey;
+static LRUCache<StripBandKey, PixelBuf> StripCache(
+        TiffMap::STRIP_CACHE_BUDGET);
+static boost::atomic<unsigned long long> NextStripCacheID(0);
+
+/** Cf. `TiffMap::SetDirectTileReads()`. */
+static boost::atomic<bool> DirectTileReads(true);
+
 class Tiff {
     public:
         explicit Tiff(const std::wstring &fname);
-        virtual ~Tiff() { };
+        virtual ~Tiff();
         TIFF *GetTIFF() { return m_rawtiff; };
         unsigned int GetWidth() const { return m_width; };
         unsigned int GetHeight() const { return m_height; };
@@ -145,6 +263,28 @@ class Tiff {
                 const class MapPixelCoordInt &pos,
                 const class MapPixelDeltaInt &size) const;
 
+        /** Read a region from the overview scaled down by `reduction`.
+         *
+         * `pos` and `size` are given in full-resolution pixels. Only
+         * reductions returned by `GetNativeReduction()` are supported.
+         */
+        PixelBuf GetRegionReduced(
+                const class MapPixelCoordInt &pos,
+                const class MapPixelDeltaInt &size,
+                unsigned int reduction) const;
+
+        /** Largest overview reduction not exceeding `reduction`, or 1. */
+        unsigned int GetNativeReduction(unsigned int reduction) const;
+
+        /** Read 16 bit heights without packing them into pixels.
+         *
+         * Only valid if `HasHeightSamples()`. Tiled DHMs are read without
+         * intermediate `PixelBuf`.
+         */
+        ElevationBuf16 GetElevationRegion(
+                const class MapPixelCoordInt &pos,
+                const class MapPixelDeltaInt &size) const;
+
         template <typename T>
         std::tuple<unsigned int, const T*>
         GetField(ttag_t field) const;
@@ -156,17 +296,55 @@ class Tiff {
         const std::wstring m_fname;
         std::wstring m_title;
         std::wstring m_description;
+        /** Handle for metadata access, always at the main image.
+         *
+         * Pixel data is read via `m_readers` instead, so that concurrent
+         * reads don't interfere with each other.
+         */
         TiffHandle m_tiffhandle;
         TIFF *m_rawtiff;
 
         virtual void Hook_TIFFRGBAImageGet(TIFFRGBAImage &img) const {};
+        /** Return `true` if pixels are 16 bit heights rather than colors.
+         *
+         * Heights are stored sign-extended in the 32 bit pixels, cf.
+         * `put16bitbw_DHM()`.
+         */
+        virtual bool HasHeightSamples() const { return false; };
     private:
         unsigned int m_width, m_height;
         unsigned short int m_bitspersample, m_samplesperpixel;
-
+        mutable TiffHandlePool m_readers;
+        // Sorted by increasing reduction.
+        std::vector<TiffOverview> m_overviews;
+        /** Identifies our bands in `StripCache`, cf. `ReadRegion()`. */
+        const unsigned long long m_strip_cache_id;
+
+        void FindOverviews();
+        void AddOverviewCandidate(tdir_t directory, toff_t subifd_offset);
+        PixelBuf ReadRegion(
+                TIFF *tif, unsigned int reduction,
+                unsigned int width, unsigned int height,
+                const class MapPixelCoordInt &pos,
+                const class MapPixelDeltaInt &size) const;
+        PixelBuf ReadStripBand(
+                TIFF *tif, unsigned int reduction,
+                unsigned int width, unsigned int height,
+                int band, int band_rows) const;
         PixelBuf DoGetRegion(
+                TIFF *tif, unsigned int width, unsigned int height,
                 const class MapPixelCoordInt &pos,
                 const class MapPixelDeltaInt &size) const;
+        /** Read a region via `TIFFReadTile()`, bypassing TIFFRGBAImage.
+         *
+         * Only common layouts are supported, cf. `GetDirectFormat()`.
+         * Returns `false` if `tif` needs the generic TIFFRGBAImage path.
+         */
+        bool ReadTilesDirect(
+                TIFF *tif, unsigned int width, unsigned int height,
+                const class MapPixelCoordInt &pos,
+                const class MapPixelDeltaInt &size,
+                PixelBuf *result) const;
 };
 
 class GeoTiff : public Tiff {
@@ -198,6 +376,9 @@ class GeoTiff : public Tiff {
         GTIF *m_rawgtif;
 
         virtual void Hook_TIFFRGBAImageGet(TIFFRGBAImage &img) const;
+        virtual bool HasHeightSamples() const {
+            return GetType() == RasterMap::TYPE_DHM;
+        };
     private:
         bool CheckDHMValid() const;
 
@@ -235,9 +416,128 @@ static void put16bitbw_DHM(
 }
 
 
+// Row converters for `Tiff::ReadTilesDirect()`. They produce exactly the
+// pixels TIFFRGBAImageGet() would for the respective formats.
+typedef void (*RowConverter)(const unsigned char *src, unsigned int *dest,
+                             int count, int samples);
+
+// 8 bit RGB, possibly followed by ignored extra samples. Alpha is opaque.
+static void convert_rgb8(const unsigned char *src, unsigned int *dest,
+                         int count, int samples)
+{
+    for (int i = 0; i < count; i++, src += samples) {
+        dest[i] = src[0] | (src[1] << 8) | (src[2] << 16) | 0xff000000;
+    }
+}
+
+// 8 bit RGBA with associated alpha, which is just a copy.
+static void convert_rgba8(const unsigned char *src, unsigned int *dest,
+                          int count, int samples)
+{
+    memcpy(dest, src, count * 4);
+}
+
+// 16 bit heights, sign-extended to 32 bit. Cf. put16bitbw_DHM().
+static void convert_height16(const unsigned char *src, unsigned int *dest,
+                             int count, int samples)
+{
+    const int16 *wp = reinterpret_cast<const int16*>(src);
+    int i = 0;
+    if (samples == 1) {
+        // Sign-extend eight heights at once: move them to the upper half of
+        // 32 bit lanes, then shift them back arithmetically.
+        for (; i + 8 <= count; i += 8) {
+            __m128i h = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(wp + i));
+            __m128i zero = _mm_setzero_si128();
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(zero, h), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(zero, h), 16);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), lo);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 4), hi);
+        }
+    }
+    for (; i < count; i++) {
+        dest[i] = static_cast<uint32>(wp[i * samples]);
+    }
+}
+
+struct DirectFormat {
+    DirectFormat() : convert(nullptr), samples(0), bytes_per_pixel(0) {};
+    RowConverter convert;
+    int samples;
+    int bytes_per_pixel;
+};
+
+// Find the row converter for the layout of `tif`. Returns a `DirectFormat`
+// without converter if the generic TIFFRGBAImage path has to be used.
+//
+// For YCbCr JPEG images, libjpeg is asked to convert to RGB. This modifies
+// `tif`, just like TIFFRGBAImageBegin() would.
+static DirectFormat GetDirectFormat(TIFF *tif, bool height_samples) {
+    DirectFormat result;
+    if (!DirectTileReads) {
+        return result;
+    }
+    uint16 bits = 0, samples = 0, planar = 0, photometric = 0;
+    uint16 orientation = 0, compression = 0;
+    if (!TIFFIsTiled(tif) ||
+        !TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits) ||
+        !TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples) ||
+        !TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar) ||
+        !TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &orientation) ||
+        !TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression) ||
+        !TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric))
+    {
+        return result;
+    }
+    if (planar != PLANARCONFIG_CONTIG || orientation != ORIENTATION_TOPLEFT) {
+        return result;
+    }
+    if (height_samples) {
+        if (bits == 16 && (photometric == PHOTOMETRIC_MINISBLACK ||
+                           photometric == PHOTOMETRIC_MINISWHITE))
+        {
+            result.convert = convert_height16;
+            result.samples = samples;
+            result.bytes_per_pixel = 2 * samples;
+        }
+        return result;
+    }
+    if (bits != 8 || samples < 3) {
+        return result;
+    }
+    if (photometric == PHOTOMETRIC_YCBCR && compression == COMPRESSION_JPEG) {
+        if (samples != 3) {
+            return result;
+        }
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+    } else if (photometric != PHOTOMETRIC_RGB) {
+        return result;
+    }
+
+    uint16 num_extra = 0;
+    uint16 *extra = nullptr;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_EXTRASAMPLES, &num_extra, &extra);
+    result.samples = samples;
+    result.bytes_per_pixel = samples;
+    if (num_extra == 0) {
+        // Without declared alpha, extra samples are ignored.
+        result.convert = convert_rgb8;
+    } else if (samples == 4 && (extra[0] == EXTRASAMPLE_ASSOCALPHA ||
+                                extra[0] == EXTRASAMPLE_UNSPECIFIED)) {
+        // TIFFRGBAImage treats unspecified extra samples as associated
+        // alpha. Unassociated alpha would need premultiplication, leave it
+        // to the generic path.
+        result.convert = convert_rgba8;
+    }
+    return result;
+}
+
+
 Tiff::Tiff(const std::wstring &fname)
     : m_fname(fname), m_title(), m_description(), m_tiffhandle(fname),
-      m_rawtiff(m_tiffhandle.GetTIFF())
+      m_rawtiff(m_tiffhandle.GetTIFF()), m_readers(fname, 0, 0),
+      m_strip_cache_id(NextStripCacheID++)
 {
     if (!TIFFGetField(m_rawtiff, TIFFTAG_IMAGEWIDTH, &m_width) ||
         !TIFFGetField(m_rawtiff, TIFFTAG_IMAGELENGTH, &m_height)) {
@@ -257,24 +557,134 @@ Tiff::Tiff(const std::wstring &fname)
     if (TIFFGetField(m_rawtiff, TIFFTAG_IMAGEDESCRIPTION, &description)) {
         m_description = WStringFromString(description, DEFAULT_ENCODING);
     }
+    FindOverviews();
 };
 
+Tiff::~Tiff() {
+    // Nobody can ask for our bands any more, free their memory right away.
+    const unsigned long long id = m_strip_cache_id;
+    StripCache.EraseIf([id](const StripBandKey &key) {
+        return std::get<0>(key) == id;
+    });
+}
+
+void Tiff::FindOverviews() {
+    // Copy the SubIFD offsets, libtiff reuses the memory on directory change.
+    std::vector<toff_t> subifds;
+    uint16 num_subifds = 0;
+    toff_t *subifd_offsets = NULL;
+    if (TIFFGetField(m_rawtiff, TIFFTAG_SUBIFD,
+                     &num_subifds, &subifd_offsets))
+    {
+        subifds.assign(subifd_offsets, subifd_offsets + num_subifds);
+    }
+    for (auto it = subifds.cbegin(); it != subifds.cend(); ++it) {
+        if (TIFFSetSubDirectory(m_rawtiff, *it)) {
+            AddOverviewCandidate(0, *it);
+        }
+    }
+    for (tdir_t dir = 1; TIFFSetDirectory(m_rawtiff, dir); ++dir) {
+        AddOverviewCandidate(dir, 0);
+    }
+    // Everybody else (GeoTIFF keys, RGBA access) expects the main image.
+    if (!TIFFSetDirectory(m_rawtiff, 0)) {
+        throw std::runtime_error("Failed to rewind TIFF directory.");
+    }
+
+    std::sort(m_overviews.begin(), m_overviews.end(),
+              [](const TiffOverview &lhs, const TiffOverview &rhs) {
+                  return lhs.reduction < rhs.reduction;
+              });
+}
+
+void Tiff::AddOverviewCandidate(tdir_t directory, toff_t subifd_offset) {
+    uint32 subfiletype = 0;
+    TIFFGetFieldDefaulted(m_rawtiff, TIFFTAG_SUBFILETYPE, &subfiletype);
+    if (!(subfiletype & FILETYPE_REDUCEDIMAGE) ||
+        (subfiletype & FILETYPE_MASK))
+    {
+        return;
+    }
+
+    uint32 width = 0, height = 0;
+    uint16 bitspersample = 0, samplesperpixel = 0;
+    if (!TIFFGetField(m_rawtiff, TIFFTAG_IMAGEWIDTH, &width) ||
+        !TIFFGetField(m_rawtiff, TIFFTAG_IMAGELENGTH, &height) ||
+        !TIFFGetField(m_rawtiff, TIFFTAG_BITSPERSAMPLE, &bitspersample) ||
+        !TIFFGetField(m_rawtiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel))
+    {
+        return;
+    }
+    if (!width || !height ||
+        bitspersample != m_bitspersample ||
+        samplesperpixel != m_samplesperpixel)
+    {
+        return;
+    }
+
+    // Only power-of-two overviews are useful for us. Writers round the
+    // overview size either up or down, so allow one pixel of slack.
+    unsigned int reduction = round_to_int(
+            static_cast<double>(m_width) / width);
+    if (reduction < 2 || (reduction & (reduction - 1)) != 0) {
+        return;
+    }
+    unsigned int exp_width = (m_width + reduction - 1) / reduction;
+    unsigned int exp_height = (m_height + reduction - 1) / reduction;
+    if (width + 1 < exp_width || width > exp_width ||
+        height + 1 < exp_height || height > exp_height)
+    {
+        return;
+    }
+    for (auto it = m_overviews.cbegin(); it != m_overviews.cend(); ++it) {
+        if (it->reduction == reduction) {
+            return;
+        }
+    }
+
+    TiffOverview overview;
+    overview.reduction = reduction;
+    overview.directory = directory;
+    overview.subifd_offset = subifd_offset;
+    overview.width = width;
+    overview.height = height;
+    overview.readers = std::make_shared<TiffHandlePool>(
+            m_fname, directory, subifd_offset);
+    m_overviews.push_back(overview);
+}
+
+unsigned int Tiff::GetNativeReduction(unsigned int reduction) const {
+    unsigned int result = 1;
+    for (auto it = m_overviews.cbegin(); it != m_overviews.cend(); ++it) {
+        if (it->reduction <= reduction) {
+            result = it->reduction;
+        }
+    }
+    return result;
+}
+
 PixelBuf
-Tiff::DoGetRegion(const MapPixelCoordInt &pos,
+Tiff::DoGetRegion(TIFF *tif, unsigned int width, unsigned int height,
+                  const MapPixelCoordInt &pos,
                   const MapPixelDeltaInt &size) const
 {
     MapPixelCoordInt endpos = pos + size;
     if (endpos.x <= 0 || endpos.y <= 0 ||
-        pos.x >= static_cast<int>(m_width) ||
-        pos.y >= static_cast<int>(m_height))
+        pos.x >= static_cast<int>(width) ||
+        pos.y >= static_cast<int>(height))
     {
         return PixelBuf(size.x, size.y);
     }
 
+    PixelBuf direct;
+    if (ReadTilesDirect(tif, width, height, pos, size, &direct)) {
+        return direct;
+    }
+
     TIFFRGBAImage img;
     char emsg[1024] = "";
-    if (!TIFFRGBAImageOK(m_rawtiff, emsg) ||
-        !TIFFRGBAImageBegin(&img, m_rawtiff, 0, emsg)) {
+    if (!TIFFRGBAImageOK(tif, emsg) ||
+        !TIFFRGBAImageBegin(&img, tif, 0, emsg)) {
         throw std::runtime_error("TIFF RGBA access not possible.");
     }
 
@@ -294,55 +704,256 @@ Tiff::DoGetRegion(const MapPixelCoordInt &pos,
     return result;
 }
 
+// Read the tiles of `tif` covering a region and pass their rows on.
+//
+// `write_row(src, x, y, count)` gets `count` pixels for the region-relative
+// `x` and `y`, counted top-down. Return `false` if the tile size is
+// unusable or tiles don't hold `bytes_per_pixel` per pixel.
+template <typename RowWriter>
+static bool ReadTiles(TIFF *tif, unsigned int width, unsigned int height,
+                      const MapPixelCoordInt &pos,
+                      const MapPixelDeltaInt &size,
+                      int bytes_per_pixel, const RowWriter &write_row)
+{
+    uint32 tile_w = 0, tile_h = 0;
+    if (!TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_w) ||
+        !TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_h) ||
+        tile_w == 0 || tile_h == 0)
+    {
+        return false;
+    }
+    // Only query the size after GetDirectFormat() set the JPEG color mode.
+    tmsize_t tile_bytes = TIFFTileSize(tif);
+    if (tile_bytes < static_cast<tmsize_t>(
+                tile_w * tile_h * bytes_per_pixel))
+    {
+        return false;
+    }
+
+    // Keep the arithmetic signed, pos may be negative.
+    int tw = static_cast<int>(tile_w);
+    int th = static_cast<int>(tile_h);
+    MapPixelCoordInt end = pos + size;
+    int x0 = std::max(pos.x, 0);
+    int y0 = std::max(pos.y, 0);
+    int x1 = std::min(end.x, static_cast<int>(width));
+    int y1 = std::min(end.y, static_cast<int>(height));
+
+    std::vector<unsigned char> tile(static_cast<size_t>(tile_bytes));
+    for (int ty = y0 / th * th; ty < y1; ty += th) {
+        for (int tx = x0 / tw * tw; tx < x1; tx += tw) {
+            if (TIFFReadTile(tif, &tile[0], tx, ty, 0, 0) < 0) {
+                throw std::runtime_error("Loading TIFF data failed.");
+            }
+            int cx0 = std::max(tx, x0), cx1 = std::min(tx + tw, x1);
+            int cy0 = std::max(ty, y0), cy1 = std::min(ty + th, y1);
+            for (int y = cy0; y < cy1; y++) {
+                const unsigned char *src = &tile[
+                        ((y - ty) * tw + (cx0 - tx)) * bytes_per_pixel];
+                write_row(src, cx0 - pos.x, y - pos.y, cx1 - cx0);
+            }
+        }
+    }
+    return true;
+}
+
+bool
+Tiff::ReadTilesDirect(TIFF *tif, unsigned int width, unsigned int height,
+                      const MapPixelCoordInt &pos,
+                      const MapPixelDeltaInt &size,
+                      PixelBuf *result) const
+{
+    DirectFormat format = GetDirectFormat(tif, HasHeightSamples());
+    if (format.convert == nullptr) {
+        return false;
+    }
+    PixelBuf pixels(size.x, size.y);
+    bool ok = ReadTiles(tif, width, height, pos, size, format.bytes_per_pixel,
+        [&](const unsigned char *src, int x, int y, int count) {
+            // PixelBufs are stored bottom-up, TIFFs top-down.
+            format.convert(src, pixels.GetPixelPtr(x, size.y - 1 - y),
+                           count, format.samples);
+        });
+    if (ok) {
+        *result = pixels;
+    }
+    return ok;
+}
+
+ElevationBuf16
+Tiff::GetElevationRegion(const MapPixelCoordInt &pos,
+                         const MapPixelDeltaInt &size) const
+{
+    if (!HasHeightSamples()) {
+        throw std::runtime_error("Elevation data requires a DHM.");
+    }
+    TiffHandlePool::Lease lease(m_readers);
+    TIFF *tif = lease.GetTIFF();
+
+    DirectFormat format = GetDirectFormat(tif, true);
+    if (format.convert != nullptr) {
+        ElevationBuf16 heights(size.x, size.y);
+        int samples = format.samples;
+        bool ok = ReadTiles(tif, m_width, m_height, pos, size,
+                            format.bytes_per_pixel,
+            [&](const unsigned char *src, int x, int y, int count) {
+                const int16 *wp = reinterpret_cast<const int16*>(src);
+                int16_t *dest = heights.GetValuePtr(x, size.y - 1 - y);
+                if (samples == 1) {
+                    memcpy(dest, wp, count * sizeof(*dest));
+                    return;
+                }
+                for (int i = 0; i < count; i++) {
+                    dest[i] = wp[i * samples];
+                }
+            });
+        if (ok) {
+            return heights;
+        }
+    }
+    // Stripped and uncommon layouts.
+    return ElevationBuf16::FromPixelBuf(
+            ReadRegion(tif, 1, m_width, m_height, pos, size));
+}
+
 PixelBuf
 Tiff::GetRegion(const MapPixelCoordInt &pos,
                 const MapPixelDeltaInt &size) const
 {
-    if (TIFFIsTiled(m_rawtiff))
-        return DoGetRegion(pos, size);
+    TiffHandlePool::Lease lease(m_readers);
+    return ReadRegion(lease.GetTIFF(), 1, m_width, m_height, pos, size);
+}
+
+PixelBuf
+Tiff::GetRegionReduced(const MapPixelCoordInt &pos,
+                       const MapPixelDeltaInt &size,
+                       unsigned int reduction) const
+{
+    if (reduction == 1) {
+        return GetRegion(pos, size);
+    }
+    auto overview = std::find_if(m_overviews.begin(), m_overviews.end(),
+        [reduction](const TiffOverview &ov) {
+            return ov.reduction == reduction;
+    });
+    if (overview == m_overviews.end()) {
+        throw std::runtime_error("No TIFF overview for this reduction.");
+    }
+
+    // Keep the division signed, pos may be negative.
+    int r = static_cast<int>(reduction);
+    MapPixelCoordInt ov_pos(pos.x / r, pos.y / r);
+    MapPixelDeltaInt ov_size(size.x / r, size.y / r);
+    MapPixelCoordInt ov_end = ov_pos + ov_size;
+    int width = overview->width;
+    int height = overview->height;
+    TiffHandlePool::Lease lease(*overview->readers);
+    TIFF *tif = lease.GetTIFF();
+    if (ov_pos.x >= 0 && ov_pos.y >= 0 &&
+        ov_end.x <= width && ov_end.y <= height)
+    {
+        return ReadRegion(tif, reduction, width, height, ov_pos, ov_size);
+    }
+
+    // The overview is rounded differently than the full-resolution bounds
+    // checks assumed. Crop to what's actually there, cf.
+    // GetRegion_BoundsHelper().
+    auto result = PixelBuf(ov_size.x, ov_size.y);
+    auto crop_pos = MapPixelCoordInt(std::max(ov_pos.x, 0),
+                                     std::max(ov_pos.y, 0));
+    auto crop_end = MapPixelCoordInt(std::min(ov_end.x, width),
+                                     std::min(ov_end.y, height));
+    auto crop_size = crop_end - crop_pos;
+    if (crop_size.x <= 0 || crop_size.y <= 0) {
+        return result;
+    }
+    auto pixels = ReadRegion(tif, reduction, width, height,
+                             crop_pos, crop_size);
+    result.Insert(PixelBufCoord(crop_pos.x - ov_pos.x,
+                                ov_size.y - crop_size.y -
+                                (crop_pos.y - ov_pos.y)),
+                  pixels);
+    return result;
+}
+
+PixelBuf
+Tiff::ReadRegion(TIFF *tif, unsigned int reduction,
+                 unsigned int width, unsigned int height,
+                 const MapPixelCoordInt &pos,
+                 const MapPixelDeltaInt &size) const
+{
+    if (TIFFIsTiled(tif))
+        return DoGetRegion(tif, width, height, pos, size);
 
     // Handle stripped images:
     // TIFFRGBAImageGet ignores img.col_offset for stripped images.
     // It always returns data starting from the first column of the image.
     //
-    // So, fetch a full-width strip and copy the relevant portion into the
-    // output PixelBuf.
+    // So, fetch full-width bands of strips and copy the relevant portion
+    // into the output PixelBuf. Horizontally adjacent requests need the same
+    // bands, so they are kept in `StripCache`.
     auto result = PixelBuf(size.x, size.y);
     MapPixelCoordInt end = pos + size;
 
-    int strip_size = -1;
-    if (!TIFFGetFieldDefaulted(m_rawtiff, TIFFTAG_ROWSPERSTRIP, &strip_size)) {
+    uint32 rows_per_strip = 0;
+    if (!TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip)) {
         throw std::runtime_error("Failed getting TIF dimensions.");
     }
-    if (strip_size < 0) {
-        throw std::runtime_error("Stripped TIF image with strip height < 0?!");
-    }
-    if (static_cast<unsigned int>(strip_size) > m_height) {
-        // TIFFRGBAImageGet crashes when reading from an image where
-        // rows_per_strip > total_rows_in_image if more than
-        // total_rows_in_image rows are requested.
-        //
-        // Cap the number of rows we try to read, in this case.
-        strip_size = m_height;
-    }
-
-    int first_ty = pos.y / strip_size;
-    int last_ty = (end.y - 1) / strip_size;
-    for (int ty = pos.y / strip_size; ty*strip_size < end.y; ty++) {
-        PixelBuf tile = DoGetRegion(
-                MapPixelCoordInt(0, ty*strip_size),
-                MapPixelDeltaInt(m_width, strip_size));
-        if (!tile.GetData()) {
+    if (rows_per_strip == 0) {
+        throw std::runtime_error("Stripped TIF image with strip height <= 0?!");
+    }
+    // Single-strip images have 2^32-1 rows per strip (the default). Clamp
+    // to the image, so the band arithmetic stays within range.
+    int strip_size = static_cast<int>(
+            std::min(rows_per_strip, std::max(height, 1U)));
+    int band_rows = (MIN_STRIP_BAND_ROWS + strip_size - 1) / strip_size *
+                    strip_size;
+    int rows = static_cast<int>(height);
+    for (int band = std::max(pos.y, 0) / band_rows;
+         band * band_rows < end.y && band * band_rows < rows;
+         band++)
+    {
+        PixelBuf pixels = ReadStripBand(tif, reduction, width, height,
+                                        band, band_rows);
+        if (!pixels.GetData()) {
             continue;
         }
+        // PixelBufs are stored bottom-up.
+        int top = band * band_rows - pos.y;
         auto insert_pos = PixelBufCoord(
                 -pos.x,
-                (last_ty - ty + first_ty) * strip_size - pos.y);
-        result.Insert(insert_pos, tile);
+                size.y - top - static_cast<int>(pixels.GetHeight()));
+        result.Insert(insert_pos, pixels);
     }
     return result;
 }
 
+PixelBuf
+Tiff::ReadStripBand(TIFF *tif, unsigned int reduction,
+                    unsigned int width, unsigned int height,
+                    int band, int band_rows) const
+{
+    // Concurrent misses for the same band may decode it more than once,
+    // that's cheaper than holding a lock while decoding.
+    StripBandKey key(m_strip_cache_id, reduction, band);
+    PixelBuf pixels;
+    if (StripCache.Get(key, &pixels)) {
+        return pixels;
+    }
+    // TIFFRGBAImageGet crashes when reading beyond the last row of the
+    // image, so the last band may be shorter.
+    int top = band * band_rows;
+    int rows = std::min(band_rows, static_cast<int>(height) - top);
+    pixels = DoGetRegion(tif, width, height,
+                         MapPixelCoordInt(0, top),
+                         MapPixelDeltaInt(width, rows));
+    if (pixels.GetData()) {
+        StripCache.Put(key, pixels, pixels.GetWidth() * pixels.GetHeight() *
+                                    sizeof(*pixels.GetRawData()));
+    }
+    return pixels;
+}
+
 template <typename T>
 std::tuple<unsigned int, const T*>
 Tiff::GetField(ttag_t field) const {
@@ -355,16 +966,17 @@ Tiff::GetField(ttag_t field) const {
     return std::make_tuple(length, data);
 }
 
+/** Full paths of the csv data files, cf. `CSVFileOverride()`. */
+static boost::mutex strmap_mutex;
+static std::map<std::string, const char *> strmap;
+
 /**
  * Internal callback to resolve csv data filenames to full paths.
  *
- * @locking Acquires an internal ``std::mutex``. No external calls are made
- * with that mutex held.
+ * @locking Acquires ``strmap_mutex``. No external calls are made with that
+ * mutex held.
  */
 static const char *CSVFileOverride(const char * input_fname) {
-    static boost::mutex strmap_mutex;
-    static std::map<std::string, const char *> strmap;
-
     {
         boost::lock_guard<boost::mutex> lock(strmap_mutex);
         auto result = strmap.find(input_fname);
@@ -665,10 +1277,62 @@ PixelBuf TiffMap::GetRegion(
     if (fixed_bounds_pb.GetData())
         return fixed_bounds_pb;
 
-    boost::lock_guard<boost::mutex> lock(m_getregion_mutex);
     return m_geotiff->GetRegion(pos, size);
 }
 
+PixelBuf TiffMap::GetRegionReduced(
+                      const MapPixelCoordInt &pos,
+                      const MapPixelDeltaInt &size,
+                      unsigned int reduction) const
+{
+    if (reduction == 1) {
+        return GetRegion(pos, size);
+    }
+    if (GetType() == TYPE_DHM) {
+        return GeoDrawable::GetRegionReduced(pos, size, reduction);
+    }
+    // Read from the closest overview, then scale down the rest of the way.
+    unsigned int native = m_geotiff->GetNativeReduction(reduction);
+    if (native == 1) {
+        return GeoDrawable::GetRegionReduced(pos, size, reduction);
+    }
+    return GetRegionReduced_ShrinkHelper(
+        [this, native](const MapPixelCoordInt &pos,
+                       const MapPixelDeltaInt &size) -> PixelBuf {
+            return m_geotiff->GetRegionReduced(pos, size, native);
+        }, pos, size, reduction, native);
+}
+
+ElevationBuf16 TiffMap::GetElevationRegion(
+                      const MapPixelCoordInt &pos,
+                      const MapPixelDeltaInt &size) const
+{
+    if (GetType() != TYPE_DHM) {
+        return RasterMap::GetElevationRegion(pos, size);
+    }
+    auto fixed_bounds_eb = GetElevationRegion_BoundsHelper(*this, pos, size);
+    if (fixed_bounds_eb.GetRawData())
+        return fixed_bounds_eb;
+
+    return m_geotiff->GetElevationRegion(pos, size);
+}
+
+unsigned int TiffMap::GetNativeReduction(unsigned int reduction) const {
+    return m_geotiff->GetNativeReduction(reduction);
+}
+
+CacheStats TiffMap::GetStripCacheStats() {
+    return StripCache.GetStats();
+}
+
+void TiffMap::SetStripCacheBudget(size_t budget_bytes) {
+    StripCache.SetBudget(budget_bytes);
+}
+
+void TiffMap::SetDirectTileReads(bool enabled) {
+    DirectTileReads = enabled;
+}
+
 bool TiffMap::PixelToPCS(double *x, double *y) const
     { return m_geotiff->PixelToPCS(x, y); }
 bool TiffMap::PCSToPixel(double *x, double *y) const
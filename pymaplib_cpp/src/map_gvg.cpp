@@ -6,14 +6,22 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include <map>
 #include <regex>
 #include <sstream>
 
-#include <boost/thread/locks.hpp>
-#include <boost/thread/lock_types.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/atomic.hpp>
+
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+#  include <immintrin.h>
+#endif
 
 #include "memjpeg.h"
 #include "util.h"
+#include "threading.h"
 
 // GVG maps consist of two files:
 // * 13.gvg: Geospatial and other metadata.
@@ -313,19 +321,139 @@ static const unsigned char cypher_table[8][256] = {
     },
 };
 
+static void decrypt_scalar(const unsigned char *src, unsigned char *dest,
+                           size_t size, unsigned long long int salt)
+{
+    // Use pointer arithmetic, iterators are too slow in debug builds.
+    unsigned char salt_char = static_cast<unsigned char>(salt);
+    for (size_t i = 0; i < size; i++) {
+        dest[i] = cypher_table[(salt_char++) & 7][src[i]];
+    }
+}
+
+// The key repeats every 8 bytes. Resolve the table rows for one period up
+// front, so the loop body has neither the salt increment nor the masking.
+static void decrypt_unrolled(const unsigned char *src, unsigned char *dest,
+                             size_t size, unsigned long long int salt)
+{
+    const unsigned char *t0 = cypher_table[(salt + 0) & 7];
+    const unsigned char *t1 = cypher_table[(salt + 1) & 7];
+    const unsigned char *t2 = cypher_table[(salt + 2) & 7];
+    const unsigned char *t3 = cypher_table[(salt + 3) & 7];
+    const unsigned char *t4 = cypher_table[(salt + 4) & 7];
+    const unsigned char *t5 = cypher_table[(salt + 5) & 7];
+    const unsigned char *t6 = cypher_table[(salt + 6) & 7];
+    const unsigned char *t7 = cypher_table[(salt + 7) & 7];
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        dest[i + 0] = t0[src[i + 0]];
+        dest[i + 1] = t1[src[i + 1]];
+        dest[i + 2] = t2[src[i + 2]];
+        dest[i + 3] = t3[src[i + 3]];
+        dest[i + 4] = t4[src[i + 4]];
+        dest[i + 5] = t5[src[i + 5]];
+        dest[i + 6] = t6[src[i + 6]];
+        dest[i + 7] = t7[src[i + 7]];
+    }
+    decrypt_scalar(src + i, dest + i, size - i, salt + i);
+}
+
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+// `cypher_table` widened to 32 bits, for use with AVX2 dword gathers.
+static uint32_t cypher_table32[8 * 256];
+
+static bool init_cypher_table32() {
+    for (int i = 0; i < 8 * 256; i++) {
+        cypher_table32[i] = cypher_table[i / 256][i % 256];
+    }
+    return true;
+}
+static const bool cypher_table32_initialized = init_cypher_table32();
+
+// Each gather looks up 8 consecutive bytes, exactly one salt period. So the
+// table row offsets of the lanes are the same for every gather.
+static void decrypt_avx2(const unsigned char *src, unsigned char *dest,
+                         size_t size, unsigned long long int salt)
+{
+    const int s = static_cast<int>(salt & 7);
+    const __m256i rows = _mm256_setr_epi32(
+            ((s + 0) & 7) * 256, ((s + 1) & 7) * 256,
+            ((s + 2) & 7) * 256, ((s + 3) & 7) * 256,
+            ((s + 4) & 7) * 256, ((s + 5) & 7) * 256,
+            ((s + 6) & 7) * 256, ((s + 7) & 7) * 256);
+    // Undoes the lane interleaving of the two pack instructions below.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const int *table = reinterpret_cast<const int*>(cypher_table32);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v[4];
+        for (int j = 0; j < 4; j++) {
+            __m128i bytes = _mm_loadl_epi64(
+                    reinterpret_cast<const __m128i*>(src + i + 8 * j));
+            __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(bytes), rows);
+            v[j] = _mm256_i32gather_epi32(table, idx, 4);
+        }
+        __m256i lo = _mm256_packus_epi32(v[0], v[1]);
+        __m256i hi = _mm256_packus_epi32(v[2], v[3]);
+        __m256i res = _mm256_permutevar8x32_epi32(
+                _mm256_packus_epi16(lo, hi), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), res);
+    }
+    decrypt_unrolled(src + i, dest + i, size - i, salt + i);
+}
+#endif
+
+bool GVGDecryptSupported(GVGDecryptImpl impl) {
+    switch (impl) {
+        case GVG_DECRYPT_SCALAR:
+        case GVG_DECRYPT_UNROLLED:
+        case GVG_DECRYPT_BEST:
+            return true;
+        case GVG_DECRYPT_AVX2:
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+            return CPUSupportsAVX2();
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+void GVGDecrypt(const unsigned char *src, unsigned char *dest,
+                size_t size, unsigned long long int salt,
+                GVGDecryptImpl impl)
+{
+    if (impl == GVG_DECRYPT_BEST) {
+        impl = GVGDecryptSupported(GVG_DECRYPT_AVX2) ? GVG_DECRYPT_AVX2
+                                                     : GVG_DECRYPT_UNROLLED;
+    }
+    switch (impl) {
+        case GVG_DECRYPT_SCALAR:
+            decrypt_scalar(src, dest, size, salt);
+            return;
+        case GVG_DECRYPT_UNROLLED:
+            decrypt_unrolled(src, dest, size, salt);
+            return;
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+        case GVG_DECRYPT_AVX2:
+            if (CPUSupportsAVX2()) {
+                decrypt_avx2(src, dest, size, salt);
+                return;
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+    throw std::runtime_error("Unsupported GVG decryption implementation.");
+}
+
 // Decrypt the buffer ``buf`` in-place.
 // ``offset`` is the position of ``buf`` within the file being read
 // (measured as bytes from the beginning of the file).
 static void decrypt_buf(std::string &buf, unsigned long long int salt) {
-    // Scribble directly into buf using pointer arithmetic.
-    // Using iterators would be better, but it's too slow in debug builds.
-    unsigned char salt_char = static_cast<unsigned char>(salt);
-    unsigned char *data = (unsigned char*)buf.data();
-    size_t buf_size = buf.size();
-    for (unsigned int i = 0; i < buf_size; i++) {
-        unsigned char c = data[i];
-        data[i] = cypher_table[(salt_char++) & 7][c];
-    }
+    unsigned char *data = reinterpret_cast<unsigned char*>(&buf[0]);
+    GVGDecrypt(data, data, buf.size(), salt);
 }
 
 
@@ -551,7 +679,7 @@ std::tuple<std::wstring, unsigned int> GVGFile::GmpPath(unsigned int n) const {
 
 
 GMPImage::GMPImage(const std::wstring &fname, int index, int64_t foffset) :
-    m_file(fname, std::ios::in | std::ios::binary),
+    m_file(std::make_shared<MappedFile>(fname)),
     m_fname(fname), m_findex(index), m_foffset(foffset),
     m_bfh(), m_bih_buf(), m_bih(nullptr), m_gmphdr(nullptr),
     m_tiles_x(0), m_tiles_y(0), m_tiles(0), m_tile_index(),
@@ -560,9 +688,20 @@ GMPImage::GMPImage(const std::wstring &fname, int index, int64_t foffset) :
     Init();
 }
 
+GMPImage::GMPImage(const std::shared_ptr<MappedFile> &file,
+                   int index, int64_t foffset) :
+    m_file(file),
+    m_fname(file->GetFname()), m_findex(index), m_foffset(foffset),
+    m_bfh(), m_bih_buf(), m_bih(nullptr), m_gmphdr(nullptr),
+    m_tiles_x(0), m_tiles_y(0), m_tiles(0), m_tile_index(),
+    m_topdown(false)
+{
+    Init();
+}
+
 GMPImage::GMPImage(const GMPImage &other) :
-    // Create a new ifstream from the same filename.
-    m_file(other.m_fname, std::ios::in | std::ios::binary),
+    // Positional reads don't interfere with each other, share the file.
+    m_file(other.m_file),
     m_fname(other.m_fname),
     m_findex(other.m_findex), m_foffset(other.m_foffset),
     m_bfh(other.m_bfh),
@@ -577,15 +716,14 @@ GMPImage::GMPImage(const GMPImage &other) :
 { }
 
 void GMPImage::Init() {
-    m_file.seekg(m_foffset);
-    m_file.read((char*)&m_bfh, sizeof(GMPBitmapFileHdr));
+    m_file->ReadAt(m_foffset, &m_bfh, sizeof(GMPBitmapFileHdr));
     if (m_bfh.bfType != 0x5847) {  // "GX"
         throw std::runtime_error("Wrong signature: not a valid GMP image");
     }
 
-    m_file.seekg(m_foffset + sizeof(GMPBitmapFileHdr));
     m_bih_buf.resize(m_bfh.bfOffBits - sizeof(GMPBitmapFileHdr));
-    m_file.read(&m_bih_buf[0], m_bih_buf.size());
+    m_file->ReadAt(m_foffset + sizeof(GMPBitmapFileHdr),
+                   &m_bih_buf[0], m_bih_buf.size());
 
     if (m_bih_buf.size() < sizeof(GMPBitmapInfoHdr)) {
         throw std::runtime_error("Invalid GMP Bitmap header: BIH missing.");
@@ -613,10 +751,9 @@ void GMPImage::Init() {
     m_tiles_y = (AnnouncedHeight() + TileHeight() - 1) / TileHeight();
     m_tiles = m_tiles_x * m_tiles_y;
 
-    m_file.seekg(m_foffset + m_bfh.bfOffBits);
     m_tile_index.resize(m_tiles);
-    m_file.read((char*)&m_tile_index[0],
-                sizeof(struct GMPTileOffset) * m_tiles);
+    m_file->ReadAt(m_foffset + m_bfh.bfOffBits, &m_tile_index[0],
+                   sizeof(struct GMPTileOffset) * m_tiles);
 }
 
 std::wstring GMPImage::DebugData() const {
@@ -668,9 +805,9 @@ int GMPImage::NumTilesX() const { return m_tiles_x; };
 int GMPImage::NumTilesY() const { return m_tiles_y; };
 int GMPImage::BitsPerPixel() const { return m_bih->biBitCount; };
 
-std::string GMPImage::LoadCompressedTile(long tx, long ty) const {
+MappedFile::View GMPImage::MapTile(long tx, long ty) const {
     if (tx < 0 || ty < 0 || tx >= (int)m_tiles_x || ty >= (int)m_tiles_y) {
-        return std::string();
+        return MappedFile::View();
     }
     unsigned int idx;
     if (m_topdown) {
@@ -679,30 +816,62 @@ std::string GMPImage::LoadCompressedTile(long tx, long ty) const {
         idx = tx + m_tiles_x * (m_tiles_y - ty - 1);
     }
     if (m_tile_index[idx].offset == -1 && m_tile_index[idx].length == 0)
-        return std::string();
-    if (m_tile_index[idx].length > std::numeric_limits<size_t>::max()) {
+        return MappedFile::View();
+    if (m_tile_index[idx].length < 0 ||
+        m_tile_index[idx].length > std::numeric_limits<size_t>::max())
+    {
         throw std::runtime_error("Malformed tile index.");
     }
-    size_t tile_buffer_sz = static_cast<size_t>(m_tile_index[idx].length);
-    m_file.seekg(m_foffset + m_bfh.bfOffBits + m_tile_index[idx].offset);
+    return m_file->Map(m_foffset + m_bfh.bfOffBits + m_tile_index[idx].offset,
+                       static_cast<size_t>(m_tile_index[idx].length));
+}
 
-    std::string tile(tile_buffer_sz, '\0');
-    m_file.read(&tile[0], tile_buffer_sz);
-    decrypt_buf(tile, m_tile_index[idx].length);
+std::string GMPImage::LoadCompressedTile(long tx, long ty) const {
+    MappedFile::View view = MapTile(tx, ty);
+    if (!view.GetSize()) {
+        return std::string();
+    }
+    std::string tile(view.GetSize(), '\0');
+    // The tile length is used as salt.
+    GVGDecrypt(view.GetData(), reinterpret_cast<unsigned char*>(&tile[0]),
+               view.GetSize(), view.GetSize());
     return tile;
 }
 
-PixelBuf GMPImage::LoadTile(long tx, long ty) const {
+bool GMPImage::ReadCompressedTile(long tx, long ty,
+                                  std::vector<unsigned char> *buffer) const
+{
+    MappedFile::View view = MapTile(tx, ty);
+    if (!view.GetSize()) {
+        return false;
+    }
+    // resize() keeps the capacity, so this only allocates for new maxima.
+    buffer->resize(view.GetSize());
+    GVGDecrypt(view.GetData(), &(*buffer)[0], view.GetSize(), view.GetSize());
+    return true;
+}
+
+/** Per-thread buffer for compressed tile data, see `GMPImage::LoadTile`. */
+static boost::thread_specific_ptr<std::vector<unsigned char>> TileScratch;
+
+PixelBuf GMPImage::LoadTile(long tx, long ty, unsigned int reduction) const {
     if (BitsPerPixel() == 24) {
-        std::string tile = LoadCompressedTile(tx, ty);
-        if (!tile.size()) {
+        // Decrypt straight from the file mapping into a buffer reused by
+        // all tile loads on this thread.
+        if (!TileScratch.get()) {
+            TileScratch.reset(new std::vector<unsigned char>());
+        }
+        std::vector<unsigned char> &tile = *TileScratch;
+        if (!ReadCompressedTile(tx, ty, &tile)) {
             // Most likely a request outside of the image area.
             // Return a correctly sized dummy image.
-            return PixelBuf(TileWidth(), TileHeight());
+            int r = static_cast<int>(reduction);
+            return PixelBuf((TileWidth() + r - 1) / r,
+                            (TileHeight() + r - 1) / r);
         }
         // Decompress jpeg while swapping R and B channels. No idea why
         // the data is encoded this way in the first place.
-        PixelBuf res = decompress_jpeg(tile, true);
+        PixelBuf res = decompress_jpeg(&tile[0], tile.size(), true, reduction);
         if (!res.GetData()) {
             throw std::runtime_error("Failed to decompress tile");
         }
@@ -714,18 +883,85 @@ PixelBuf GMPImage::LoadTile(long tx, long ty) const {
     return PixelBuf();
 }
 
-GMPImage MakeGmpImage(const std::wstring& path, unsigned int gmp_image_idx) {
-    int64_t foffset = 0;
-    auto fsize = GetFilesize(path);
-    int64_t filesize = GetFilesize(path);
-    for (int i = 0; foffset < filesize; i++) {
-        GMPImage image(path, i, foffset);
-        if (i == gmp_image_idx) {
-            return image;
+/** Start offsets of the images within GMP files.
+ *
+ * GMP files don't have a directory of their images. Finding image N means
+ * walking the tile indexes of images 0 to N-1, as each image starts after
+ * the last tile of the previous one. The offsets found are remembered per
+ * file, so every image is scanned at most once per session, no matter how
+ * many maps refer to the same GMP file. Entries are discarded when the size
+ * or modification time of the file changes.
+ *
+ * @locking `m_mutex` protects `m_files`. It is not held while scanning.
+ */
+class GMPOffsetDirectory {
+    public:
+        GMPOffsetDirectory() : m_mutex(), m_files() {};
+
+        /** Find the offset of image `index`, throw if there is none. */
+        int64_t ImageOffset(const std::shared_ptr<MappedFile> &file,
+                            unsigned int index)
+        {
+            FileOffsets known;
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                auto it = m_files.find(file->GetFname());
+                if (it != m_files.end() && it->second.Matches(*file)) {
+                    known = it->second;
+                }
+            }
+            if (known.offsets.empty()) {
+                known.size = file->GetSize();
+                known.mtime = file->GetModificationTime();
+                known.offsets.push_back(0);
+            }
+            size_t num_known = known.offsets.size();
+            while (known.offsets.size() <= index &&
+                   known.offsets.back() < known.size)
+            {
+                GMPImage image(file, static_cast<int>(known.offsets.size() - 1),
+                               known.offsets.back());
+                known.offsets.push_back(image.NextImageOffset());
+            }
+            if (known.offsets.size() > num_known) {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                FileOffsets &stored = m_files[file->GetFname()];
+                if (!stored.Matches(*file) ||
+                    stored.offsets.size() < known.offsets.size())
+                {
+                    stored = known;
+                }
+            }
+            if (index >= known.offsets.size() ||
+                known.offsets[index] >= known.size)
+            {
+                throw std::runtime_error("Could not find GMP image.");
+            }
+            return known.offsets[index];
         }
-        foffset = image.NextImageOffset();
-    }
-    throw std::runtime_error("Could not find GMP image.");
+    private:
+        DISALLOW_COPY_AND_ASSIGN(GMPOffsetDirectory);
+
+        struct FileOffsets {
+            FileOffsets() : size(-1), mtime(0), offsets() {};
+            bool Matches(const MappedFile &file) const {
+                return size == file.GetSize() &&
+                       mtime == file.GetModificationTime();
+            }
+            int64_t size;
+            uint64_t mtime;
+            std::vector<int64_t> offsets;
+        };
+        boost::mutex m_mutex;
+        std::map<std::wstring, FileOffsets> m_files;
+};
+
+static GMPOffsetDirectory GmpOffsets;
+
+GMPImage MakeGmpImage(const std::wstring& path, unsigned int gmp_image_idx) {
+    auto file = std::make_shared<MappedFile>(path);
+    int64_t foffset = GmpOffsets.ImageOffset(file, gmp_image_idx);
+    return GMPImage(file, gmp_image_idx, foffset);
 }
 
 
@@ -739,8 +975,35 @@ GMPImage MakeBestResolutionGmpImage(const GVGFile &gvgfile) {
     return MakeGmpImage(path, image_num);
 }
 
+PixelBuf GMPTileCache::Get(unsigned long long map_id,
+                           long tx, long ty, unsigned int reduction,
+                           const std::function<PixelBuf()> &decode)
+{
+    Key key(map_id, tx, ty, reduction);
+    PixelBuf tile;
+    if (m_tiles.Get(key, &tile)) {
+        return tile;
+    }
+    tile = decode();
+    if (tile.GetData()) {
+        m_tiles.Put(key, tile, tile.GetWidth() * tile.GetHeight() *
+                               sizeof(*tile.GetRawData()));
+    }
+    return tile;
+}
+
+void GMPTileCache::EraseMap(unsigned long long map_id) {
+    m_tiles.EraseIf([map_id](const Key &key) {
+        return std::get<0>(key) == map_id;
+    });
+}
+
+/** The decoded tiles of all GVG maps, so that one budget bounds them. */
+static GMPTileCache DecodedTiles(GVGMap::TILE_CACHE_BUDGET);
+static boost::atomic<unsigned long long> NextTileCacheID(0);
+
 GVGMap::GVGMap(const std::wstring &fname)
-    : m_getregion_mutex(), m_gvgfile(fname),
+    : m_gvgfile(fname),
       m_image(MakeBestResolutionGmpImage(m_gvgfile)),
       m_gvgheader(&m_gvgfile.Header()),
       m_gvgmapinfo(&m_gvgfile.MapInfo(m_gvgfile.BestResolutionIndex())),
@@ -752,7 +1015,8 @@ GVGMap::GVGMap(const std::wstring &fname)
       m_height(m_image.RealHeight()),
       m_bpp(m_image.BitsPerPixel()),
       m_proj_str(MakeProjString()),
-      m_proj(m_proj_str)
+      m_proj(m_proj_str),
+      m_tile_cache_id(NextTileCacheID++)
 { }
 
 std::string GVGMap::MakeProjString() const {
@@ -779,7 +1043,10 @@ std::string GVGMap::MakeProjString() const {
     return ss.str();
 }
 
-GVGMap::~GVGMap() {}
+GVGMap::~GVGMap() {
+    // Nobody can ask for our tiles any more, free their memory right away.
+    DecodedTiles.EraseMap(m_tile_cache_id);
+}
 
 RasterMap::DrawableType GVGMap::GetType() const {
     return RasterMap::TYPE_MAP;
@@ -802,28 +1069,121 @@ GVGMap::GetRegion(const MapPixelCoordInt &pos,
     if (fixed_bounds_pb.GetData())
         return fixed_bounds_pb;
 
-    boost::lock_guard<boost::mutex> lock(m_getregion_mutex);
+    return LoadRegion(pos, size, 1);
+}
+
+PixelBuf
+GVGMap::GetRegionReduced(const MapPixelCoordInt &pos,
+                         const MapPixelDeltaInt &size,
+                         unsigned int reduction) const
+{
+    if (reduction == 1) {
+        return GetRegion(pos, size);
+    }
+    unsigned int native = GetNativeReduction(reduction);
+    if (native == 1) {
+        return RasterMap::GetRegionReduced(pos, size, reduction);
+    }
+    // Let the JPEG decoder do as much of the work as it can, then scale
+    // down the rest of the way.
+    return GetRegionReduced_ShrinkHelper(
+        [this, native](const MapPixelCoordInt &pos,
+                       const MapPixelDeltaInt &size) -> PixelBuf {
+            return LoadRegion(pos, size, native);
+        }, pos, size, reduction, native);
+}
 
-    PixelBuf result(size.x, size.y);
-    MapPixelCoordInt end = pos + size;
+unsigned int GVGMap::GetNativeReduction(unsigned int reduction) const {
+    // Libjpeg scales by up to 1/8. Reduced tiles must line up exactly, so
+    // the tile size has to be divisible by the reduction.
+    unsigned int result = 1;
+    for (unsigned int r = 2; r <= reduction && r <= 8; r *= 2) {
+        if (m_tile_width % r || m_tile_height % r) {
+            break;
+        }
+        result = r;
+    }
+    return result;
+}
 
-    int first_ty = pos.y / m_tile_height;
-    int last_ty = (end.y - 1) / m_tile_height;
-    for (int ty = pos.y / m_tile_height; ty*m_tile_height < end.y; ty++) {
-        for (int tx = pos.x / m_tile_width; tx*m_tile_width < end.x; tx++) {
-            PixelBuf tile = m_image.LoadTile(tx, ty);
-            if (!tile.GetData()) {
-                continue;
-            }
-            auto insert_pos = PixelBufCoord(
-                    tx * m_tile_width - pos.x,
-                    (last_ty - ty + first_ty) * m_tile_height - pos.y);
-            result.Insert(insert_pos, tile);
+PixelBuf
+GVGMap::LoadRegion(const MapPixelCoordInt &pos,
+                   const MapPixelDeltaInt &size,
+                   unsigned int reduction) const
+{
+    // Work in reduced pixels throughout. Keep the arithmetic signed, pos
+    // may be negative.
+    int r = static_cast<int>(reduction);
+    int tile_w = m_tile_width / r;
+    int tile_h = m_tile_height / r;
+    MapPixelCoordInt start(pos.x / r, pos.y / r);
+    MapPixelDeltaInt out_size(size.x / r, size.y / r);
+    MapPixelCoordInt end = start + out_size;
+
+    // Crop to the map, partially covered pixels at its edge are included.
+    // Cf. GetRegion_BoundsHelper().
+    MapPixelCoordInt crop_start(std::max(start.x, 0), std::max(start.y, 0));
+    MapPixelCoordInt crop_end(
+            std::min(end.x, static_cast<int>((m_width + r - 1) / r)),
+            std::min(end.y, static_cast<int>((m_height + r - 1) / r)));
+    if (crop_start.x >= crop_end.x || crop_start.y >= crop_end.y) {
+        return PixelBuf(out_size.x, out_size.y);
+    }
+    MapPixelDeltaInt crop_size = crop_end - crop_start;
+    PixelBuf cropped(crop_size.x, crop_size.y);
+
+    // Decode all covered GMP tiles in parallel. Each task writes to its own
+    // part of `cropped`, so no synchronization is necessary.
+    std::vector<Task> tasks;
+    for (int ty = crop_start.y / tile_h; ty * tile_h < crop_end.y; ty++) {
+        for (int tx = crop_start.x / tile_w; tx * tile_w < crop_end.x; tx++) {
+            int left = tx * tile_w - crop_start.x;
+            int top = ty * tile_h - crop_start.y;
+            tasks.push_back([this, tx, ty, reduction, left, top, &cropped]() {
+                PixelBuf tile = LoadGMPTile(tx, ty, reduction);
+                if (!tile.GetData()) {
+                    return;
+                }
+                // PixelBufs are stored bottom-up, tiles are numbered
+                // top-down.
+                int bottom = static_cast<int>(cropped.GetHeight()) - top -
+                             static_cast<int>(tile.GetHeight());
+                cropped.Insert(PixelBufCoord(left, bottom), tile);
+            });
         }
     }
+    if (tasks.size() == 1) {
+        tasks[0]();
+    } else {
+        ThreadPool::Instance().RunAll(tasks);
+    }
+
+    if (crop_start == start && crop_size == out_size) {
+        return cropped;
+    }
+    PixelBuf result(out_size.x, out_size.y);
+    result.Insert(PixelBufCoord(crop_start.x - start.x, end.y - crop_end.y),
+                  cropped);
     return result;
 }
 
+PixelBuf
+GVGMap::LoadGMPTile(long tx, long ty, unsigned int reduction) const {
+    const GMPImage &image = m_image;
+    return DecodedTiles.Get(m_tile_cache_id, tx, ty, reduction,
+                            [&image, tx, ty, reduction]() {
+        return image.LoadTile(tx, ty, reduction);
+    });
+}
+
+CacheStats GVGMap::GetTileCacheStats() {
+    return DecodedTiles.GetStats();
+}
+
+void GVGMap::SetTileCacheBudget(size_t budget_bytes) {
+    DecodedTiles.SetBudget(budget_bytes);
+}
+
 Projection GVGMap::GetProj() const {
     return m_proj;
 }
@@ -832,6 +1192,15 @@ const std::wstring &GVGMap::GetFname() const {
     return m_gvgfile.Filename();
 }
 
+std::wstring GVGMap::GetCacheIdentity() const {
+    // The pixels live in the GMP file, GetFname() is only the GVG header.
+    const MappedFile &file = m_image.GetFile();
+    std::wostringstream identity;
+    identity << file.GetFname() << L"@" << m_image.GetFileOffset() << L":"
+             << file.GetSize() << L":" << file.GetModificationTime();
+    return identity.str();
+}
+
 const std::wstring &GVGMap::GetTitle() const {
     return m_gvgfile.Header().Title;
 }
@@ -5,6 +5,9 @@
 #include <cassert>
 #include <limits>
 #include <algorithm>
+#include <cmath>
+
+#include <boost/chrono.hpp>
 
 #include "rastermap.h"
 #include "tiles.h"
@@ -12,6 +15,13 @@
 
 
 static const int MAX_TILES = 100;
+
+// Navigation history used for predicting the view motion, in seconds.
+static const double MOTION_WINDOW = 0.3;
+// How far into the future the view position is extrapolated, in seconds.
+static const double PREFETCH_LOOKAHEAD = 0.5;
+// Upper bound for the number of tiles prefetched at once.
+static const unsigned int MAX_PREFETCH_TILES = 48;
 // ZOOM_STEP ** 4 == 2
 const double MapViewModel::ZOOM_STEP =
                     1.189207115002721066717499970560475915;
@@ -194,9 +204,100 @@ void MapViewModel::MoveCenter(const DisplayDelta &disp_delta) {
 
 
 
+RepaintCoalescer::RepaintCoalescer(const std::weak_ptr<Display> &display,
+                                   unsigned int interval_msecs)
+    : m_display(display), m_mutex(), m_cond(),
+      m_interval_msecs(interval_msecs), m_completions(0),
+      m_last_repaint(), m_stats(), m_exitthread(false), m_thread()
+{
+    m_thread.reset(new boost::thread(&RepaintCoalescer::threadproc, this));
+}
+
+RepaintCoalescer::~RepaintCoalescer() {
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_exitthread = true;
+    }
+    m_cond.notify_one();
+    m_thread->join();
+}
+
+void RepaintCoalescer::TileLoaded() {
+    bool wake;
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        wake = !m_completions;
+        m_completions++;
+        m_stats.completions++;
+    }
+    if (wake) {
+        m_cond.notify_one();
+    }
+}
+
+unsigned int RepaintCoalescer::GetInterval() const {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    return m_interval_msecs;
+}
+
+void RepaintCoalescer::SetInterval(unsigned int interval_msecs) {
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_interval_msecs = interval_msecs;
+    }
+    m_cond.notify_one();
+}
+
+RepaintStats RepaintCoalescer::GetStats() const {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void RepaintCoalescer::ResetStats() {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_stats = RepaintStats();
+}
+
+void RepaintCoalescer::threadproc() {
+    using namespace boost::chrono;
+
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (!m_exitthread) {
+        if (!m_completions) {
+            m_cond.wait(lock);
+            continue;
+        }
+        auto due = m_last_repaint + milliseconds(m_interval_msecs);
+        auto now = steady_clock::now();
+        if (now < due) {
+            m_cond.wait_until(lock, due);
+            continue;
+        }
+
+        m_stats.repaints++;
+        m_stats.last_absorbed = m_completions;
+        m_stats.max_absorbed = std::max(m_stats.max_absorbed, m_completions);
+        m_completions = 0;
+        m_last_repaint = now;
+
+        // This relies on the fact that ForceRepaint() resolves to a single
+        // call to InvalidateRect() on Windows, which is safe to run on any
+        // thread.
+        lock.unlock();
+        if (auto display = m_display.lock()) {
+            display->ForceRepaint();
+        }
+        lock.lock();
+    }
+}
+
+
 MapView::MapView(const std::shared_ptr<class Display> &display)
-    : m_display(display), m_need_full_repaint(true),
-      m_old_promise_cache(), m_new_promise_cache()
+    : m_display(display), m_repaint(new RepaintCoalescer(display)),
+      m_need_full_repaint(true),
+      m_old_promise_cache(), m_new_promise_cache(),
+      m_prefetch_enabled(true), m_motion(), m_motion_basemap(nullptr),
+      m_prefetcher()
 {}
 
 
@@ -229,6 +330,26 @@ void MapView::ForceFullRepaint() {
     m_display->ForceRepaint();
 }
 
+void MapView::SetRepaintInterval(unsigned int interval_msecs) {
+    m_repaint->SetInterval(interval_msecs);
+}
+
+unsigned int MapView::GetRepaintInterval() const {
+    return m_repaint->GetInterval();
+}
+
+RepaintStats MapView::GetRepaintStats() const {
+    return m_repaint->GetStats();
+}
+
+void MapView::SetPrefetchEnabled(bool enabled) {
+    m_prefetch_enabled = enabled;
+    if (!enabled) {
+        m_prefetcher.Cancel();
+        m_motion.clear();
+    }
+}
+
 
 std::list<std::shared_ptr<class DisplayOrder>>
 MapView::GenerateDisplayOrders(const MapViewModel &mdm,
@@ -265,9 +386,153 @@ MapView::GenerateDisplayOrders(const MapViewModel &mdm,
     }
     m_old_promise_cache.clear();
     std::swap(m_old_promise_cache, m_new_promise_cache);
+    if (allow_async_promises && m_prefetch_enabled) {
+        SchedulePrefetch(mdm, tile_size);
+    }
     return orders;
 }
 
+static double MonotonicSeconds() {
+    using namespace boost::chrono;
+    auto since_epoch = steady_clock::now().time_since_epoch();
+    return duration_cast<duration<double>>(since_epoch).count();
+}
+
+void MapView::SchedulePrefetch(const MapViewModel &mdm,
+                               const MapPixelDeltaInt &tile_size)
+{
+    // Motion on one base map says nothing about another one.
+    if (mdm.GetBaseMap().get() != m_motion_basemap) {
+        m_motion.clear();
+        m_motion_basemap = mdm.GetBaseMap().get();
+    }
+
+    MotionSample sample;
+    sample.time = MonotonicSeconds();
+    sample.center = mdm.GetCenter();
+    sample.zoom = mdm.GetZoom();
+    m_motion.push_back(sample);
+    while (sample.time - m_motion.front().time > MOTION_WINDOW) {
+        m_motion.pop_front();
+    }
+
+    std::vector<TileCode> tiles;
+    const MotionSample &first = m_motion.front();
+    double dt = sample.time - first.time;
+    if (m_motion.size() < 2 || dt <= 0) {
+        // Not moving (or just started), whatever was predicted is obsolete.
+        m_prefetcher.Prefetch(tiles);
+        return;
+    }
+
+    // Extrapolate the zoom level logarithmically, by at most a factor of 2.
+    double zoom_change = log(sample.zoom / first.zoom) / dt;
+    zoom_change = ValueBetween(-log(2.0), zoom_change * PREFETCH_LOOKAHEAD,
+                               log(2.0));
+    double zoom = sample.zoom * exp(zoom_change);
+
+    // Extrapolate the center, by at most one display size. If we are moving
+    // at all, look ahead at least half a tile so that the next ring of tiles
+    // is covered.
+    BaseMapDelta velocity = (sample.center - first.center) / dt;
+    BaseMapDelta shift = velocity * PREFETCH_LOOKAHEAD;
+    double distance = sqrt(shift.x * shift.x + shift.y * shift.y);
+    if (distance > 0) {
+        double disp_size = std::max(mdm.GetDisplaySize().x,
+                                    mdm.GetDisplaySize().y) / sample.zoom;
+        double wanted = ValueBetween(0.5 * TILE_SIZE, distance, disp_size);
+        shift *= wanted / distance;
+    }
+
+    CollectPrefetchTiles(mdm, sample.center + shift, zoom, tile_size, &tiles);
+    m_prefetcher.Prefetch(tiles);
+}
+
+void MapView::CollectPrefetchTiles(const MapViewModel &mdm,
+                                   const BaseMapCoord &center, double zoom,
+                                   const MapPixelDeltaInt &tile_size,
+                                   std::vector<TileCode> *tiles)
+{
+    DisplayDelta half_disp_size_d(mdm.GetDisplaySize() / 2.0);
+    MapPixelDelta half_disp_size(half_disp_size_d.x / zoom,
+                                 half_disp_size_d.y / zoom);
+    MapPixelCoordInt base_pixel_tl(center - half_disp_size);
+    MapPixelCoordInt base_pixel_br(center + half_disp_size);
+
+    std::vector<std::shared_ptr<GeoDrawable>> layers;
+    layers.push_back(mdm.GetBaseMap());
+    auto &overlays = mdm.GetOverlayList();
+    for (auto ci = overlays.cbegin(); ci != overlays.cend(); ++ci) {
+        if (ci->GetEnabled() && !ci->GetMap()->SupportsDirectDrawing()) {
+            layers.push_back(ci->GetMap());
+        }
+    }
+
+    for (auto it = layers.cbegin(); it != layers.cend(); ++it) {
+        const std::shared_ptr<GeoDrawable> &map = *it;
+        if (!map->SupportsConcurrentGetRegion()) {
+            continue;
+        }
+        MapPixelCoordInt tile_tl, tile_br;
+        MapPixelDeltaInt footprint;
+        unsigned int reduction;
+        if (!CalcLayerTiling(mdm, map, base_pixel_tl, base_pixel_br,
+                             tile_size, &tile_tl, &tile_br,
+                             &footprint, &reduction))
+        {
+            continue;
+        }
+
+        // Find the center of the tiles currently on display.
+        MapPixelDelta shown_sum(0, 0);
+        unsigned int shown_count = 0;
+        for (auto ci = m_old_promise_cache.cbegin();
+             ci != m_old_promise_cache.cend(); ++ci)
+        {
+            if (ci->first.GetMap() == map) {
+                shown_sum += MapPixelDelta(ci->first.GetPosition().x,
+                                           ci->first.GetPosition().y);
+                shown_count++;
+            }
+        }
+        MapPixelCoord shown_center = shown_count ?
+                MapPixelCoord(shown_sum / shown_count) :
+                MapPixelCoord(MapPixelCoordInt(tile_tl));
+
+        typedef std::pair<double, TileCode> DistanceTile;
+        std::vector<DistanceTile> candidates;
+        auto map_size = map->GetSize();
+        for (int x = tile_tl.x; x <= tile_br.x; x += footprint.x) {
+            for (int y = tile_tl.y; y <= tile_br.y; y += footprint.y) {
+                if (x + footprint.x <= 0 || x >= map_size.x ||
+                    y + footprint.y <= 0 || y >= map_size.y)
+                {
+                    continue;
+                }
+                TileCode tilecode(map, MapPixelCoordInt(x, y), footprint,
+                                  reduction);
+                if (m_old_promise_cache.count(tilecode)) {
+                    continue;
+                }
+                double dx = x - shown_center.x;
+                double dy = y - shown_center.y;
+                candidates.push_back(
+                        DistanceTile(dx * dx + dy * dy, tilecode));
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const DistanceTile &lhs, const DistanceTile &rhs) {
+                      return lhs.first < rhs.first;
+                  });
+        for (auto ci = candidates.cbegin(); ci != candidates.cend(); ++ci) {
+            if (tiles->size() >= MAX_PREFETCH_TILES) {
+                return;
+            }
+            tiles->push_back(ci->second);
+        }
+    }
+}
+
 void MapView::PaintLayerDirect(
     const MapViewModel &mdm,
     std::list<std::shared_ptr<DisplayOrder>> *orders,
@@ -302,21 +567,23 @@ void MapView::PaintLayerTiled(
     double transparency, bool allow_async_promises)
 {
     MapPixelCoordInt tile_topleft, tile_botright;
-    if (!CalcOverlayRect(mdm.GetBaseMap(), map, tile_size,
-                         base_pixel_topleft, base_pixel_botright,
-                         &tile_topleft, &tile_botright))
+    MapPixelDeltaInt footprint;
+    unsigned int reduction;
+    if (!CalcLayerTiling(mdm, map, base_pixel_topleft, base_pixel_botright,
+                         tile_size, &tile_topleft, &tile_botright,
+                         &footprint, &reduction))
     {
         // Failed to paint overlay
         assert(false);
     }
 
-    MapPixelDeltaInt tile_size_h(tile_size.x, 0);
-    MapPixelDeltaInt tile_size_v(0, tile_size.y);
+    MapPixelDeltaInt tile_size_h(footprint.x, 0);
+    MapPixelDeltaInt tile_size_v(0, footprint.y);
 
-    for (int x = tile_topleft.x; x <= tile_botright.x; x += tile_size.x) {
-        for (int y = tile_topleft.y; y <= tile_botright.y; y += tile_size.y) {
+    for (int x = tile_topleft.x; x <= tile_botright.x; x += footprint.x) {
+        for (int y = tile_topleft.y; y <= tile_botright.y; y += footprint.y) {
             MapPixelCoordInt map_pos(x, y);
-            TileCode tilecode(map, map_pos, tile_size);
+            TileCode tilecode(map, map_pos, footprint, reduction);
 
             DisplayCoordCentered disp_tl = DisplayCoordCenteredFromMapPixel(
                 map_pos, map, mdm);
@@ -325,14 +592,20 @@ void MapView::PaintLayerTiled(
             DisplayCoordCentered disp_bl = DisplayCoordCenteredFromMapPixel(
                 map_pos + tile_size_v, map, mdm);
             DisplayCoordCentered disp_br = DisplayCoordCenteredFromMapPixel(
-                map_pos + tile_size, map, mdm);
+                map_pos + footprint, map, mdm);
             DisplayRectCentered rect(disp_tl, disp_tr, disp_bl, disp_br);
 
+            // Load tiles in the middle of the display first.
+            double center_x = (disp_tl.x + disp_br.x) / 2;
+            double center_y = (disp_tl.y + disp_br.y) / 2;
+            double priority = -sqrt(center_x * center_x + center_y * center_y);
+
             // Take an already created promise, if available.
             std::shared_ptr<PixelPromise> promise;
             auto old_promise = m_old_promise_cache.find(tilecode);
             if (old_promise != m_old_promise_cache.end()) {
                 promise = old_promise->second;
+                promise->SetPriority(priority);
             } else {
                 if (allow_async_promises &&
                     map->SupportsConcurrentGetRegion())
@@ -340,21 +613,18 @@ void MapView::PaintLayerTiled(
                     // Load tiles on a background thread, if the map
                     // implementation can handle it.
                     //
-                    // On completion, call ForceRepaint() in the BG thread.
-                    // Use a weak_ptr to ensure correct behavior on shutdown.
-                    //
-                    // This relies rather delicately on the fact that
-                    // ForceRepaint() resolves to a single call to
-                    // InvalidateRect() on Windows, which is safe to run on
-                    // any thread.
-                    const std::weak_ptr<Display> &weak_display = m_display;
-                    auto refresh = [weak_display]() {
-                        if (auto display = weak_display.lock()) {
-                            display->ForceRepaint();
+                    // On completion, have the RepaintCoalescer schedule a
+                    // repaint. Use a weak_ptr to ensure correct behavior on
+                    // shutdown.
+                    const std::weak_ptr<RepaintCoalescer> weak_repaint =
+                            m_repaint;
+                    auto refresh = [weak_repaint]() {
+                        if (auto repaint = weak_repaint.lock()) {
+                            repaint->TileLoaded();
                         }
                     };
                     promise = std::make_shared<PixelPromiseTiledAsync>(
-                        tilecode, refresh);
+                        tilecode, refresh, priority);
                 }
                 else {
                     promise = std::make_shared<PixelPromiseTiled>(tilecode);
@@ -368,6 +638,51 @@ void MapView::PaintLayerTiled(
     }
 }
 
+bool MapView::CalcLayerTiling(
+    const MapViewModel &mdm,
+    const std::shared_ptr<class GeoDrawable> &map,
+    const MapPixelCoordInt &base_tl, const MapPixelCoordInt &base_br,
+    const MapPixelDeltaInt &tile_size,
+    MapPixelCoordInt *tile_tl, MapPixelCoordInt *tile_br,
+    MapPixelDeltaInt *tile_footprint, unsigned int *reduction)
+{
+    MapPixelCoordInt layer_tl, layer_br;
+    if (!CalcOverlayRect(mdm.GetBaseMap(), map, MapPixelDeltaInt(1, 1),
+                         base_tl, base_br, &layer_tl, &layer_br))
+    {
+        return false;
+    }
+
+    // Number of map pixels per display pixel. Take the smaller direction,
+    // the bounding rect of rotated overlays is too large in both.
+    const DisplayDeltaInt &disp_size = mdm.GetDisplaySize();
+    double scale = std::min(
+            double(layer_br.x - layer_tl.x) / std::max(disp_size.x, 1),
+            double(layer_br.y - layer_tl.y) / std::max(disp_size.y, 1));
+    unsigned int r = 1;
+    while (2 * r <= scale) {
+        r *= 2;
+    }
+
+    while (true) {
+        *tile_footprint = tile_size * static_cast<int>(r);
+        *tile_tl = MapPixelCoordInt(
+                round_to_neg_inf(layer_tl.x, tile_footprint->x),
+                round_to_neg_inf(layer_tl.y, tile_footprint->y));
+        *tile_br = MapPixelCoordInt(
+                round_to_neg_inf(layer_br.x, tile_footprint->x),
+                round_to_neg_inf(layer_br.y, tile_footprint->y));
+        int num_tiles = ((tile_br->x - tile_tl->x) / tile_footprint->x + 1) *
+                        ((tile_br->y - tile_tl->y) / tile_footprint->y + 1);
+        if (num_tiles <= MAX_TILES) {
+            break;
+        }
+        r *= 2;
+    }
+    *reduction = r;
+    return true;
+}
+
 bool MapView::CalcOverlayRect(
     const std::shared_ptr<class GeoDrawable> &base_map,
     const std::shared_ptr<class GeoDrawable> &overlay_map,
@@ -0,0 +1,181 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <list>
+#include <stdexcept>
+#include <cstring>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include <Windows.h>
+
+
+namespace {
+
+/** A mapped view of a part of a file. Unmapped on destruction. */
+struct Window {
+    Window(const MappedFile *owner_, int64_t offset_, size_t size_,
+           const void *base_)
+        : owner(owner_), offset(offset_), size(size_), base(base_)
+    {};
+    ~Window() {
+        UnmapViewOfFile(base);
+    }
+    bool Contains(const MappedFile *req_owner,
+                  int64_t req_offset, size_t req_length) const
+    {
+        return req_owner == owner && req_offset >= offset &&
+               req_offset + static_cast<int64_t>(req_length) <=
+                   offset + static_cast<int64_t>(size);
+    }
+
+    const MappedFile * const owner;
+    const int64_t offset;
+    const size_t size;
+    const void * const base;
+private:
+    DISALLOW_COPY_AND_ASSIGN(Window);
+};
+
+typedef std::list<std::shared_ptr<Window>> WindowList;
+
+}
+
+// The windows of all files, most recently used first, cf. `MappedFile`.
+static boost::mutex WindowsMutex;
+static WindowList Windows;
+static size_t WindowsBytes = 0;
+static size_t WindowBudget = MappedFile::DEFAULT_WINDOW_BUDGET;
+
+/** Remove windows beyond the budget from `Windows`, into `evicted`.
+ *
+ * `evicted` should be destroyed after `WindowsMutex` is released, to unmap
+ * the windows without holding the lock.
+ */
+static void EvictWindows(WindowList *evicted) {
+    while (WindowsBytes > WindowBudget && !Windows.empty()) {
+        WindowsBytes -= Windows.back()->size;
+        evicted->splice(evicted->begin(), Windows, --Windows.end());
+    }
+}
+
+/** Return the window of `owner` containing the range, map it if needed. */
+static std::shared_ptr<Window>
+FindOrMapWindow(const MappedFile *owner, void *mapping,
+                int64_t offset, size_t length)
+{
+    // Windows that went out of use are unmapped after releasing the lock.
+    WindowList evicted;
+    boost::lock_guard<boost::mutex> lock(WindowsMutex);
+    for (auto it = Windows.begin(); it != Windows.end(); ++it) {
+        if ((*it)->Contains(owner, offset, length)) {
+            Windows.splice(Windows.begin(), Windows, it);
+            return Windows.front();
+        }
+    }
+
+    // Map the aligned window around `offset`, extended if the requested
+    // range crosses its end.
+    const size_t window_size = MappedFile::WINDOW_SIZE;
+    int64_t start = offset - offset % window_size;
+    int64_t end = std::max(start + static_cast<int64_t>(window_size),
+                           offset + static_cast<int64_t>(length));
+    end = std::min(end, owner->GetSize());
+    size_t size = static_cast<size_t>(end - start);
+    const void *base = MapViewOfFile(mapping, FILE_MAP_READ,
+                                     static_cast<DWORD>(start >> 32),
+                                     static_cast<DWORD>(start),
+                                     size);
+    if (!base) {
+        throw std::runtime_error("Failed to map file view.");
+    }
+    Windows.push_front(std::make_shared<Window>(owner, start, size, base));
+    WindowsBytes += size;
+    auto window = Windows.front();
+    EvictWindows(&evicted);
+    return window;
+}
+
+MappedFile::MappedFile(const std::wstring &fname)
+    : m_fname(fname), m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr),
+      m_size(0), m_mtime(0)
+{
+    m_file = CreateFileW(fname.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                         nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS,
+                         nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Failed to open file.");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw std::runtime_error("Failed to get file size.");
+    }
+    m_size = size.QuadPart;
+    FILETIME mtime;
+    if (!GetFileTime(m_file, nullptr, nullptr, &mtime)) {
+        CloseHandle(m_file);
+        throw std::runtime_error("Failed to get file time.");
+    }
+    m_mtime = (static_cast<uint64_t>(mtime.dwHighDateTime) << 32) |
+              mtime.dwLowDateTime;
+    // Empty files can't be mapped, but there's nothing to read anyway.
+    if (m_size > 0) {
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY,
+                                       0, 0, nullptr);
+        if (!m_mapping) {
+            CloseHandle(m_file);
+            throw std::runtime_error("Failed to map file.");
+        }
+    }
+}
+
+MappedFile::~MappedFile() {
+    WindowList evicted;
+    {
+        boost::lock_guard<boost::mutex> lock(WindowsMutex);
+        for (auto it = Windows.begin(); it != Windows.end();) {
+            auto cur = it++;
+            if ((*cur)->owner == this) {
+                WindowsBytes -= (*cur)->size;
+                evicted.splice(evicted.end(), Windows, cur);
+            }
+        }
+    }
+    evicted.clear();
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    CloseHandle(m_file);
+}
+
+MappedFile::View MappedFile::Map(int64_t offset, size_t length) const {
+    if (offset < 0 || offset + static_cast<int64_t>(length) > m_size) {
+        throw std::runtime_error("Read beyond the end of file.");
+    }
+    if (!length) {
+        return View();
+    }
+    auto window = FindOrMapWindow(this, m_mapping, offset, length);
+    auto data = static_cast<const unsigned char*>(window->base) +
+                static_cast<size_t>(offset - window->offset);
+    return View(window, data, length);
+}
+
+void MappedFile::ReadAt(int64_t offset, void *buffer, size_t length) const {
+    View view = Map(offset, length);
+    memcpy(buffer, view.GetData(), length);
+}
+
+void MappedFile::SetWindowBudget(size_t budget_bytes) {
+    WindowList evicted;
+    boost::lock_guard<boost::mutex> lock(WindowsMutex);
+    WindowBudget = budget_bytes;
+    EvictWindows(&evicted);
+}
+
+size_t MappedFile::GetMappedBytes() {
+    boost::lock_guard<boost::mutex> lock(WindowsMutex);
+    return WindowsBytes;
+}
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <stdexcept>
+#include <vector>
 
 extern "C" {
 #include "jpeglib.h"
@@ -27,7 +28,19 @@ error_exit_handler(j_common_ptr cinfo) {
     throw JPEGError("Failed to decompress JPEG buffer.");
 }
 
-PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb) {
+PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb,
+                         unsigned int reduction)
+{
+    return decompress_jpeg(reinterpret_cast<const unsigned char*>(buf.data()),
+                           buf.size(), swap_rb, reduction);
+}
+
+PixelBuf decompress_jpeg(const unsigned char *data, size_t size,
+                         bool swap_rb, unsigned int reduction)
+{
+    if (reduction != 1 && reduction != 2 && reduction != 4 && reduction != 8) {
+        throw JPEGError("Invalid JPEG reduction factor.");
+    }
     jpeg_decompress_struct cinfo;
     jpeg_error_mgr err_mgr;
 
@@ -42,43 +55,57 @@ PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb) {
     std::unique_ptr<jpeg_decompress_struct, decltype(deleter)>
             cleanup_cinfo(&cinfo, deleter);
 
-    jpeg_mem_src(&cinfo, (JOCTET*)buf.c_str(), buf.size());
+    jpeg_mem_src(&cinfo, const_cast<JOCTET*>(data),
+                 static_cast<unsigned long>(size));
     jpeg_read_header(&cinfo, /* require_image = */ true);
 
-    // Ensure we get 24 bit RGB or an error, without explicitly setting the
-    // out_color_space, we might get grayscale or CMYK data.
-    // Libjpeg can do the color conversions if necessary.
+    // Libjpeg scales down in the DCT domain, skipping most of the work.
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = reduction;
+
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo writes the 32 bit RGBX layout of PixelBuf directly, in
+    // the requested channel order. This also ensures we get RGB data or an
+    // error; without explicitly setting the out_color_space, we might get
+    // grayscale or CMYK data. Libjpeg can do the color conversions.
+    cinfo.out_color_space = swap_rb ? JCS_EXT_BGRX : JCS_EXT_RGBX;
+    const int components = 4;
+#else
+    // Plain libjpeg can only provide 24 bit packed RGB. Read that into the
+    // PixelBuf buffer first, then space it out in a second step later.
     cinfo.out_color_space = JCS_RGB;
+    const int components = 3;
+#endif
     jpeg_start_decompress(&cinfo);
 
-    if (cinfo.output_components != 3) {
-        // This should never happen, as we explicitly set JCS_RGB and libjpeg
-        // should honor it. We might get a nasty buffer overflow if it doesn't,
-        // so guard against it.
+    if (cinfo.output_components != components) {
+        // This should never happen, as we explicitly set the color space and
+        // libjpeg should honor it. We might get a nasty buffer overflow if it
+        // doesn't, so guard against it.
         throw JPEGError("Invalid number of JPEG color components.");
     }
-    int row_stride = cinfo.output_width * cinfo.output_components;
-    auto output = PixelBuf(cinfo.output_width, cinfo.output_height);
+    unsigned int height = cinfo.output_height;
+    unsigned int row_stride = cinfo.output_width * components;
+    auto output = PixelBuf(cinfo.output_width, height);
     auto output_buf = reinterpret_cast<unsigned char*>(output.GetRawData());
 
-    // PixelBuf works on 32-bit RGBX values, while libjpeg can only provide 24
-    // bit packed RGB. Read that into the PixelBuf buffer first, then space it
-    // out in a second step later.
-    JSAMPROW rows[1];
-    bool top_down = false;
-    unsigned int pos = top_down ? 0 : row_stride * (cinfo.output_height - 1);
-    int pos_delta = top_down ? row_stride : -row_stride;
-    unsigned int pos_end = pos + cinfo.output_height * pos_delta;
-    while (cinfo.output_scanline < cinfo.output_height && pos != pos_end) {
-        // TODO: Use a larger output JSAMPARRAY and handle return value of
-        // jpeg_read_scanlines(). Cf. cinfo.rec_outbuf_height
-        rows[0] = &output_buf[pos];
-        (void) jpeg_read_scanlines(&cinfo, rows, 1);
-        pos += pos_delta;
+    // JPEG scanlines are top-down, PixelBufs bottom-up.
+    std::vector<JSAMPROW> rows(height);
+    for (unsigned int i = 0; i < height; i++) {
+        rows[i] = &output_buf[row_stride * (height - 1 - i)];
+    }
+    // Let libjpeg return as many scanlines per call as it has available,
+    // instead of one at a time.
+    while (cinfo.output_scanline < height) {
+        JDIMENSION line = cinfo.output_scanline;
+        if (!jpeg_read_scanlines(&cinfo, &rows[line], height - line)) {
+            throw JPEGError("Truncated JPEG buffer.");
+        }
     }
 
     jpeg_finish_decompress(&cinfo);
 
+#ifndef JCS_EXTENSIONS
     // Convert 24 bit RGB to 32 bit RGBX, possibly exchange R and B channels.
     int R = swap_rb ? 2 : 0;
     int G = 1;
@@ -90,5 +117,71 @@ PixelBuf decompress_jpeg(const std::string &buf, bool swap_rb) {
                            (output_buf[3*i + B] << 16);
         *reinterpret_cast<unsigned int*>(&output_buf[4*i]) = val;
     }
+#endif
     return output;
-}
\ No newline at end of file
+}
+
+bool jpeg_swap_rb_lossless(const unsigned char *data, size_t size,
+                           std::vector<unsigned char> *result)
+{
+    jpeg_decompress_struct src;
+    jpeg_error_mgr src_err_mgr;
+    src.err = jpeg_std_error(&src_err_mgr);
+    src_err_mgr.error_exit = error_exit_handler;
+
+    jpeg_create_decompress(&src);
+    auto src_deleter = [](j_decompress_ptr p){ jpeg_destroy_decompress(p); };
+    std::unique_ptr<jpeg_decompress_struct, decltype(src_deleter)>
+            cleanup_src(&src, src_deleter);
+
+    jpeg_mem_src(&src, const_cast<JOCTET*>(data),
+                 static_cast<unsigned long>(size));
+    jpeg_read_header(&src, /* require_image = */ true);
+
+    // With a YCbCr color transform, swapping R and B mixes all components.
+    if (src.jpeg_color_space != JCS_RGB || src.num_components != 3) {
+        return false;
+    }
+    for (int ci = 0; ci < src.num_components; ci++) {
+        if (src.comp_info[ci].h_samp_factor != 1 ||
+            src.comp_info[ci].v_samp_factor != 1)
+        {
+            return false;
+        }
+    }
+    jvirt_barray_ptr *src_coefs = jpeg_read_coefficients(&src);
+
+    jpeg_compress_struct dst;
+    jpeg_error_mgr dst_err_mgr;
+    dst.err = jpeg_std_error(&dst_err_mgr);
+    dst_err_mgr.error_exit = error_exit_handler;
+
+    jpeg_create_compress(&dst);
+    auto dst_deleter = [](j_compress_ptr p){ jpeg_destroy_compress(p); };
+    std::unique_ptr<jpeg_compress_struct, decltype(dst_deleter)>
+            cleanup_dst(&dst, dst_deleter);
+
+    // Libjpeg allocates the output buffer, it's freed after copying.
+    unsigned char *outbuf = nullptr;
+    unsigned long outsize = 0;
+    auto outbuf_deleter = [](unsigned char **p){ free(*p); };
+    std::unique_ptr<unsigned char*, decltype(outbuf_deleter)>
+            cleanup_outbuf(&outbuf, outbuf_deleter);
+    jpeg_mem_dest(&dst, &outbuf, &outsize);
+
+    // Keep the component IDs in place, but exchange the coefficients of
+    // the first and third component along with their quantization tables.
+    jpeg_copy_critical_parameters(&src, &dst);
+    std::swap(dst.comp_info[0].quant_tbl_no, dst.comp_info[2].quant_tbl_no);
+    jvirt_barray_ptr dst_coefs[3] = {
+        src_coefs[2], src_coefs[1], src_coefs[0]
+    };
+    // Optimized Huffman tables keep the size close to the original.
+    dst.optimize_coding = TRUE;
+    jpeg_write_coefficients(&dst, dst_coefs);
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+
+    result->assign(outbuf, outbuf + outsize);
+    return true;
+}
@@ -15,6 +15,8 @@
 #include <cmath>
 #include <iostream>
 #include <stdio.h>
+#include <map>
+#include <vector>
 
 #include <GeographicLib/Geodesic.hpp>
 #include <GeographicLib/LocalCartesian.hpp>
@@ -26,15 +28,54 @@
 #include "map_composite.h"
 #include "bezier.h"
 #include "projection.h"
+#include "threading.h"
 
 
 GeoPixels::~GeoPixels() {};
 GeoDrawable::~GeoDrawable() {};
 RasterMap::~RasterMap() {};
 
-PixelBuf EXPORT GetRegion_BoundsHelper(const GeoDrawable &drawable,
-                                       const MapPixelCoordInt &pos,
-                                       const MapPixelDeltaInt &size)
+PixelBuf GeoDrawable::GetRegionReduced(const MapPixelCoordInt &pos,
+                                       const MapPixelDeltaInt &size,
+                                       unsigned int reduction) const
+{
+    if (reduction == 1) {
+        return GetRegion(pos, size);
+    }
+    if (GetType() == TYPE_DHM) {
+        return GetRegionReduced_SubsampleHelper(
+            [this](const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) {
+                return GetRegion(pos, size);
+            }, pos, size, reduction);
+    }
+    return GetRegionReduced_ShrinkHelper(
+        [this](const MapPixelCoordInt &pos, const MapPixelDeltaInt &size) {
+            return GetRegion(pos, size);
+        }, pos, size, reduction);
+}
+
+ElevationBuf16
+GeoDrawable::GetElevationRegion(const MapPixelCoordInt &pos,
+                                const MapPixelDeltaInt &size) const
+{
+    if (GetType() != TYPE_DHM) {
+        throw std::runtime_error("Elevation data requires a DHM.");
+    }
+    return ElevationBuf16::FromPixelBuf(GetRegion(pos, size));
+}
+
+/** Common implementation of the bounds helpers.
+ *
+ * `Buf` is `PixelBuf` or `ElevationBuf16`, `get_region` the matching
+ * `GeoDrawable` method.
+ */
+template <typename Buf>
+static Buf BoundsHelper(const GeoDrawable &drawable,
+                        Buf (GeoDrawable::*get_region)(
+                                const MapPixelCoordInt &,
+                                const MapPixelDeltaInt &) const,
+                        const MapPixelCoordInt &pos,
+                        const MapPixelDeltaInt &size)
 {
     MapPixelCoordInt endpos = pos + size;
     if (endpos.x <= 0 || endpos.y <= 0 ||
@@ -42,16 +83,16 @@ PixelBuf EXPORT GetRegion_BoundsHelper(const GeoDrawable &drawable,
         pos.y >= static_cast<int>(drawable.GetHeight()))
     {
         // Requested region fully out of bounds.
-        return PixelBuf(size.x, size.y);
+        return Buf(size.x, size.y);
     }
     if (pos.x >= 0 && pos.y >= 0 &&
         endpos.x <= static_cast<int>(drawable.GetWidth()) &&
         endpos.y <= static_cast<int>(drawable.GetHeight()))
     {
         // Requested region fully in-bounds.
-        return PixelBuf();
+        return Buf();
     }
-    // Crop the request size and defer to the original GetRegion(), then copy
+    // Crop the request size and defer to the original method, then copy
     // the result to the appropriate place in the output.
     auto newpos = MapPixelCoordInt(std::max(pos.x, 0), std::max(pos.y, 0));
     auto newend = MapPixelCoordInt(
@@ -61,9 +102,116 @@ PixelBuf EXPORT GetRegion_BoundsHelper(const GeoDrawable &drawable,
     auto pos_offset = PixelBufCoord(newpos.x - pos.x,
                                     size.y - newsize.y - (newpos.y - pos.y));
 
-    auto result = PixelBuf(size.x, size.y);
-    auto pixels = drawable.GetRegion(newpos, newsize);
-    result.Insert(pos_offset, pixels);
+    auto result = Buf(size.x, size.y);
+    result.Insert(pos_offset, (drawable.*get_region)(newpos, newsize));
+    return result;
+}
+
+PixelBuf EXPORT GetRegion_BoundsHelper(const GeoDrawable &drawable,
+                                       const MapPixelCoordInt &pos,
+                                       const MapPixelDeltaInt &size)
+{
+    return BoundsHelper<PixelBuf>(drawable, &GeoDrawable::GetRegion,
+                                  pos, size);
+}
+
+ElevationBuf16 EXPORT
+GetElevationRegion_BoundsHelper(const GeoDrawable &drawable,
+                                const MapPixelCoordInt &pos,
+                                const MapPixelDeltaInt &size)
+{
+    return BoundsHelper<ElevationBuf16>(
+            drawable, &GeoDrawable::GetElevationRegion, pos, size);
+}
+
+// Upper bound for the full-resolution data held by the shrink helper.
+static const int SHRINK_BAND_PIXELS = 4 * 1024 * 1024;
+
+PixelBuf EXPORT GetRegionReduced_ShrinkHelper(
+        const RegionReader &get_region,
+        const MapPixelCoordInt &pos,
+        const MapPixelDeltaInt &size,
+        unsigned int reduction,
+        unsigned int source_reduction)
+{
+    // Keep the arithmetic signed, pos may be negative.
+    int r = static_cast<int>(reduction);
+    int src_r = static_cast<int>(source_reduction);
+    if (r <= 0 || (r & (r - 1)) != 0 || src_r <= 0 || r % src_r != 0) {
+        throw std::runtime_error("Invalid reduction factor.");
+    }
+    if (pos.x % r || pos.y % r || size.x % r || size.y % r) {
+        throw std::runtime_error(
+            "Region not aligned to the requested reduction.");
+    }
+    if (r == src_r) {
+        return get_region(pos, size);
+    }
+
+    int scale = r / src_r;
+    int src_width = size.x / src_r;
+    auto result = PixelBuf(size.x / r, size.y / r);
+    if (!src_width) {
+        return result;
+    }
+    // Band height in native pixels, a multiple of the reduction.
+    int band_height = std::max(
+            1, SHRINK_BAND_PIXELS / src_width / scale) * r;
+
+    for (int y = 0; y < size.y; y += band_height) {
+        int height = std::min(band_height, size.y - y);
+        auto band = get_region(MapPixelCoordInt(pos.x, pos.y + y),
+                               MapPixelDeltaInt(size.x, height));
+        if (!band.GetRawData()) {
+            continue;
+        }
+        // PixelBufs are stored bottom-up, the first band goes to the top.
+        ShrinkImage(band.GetRawData(), src_width, height / src_r,
+                    result.GetRawData(), 0, (size.y - y - height) / r,
+                    result.GetWidth(), result.GetHeight(), scale);
+    }
+    return result;
+}
+
+PixelBuf EXPORT GetRegionReduced_SubsampleHelper(
+        const RegionReader &get_region,
+        const MapPixelCoordInt &pos,
+        const MapPixelDeltaInt &size,
+        unsigned int reduction)
+{
+    int r = static_cast<int>(reduction);
+    if (r <= 0 || (r & (r - 1)) != 0) {
+        throw std::runtime_error("Invalid reduction factor.");
+    }
+    if (pos.x % r || pos.y % r || size.x % r || size.y % r) {
+        throw std::runtime_error(
+            "Region not aligned to the requested reduction.");
+    }
+    auto result = PixelBuf(size.x / r, size.y / r);
+    if (!size.x) {
+        return result;
+    }
+    // Band height in native pixels, a multiple of the reduction.
+    int band_height = std::max(1, SHRINK_BAND_PIXELS / size.x / r) * r;
+
+    for (int y = 0; y < size.y; y += band_height) {
+        int height = std::min(band_height, size.y - y);
+        auto band = get_region(MapPixelCoordInt(pos.x, pos.y + y),
+                               MapPixelDeltaInt(size.x, height));
+        if (!band.GetRawData()) {
+            continue;
+        }
+        // Keep the top-left pixel of every block. PixelBufs are stored
+        // bottom-up, the first band goes to the top.
+        for (int row = 0; row < height / r; row++) {
+            const unsigned int *src = band.GetPixelPtr(0, height - 1 - row * r);
+            unsigned int *dest = result.GetPixelPtr(
+                    0, result.GetHeight() - 1 - y / r - row);
+            for (int x = 0; x < result.GetWidth(); x++) {
+                dest[x] = src[x * r];
+            }
+        }
+    }
     return result;
 }
 
@@ -158,11 +306,31 @@ AlternateMapViews(const std::shared_ptr<RasterMap> &map)
         representations.push_back(deriv_map);
         deriv_map.reset(new SteepnessMap(map));
         representations.push_back(deriv_map);
+        deriv_map.reset(new HillshadeMap(map));
+        representations.push_back(deriv_map);
     }
     return representations;
 }
 
 
+static void FillTerrainInfo(MapBezierGradient grad, double mpp,
+                            double height, TerrainInfo *result)
+{
+    unsigned int bezier_pixels = Bezier::N_POINTS - 1;
+    double bezier_meters = bezier_pixels * mpp;
+
+    grad /= bezier_meters;
+    // -grad.y corrects for the coordinate system of the image pixels not being
+    // the same as the map coordinates (y axis inverted)
+    double grad_direction = atan2(-grad.y, grad.x);
+    double grad_steepness = atan(grad.Abs());
+
+    result->height_m = height;
+    result->steepness_deg = grad_steepness * RAD_to_DEG;
+    result->slope_face_deg = normalize_direction(270 +
+                                                 grad_direction * RAD_to_DEG);
+}
+
 bool CalcTerrainInfo(const std::shared_ptr<class RasterMap> &map,
                      const LatLon &pos, TerrainInfo *result)
 {
@@ -180,8 +348,6 @@ bool CalcTerrainInfo(const std::shared_ptr<class RasterMap> &map,
     if (!MetersPerPixel(map, bezier_pos.GetBezierCenter(), &mpp)) {
         return false;
     }
-    unsigned int bezier_pixels = Bezier::N_POINTS - 1;
-    double bezier_meters = bezier_pixels * mpp;
 
     MapBezierGradient grad;
     if (!Gradient3x3(*map, bezier_pos.GetBezierCenter(),
@@ -189,24 +355,115 @@ bool CalcTerrainInfo(const std::shared_ptr<class RasterMap> &map,
     {
         return false;
     }
-
-    grad /= bezier_meters;
-    // -grad.y corrects for the coordinate system of the image pixels not being
-    // the same as the map coordinates (y axis inverted)
-    double grad_direction = atan2(-grad.y, grad.x);
-    double grad_steepness = atan(grad.Abs());
-
+    double height;
     if (!Value3x3(*map, bezier_pos.GetBezierCenter(),
-                  bezier_pos.GetBasePoint(), &result->height_m))
+                  bezier_pos.GetBasePoint(), &height))
     {
         return false;
     }
-    result->steepness_deg = grad_steepness * RAD_to_DEG;
-    result->slope_face_deg = normalize_direction(270 +
-                                                 grad_direction * RAD_to_DEG);
+    FillTerrainInfo(grad, mpp, height, result);
     return true;
 }
 
+// Edge length of the map blocks CalcTerrainInfoBatch() groups positions by.
+static const int TERRAIN_BATCH_BLOCK_SIZE = 256;
+
+std::vector<int>
+CalcTerrainInfoBatch(const std::shared_ptr<class RasterMap> &map,
+                     const std::vector<LatLon> &positions,
+                     std::vector<TerrainInfo> *results)
+{
+    assert(results);
+    TerrainInfo invalid = { 0, 0, 0 };
+    results->assign(positions.size(), invalid);
+    std::vector<int> valid(positions.size(), 0);
+
+    // Positions of each block, keyed by block row and column.
+    std::vector<MapBezierPositioner> bezier_positions;
+    std::map<std::pair<int, int>, std::vector<size_t> > blocks;
+    const MapPixelDeltaInt map_size = map->GetSize();
+    bezier_positions.reserve(positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+        MapPixelCoord map_pos;
+        if (!map->LatLonToPixel(positions[i], &map_pos)) {
+            map_pos = MapPixelCoord(-1, -1);
+        }
+        bezier_positions.push_back(MapBezierPositioner(map_pos, map_size));
+        if (!bezier_positions.back().IsValid()) {
+            continue;
+        }
+        const MapPixelCoordInt &center =
+            bezier_positions.back().GetBezierCenter();
+        blocks[std::make_pair(center.y / TERRAIN_BATCH_BLOCK_SIZE,
+                              center.x / TERRAIN_BATCH_BLOCK_SIZE)]
+            .push_back(i);
+    }
+
+    const MapPixelDeltaInt overhang((Bezier::N_POINTS - 1) / 2,
+                                    (Bezier::N_POINTS - 1) / 2);
+    auto process_block = [&map, &bezier_positions, &overhang,
+                          results, &valid](const std::vector<size_t> &indices)
+    {
+        // Fetch the heights around all positions of the block at once.
+        MapPixelCoordInt min_center = bezier_positions[indices[0]]
+                                      .GetBezierCenter();
+        MapPixelCoordInt max_center = min_center;
+        for (auto it = indices.begin(); it != indices.end(); ++it) {
+            const MapPixelCoordInt &c = bezier_positions[*it].GetBezierCenter();
+            min_center.x = std::min(min_center.x, c.x);
+            min_center.y = std::min(min_center.y, c.y);
+            max_center.x = std::max(max_center.x, c.x);
+            max_center.y = std::max(max_center.y, c.y);
+        }
+        MapPixelCoordInt origin = min_center - overhang;
+        MapPixelDeltaInt size = max_center - min_center + overhang * 2 +
+                                MapPixelDeltaInt(1, 1);
+        auto heights = map->GetElevationRegion(origin, size);
+
+        // The pixel size hardly changes within a block.
+        double mpp;
+        if (!MetersPerPixel(map, min_center + (max_center - min_center) / 2,
+                            &mpp))
+        {
+            return;
+        }
+        for (auto it = indices.begin(); it != indices.end(); ++it) {
+            const MapBezierPositioner &bezier_pos = bezier_positions[*it];
+            // Heights are stored bottom-up, like in `Gradient3x3(map, ...)`.
+            MapPixelCoordInt center(
+                    bezier_pos.GetBezierCenter().x - origin.x,
+                    origin.y + size.y - 1 - bezier_pos.GetBezierCenter().y);
+            MapBezierGradient grad;
+            double height;
+            if (!Gradient3x3(heights.GetRawData(), size, center,
+                             bezier_pos.GetBasePoint(), &grad) ||
+                !Value3x3(heights.GetRawData(), size, center,
+                          bezier_pos.GetBasePoint(), &height))
+            {
+                continue;
+            }
+            FillTerrainInfo(grad, mpp, height, &(*results)[*it]);
+            valid[*it] = 1;
+        }
+    };
+
+    if (!map->SupportsConcurrentGetRegion() || blocks.size() < 2) {
+        for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+            process_block(it->second);
+        }
+        return valid;
+    }
+    std::vector<Task> tasks;
+    for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+        const std::vector<size_t> &indices = it->second;
+        tasks.push_back([&process_block, &indices]() {
+            process_block(indices);
+        });
+    }
+    ThreadPool::Instance().RunAll(tasks);
+    return valid;
+}
+
 
 bool GetMapDistance(const std::shared_ptr<class GeoDrawable> &map,
                     const MapPixelCoord &pos,
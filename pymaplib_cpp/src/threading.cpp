@@ -1,52 +1,355 @@
 #include <threading.h>
 
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <limits>
+
 #include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+
+bool TaskHandle::Cancel() {
+    if (!m_task) {
+        return false;
+    }
+    return m_pool->CancelTask(m_task);
+}
+
+bool TaskHandle::SetPriority(double priority) {
+    if (!m_task) {
+        return false;
+    }
+    return m_pool->SetTaskPriority(m_task, priority);
+}
+
+
+/** A worker thread's task queue. */
+struct ThreadPool::Worker {
+    boost::mutex mutex;
+    PoolTaskQueue tasks;
+};
+
+/** Index of the current thread within its pool, if it is a worker. */
+struct WorkerIdentity {
+    const ThreadPool *pool;
+    unsigned int index;
+};
+static boost::thread_specific_ptr<WorkerIdentity> CurrentWorker;
+
+/** Run `task`, reporting exceptions instead of letting them escape.
+ *
+ * An exception leaving a worker thread would terminate the process, and one
+ * leaving a serial group task would keep the group busy forever.
+ */
+static void RunContained(const Task &task) {
+    try {
+        task();
+    } catch (const std::exception &e) {
+        std::cerr << "Uncaught exception in pool task: " << e.what()
+                  << std::endl;
+    } catch (...) {
+        std::cerr << "Uncaught exception in pool task." << std::endl;
+    }
+}
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+    : m_workers(), m_threads(), m_next_worker(0), m_next_seq(0),
+      m_pending(0), m_exitthreads(false), m_idle_mutex(), m_idle_cond(),
+      m_groups_mutex(), m_groups()
+{
+    if (!num_threads) {
+        num_threads = std::max(1U, boost::thread::hardware_concurrency());
+    }
+    for (unsigned int i = 0; i < num_threads; i++) {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for (unsigned int i = 0; i < num_threads; i++) {
+        m_threads.create_thread(
+                std::bind(&ThreadPool::threadproc, this, i));
+    }
+}
 
-ThreadedTaskRunner::ThreadedTaskRunner()
-    : m_tasks(), m_exitthread(false), m_thread()
+ThreadPool::~ThreadPool() {
+    {
+        boost::lock_guard<boost::mutex> lock(m_idle_mutex);
+        m_exitthreads = true;
+    }
+    m_idle_cond.notify_all();
+    m_threads.join_all();
+}
+
+// Defined after `CurrentWorker`, so that is ready when the workers start.
+static ThreadPool PoolInstance;
+
+ThreadPool &ThreadPool::Instance() {
+    return PoolInstance;
+}
+
+TaskHandle ThreadPool::Enqueue(const Task& f, double priority) {
+    auto task = MakeTask(f, priority);
+    PushTask(task);
+    return TaskHandle(this, task);
+}
+
+std::shared_ptr<PoolTask> ThreadPool::MakeTask(const Task& f,
+                                               double priority)
+{
+    // Keep work spawned by a task local to its worker, distribute the rest.
+    unsigned int index;
+    WorkerIdentity *identity = CurrentWorker.get();
+    if (identity && identity->pool == this) {
+        index = identity->index;
+    } else {
+        index = m_next_worker++ % m_workers.size();
+    }
+    return std::make_shared<PoolTask>(f, priority, m_next_seq++,
+                                      index, nullptr);
+}
+
+void ThreadPool::PushTask(const std::shared_ptr<PoolTask> &task) {
+    {
+        Worker &worker = *m_workers[task->worker];
+        boost::lock_guard<boost::mutex> lock(worker.mutex);
+        worker.tasks.insert(task);
+    }
+    {
+        boost::lock_guard<boost::mutex> lock(m_idle_mutex);
+        ++m_pending;
+    }
+    m_idle_cond.notify_one();
+}
+
+TaskHandle ThreadPool::Enqueue(GroupID group_id, const Task& f,
+                               double priority)
 {
-    m_thread.reset(new boost::thread(&ThreadedTaskRunner::threadproc, this));
+    if (!group_id) {
+        return Enqueue(f, priority);
+    }
+    auto task = std::make_shared<PoolTask>(f, priority, m_next_seq++,
+                                           -1, group_id);
+    boost::lock_guard<boost::mutex> lock(m_groups_mutex);
+    SerialGroup &group = m_groups[group_id];
+    group.tasks.insert(task);
+    if (!group.active) {
+        group.active = true;
+        StartGroupRunner(group_id, group);
+    } else {
+        // RunSerialGroup() picks up the new task once the others are done.
+        // Until then, it may have to hurry up.
+        UpdateGroupRunner(group);
+    }
+    return TaskHandle(this, task);
+}
+
+/** Enqueue a task running `group` at the priority of its head task.
+ *
+ * @locking `m_groups_mutex` must be held by the caller.
+ */
+void ThreadPool::StartGroupRunner(GroupID group_id, SerialGroup &group) {
+    double priority = (*group.tasks.begin())->priority;
+    group.runner = MakeTask([this, group_id]() { RunSerialGroup(group_id); },
+                            priority);
+    PushTask(group.runner);
 }
 
-ThreadedTaskRunner::~ThreadedTaskRunner() {
-    if (!m_thread) {
+/** Move the task running `group` along with the group's head task.
+ *
+ * @locking `m_groups_mutex` must be held by the caller.
+ */
+void ThreadPool::UpdateGroupRunner(SerialGroup &group) {
+    if (!group.runner || group.tasks.empty()) {
         return;
     }
-    m_exitthread = true;
-    // Push a dummy task to make the thread continue if stuck in m_tasks.pop().
-    m_tasks.push(Task());
-    m_thread->join();
+    double priority = (*group.tasks.begin())->priority;
+    if (group.runner->priority != priority) {
+        SetTaskPriority(group.runner, priority);
+    }
 }
 
-void ThreadedTaskRunner::Enqueue(const Task& f) {
-    m_tasks.push(f);
+void ThreadPool::RunSerialGroup(GroupID group_id) {
+    std::shared_ptr<PoolTask> task;
+    {
+        boost::lock_guard<boost::mutex> lock(m_groups_mutex);
+        auto it = m_groups.find(group_id);
+        it->second.runner.reset();
+        if (it->second.tasks.empty()) {
+            // All remaining tasks were cancelled.
+            m_groups.erase(it);
+            return;
+        }
+        task = *it->second.tasks.begin();
+        it->second.tasks.erase(it->second.tasks.begin());
+    }
+    RunContained(task->task);
+
+    boost::lock_guard<boost::mutex> lock(m_groups_mutex);
+    auto it = m_groups.find(group_id);
+    if (it->second.tasks.empty()) {
+        m_groups.erase(it);
+        return;
+    }
+    // Requeue instead of looping, so that other work gets its turn.
+    StartGroupRunner(group_id, it->second);
 }
 
-void ThreadedTaskRunner::threadproc() {
-    while (!m_exitthread) {
-        auto task = m_tasks.pop();
-        if (task) {
+/** Completion state shared between `ThreadPool::RunAll()` and its tasks. */
+struct RunAllState {
+    RunAllState() : mutex(), cond(), remaining(0), error() {};
+
+    /** Run `task`, recording exceptions and completion. */
+    void Run(const Task &task) {
+        std::exception_ptr task_error;
+        try {
             task();
+        } catch (...) {
+            task_error = std::current_exception();
+        }
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (task_error && !error) {
+            error = task_error;
+        }
+        if (--remaining == 0) {
+            cond.notify_all();
+        }
+    }
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    size_t remaining;
+    std::exception_ptr error;
+};
+
+void ThreadPool::RunAll(const std::vector<Task> &tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    auto state = std::make_shared<RunAllState>();
+    state->remaining = tasks.size();
+
+    // Other threads may pick up all but the first task. The caller is
+    // waiting for them, so they go before anything else.
+    std::vector<TaskHandle> handles;
+    for (size_t i = 1; i < tasks.size(); i++) {
+        Task task = tasks[i];
+        handles.push_back(Enqueue([state, task]() { state->Run(task); },
+                                  std::numeric_limits<double>::max()));
+    }
+    state->Run(tasks[0]);
+
+    // Run whatever nobody else has started yet, then wait for the rest.
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (handles[i].Cancel()) {
+            state->Run(tasks[i + 1]);
+        }
+    }
+    boost::unique_lock<boost::mutex> lock(state->mutex);
+    while (state->remaining > 0) {
+        state->cond.wait(lock);
+    }
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+bool ThreadPool::CancelTask(const std::shared_ptr<PoolTask> &task) {
+    if (task->group) {
+        boost::lock_guard<boost::mutex> lock(m_groups_mutex);
+        auto it = m_groups.find(task->group);
+        if (it == m_groups.end() || !it->second.tasks.erase(task)) {
+            return false;
         }
+        UpdateGroupRunner(it->second);
+        return true;
+    }
+
+    Worker &worker = *m_workers[task->worker];
+    boost::lock_guard<boost::mutex> lock(worker.mutex);
+    if (!worker.tasks.erase(task)) {
+        return false;
     }
+    --m_pending;
+    return true;
 }
 
-void ThreadedTaskGroupRunner::Enqueue(GroupID group_id, const Task& f)
+bool ThreadPool::SetTaskPriority(const std::shared_ptr<PoolTask> &task,
+                                 double priority)
 {
-    auto &tq = find_or_create_runner(group_id);
-    tq.Enqueue(f);
+    // The queue order depends on the priority, remove the task while
+    // changing it.
+    if (task->group) {
+        boost::lock_guard<boost::mutex> lock(m_groups_mutex);
+        auto it = m_groups.find(task->group);
+        if (it == m_groups.end() || !it->second.tasks.erase(task)) {
+            return false;
+        }
+        task->priority = priority;
+        it->second.tasks.insert(task);
+        UpdateGroupRunner(it->second);
+        return true;
+    }
+
+    Worker &worker = *m_workers[task->worker];
+    boost::lock_guard<boost::mutex> lock(worker.mutex);
+    if (!worker.tasks.erase(task)) {
+        return false;
+    }
+    task->priority = priority;
+    worker.tasks.insert(task);
+    return true;
 }
 
-ThreadedTaskRunner&
-ThreadedTaskGroupRunner::find_or_create_runner(GroupID group_id) {
-    auto val = TaskRunnerMap::value_type(group_id, ThreadedTaskRunnerPtr());
-    // Insert returns a pair<iterator<value_type> it, bool was_inserted>.
-    auto iterpair = m_tasks.insert(val);
+bool ThreadPool::PopTask(unsigned int index, Task *task) {
+    // Find the worker with the most urgent task. On ties, prefer our own.
+    int best = -1;
+    double best_priority = 0;
+    for (unsigned int i = 0; i < m_workers.size(); i++) {
+        unsigned int candidate = (index + i) % m_workers.size();
+        Worker &worker = *m_workers[candidate];
+        boost::lock_guard<boost::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) {
+            continue;
+        }
+        double priority = (*worker.tasks.begin())->priority;
+        if (best < 0 || priority > best_priority) {
+            best = candidate;
+            best_priority = priority;
+        }
+    }
+    if (best < 0) {
+        return false;
+    }
+
+    // The queue may have changed in between, take whatever is on top now.
+    // If it ran empty, our caller retries.
+    Worker &worker = *m_workers[best];
+    boost::lock_guard<boost::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) {
+        return false;
+    }
+    *task = (*worker.tasks.begin())->task;
+    worker.tasks.erase(worker.tasks.begin());
+    --m_pending;
+    return true;
+}
+
+void ThreadPool::threadproc(unsigned int index) {
+    WorkerIdentity *identity = new WorkerIdentity;
+    identity->pool = this;
+    identity->index = index;
+    CurrentWorker.reset(identity);
 
-    // If val was newly inserted (and not just retrieved), start the Thread.
-    if (iterpair.second) {
-        assert(!iterpair.first->second);
-        iterpair.first->second.reset(new ThreadedTaskRunner());
+    while (!m_exitthreads) {
+        Task task;
+        if (PopTask(index, &task)) {
+            if (task) {
+                RunContained(task);
+            }
+            continue;
+        }
+        boost::unique_lock<boost::mutex> lock(m_idle_mutex);
+        while (m_pending <= 0 && !m_exitthreads) {
+            m_idle_cond.wait(lock);
+        }
     }
-    return *iterpair.first->second;
 }
@@ -2,11 +2,88 @@
 
 #include "rastermap.h"
 #include "threading.h"
+#include "tilestore.h"
+
+#include <iostream>
 
 PixelBuf TileCode::GetTile() const {
-    return m_map->GetRegion(m_pos, m_tilesize);
+    PixelBuf result;
+    if (TileCache::Instance().Get(*this, &result)) {
+        return result;
+    }
+    return LoadTile();
+}
+
+PixelBuf TileCode::LoadTile() const {
+    PixelBuf result;
+    PersistentTileStore &store = PersistentTileStore::Instance();
+    if (!store.Get(*this, &result)) {
+        if (m_reduction > 1) {
+            result = m_map->GetRegionReduced(m_pos, m_tilesize, m_reduction);
+        } else {
+            result = m_map->GetRegion(m_pos, m_tilesize);
+        }
+        store.Put(*this, result);
+    }
+    TileCache::Instance().Put(*this, result);
+    return result;
+}
+
+
+static TileCache TileCacheInstance(TileCache::DEFAULT_BUDGET);
+
+TileCache &TileCache::Instance() {
+    return TileCacheInstance;
+}
+
+TileCache::TileCache(size_t budget_bytes)
+    : m_cache(budget_bytes)
+{}
+
+bool TileCache::Get(const TileCode &tilecode, PixelBuf *result) {
+    return m_cache.Get(tilecode, result);
+}
+
+bool TileCache::Contains(const TileCode &tilecode) const {
+    return m_cache.Contains(tilecode);
+}
+
+void TileCache::Put(const TileCode &tilecode, const PixelBuf &pixels) {
+    if (!pixels.GetRawData()) {
+        return;
+    }
+    size_t cost = pixels.GetWidth() * pixels.GetHeight() *
+                  sizeof(*pixels.GetRawData());
+    m_cache.Put(tilecode, pixels, cost);
+}
+
+void TileCache::EvictDrawable(const GeoDrawable *map) {
+    m_cache.EraseIf([map](const TileCode &tilecode) -> bool {
+        return tilecode.GetMap().get() == map;
+    });
 }
 
+void TileCache::Clear() {
+    m_cache.Clear();
+}
+
+size_t TileCache::GetBudget() const {
+    return m_cache.GetBudget();
+}
+
+void TileCache::SetBudget(size_t budget_bytes) {
+    m_cache.SetBudget(budget_bytes);
+}
+
+CacheStats TileCache::GetStats() const {
+    return m_cache.GetStats();
+}
+
+void TileCache::ResetStats() {
+    m_cache.ResetStats();
+}
+
+
 ODMPixelFormat PixelPromiseTiled::GetPixelFormat() const {
     return m_tilecode.GetMap()->GetPixelFormat();
 }
@@ -20,9 +97,6 @@ ODMPixelFormat PixelPromiseDirect::GetPixelFormat() const {
 }
 
 
-/** A local task group runner supporting PixelPromiseTiledAsync */
-static ThreadedTaskGroupRunner TGRunner;
-
 /** A thread-safe callable for retrieving PixelBufs from NonDirectDraw maps.
  *
  * This is a helper class for PixelPromiseTiledAsync. On creation, it is
@@ -50,16 +124,36 @@ public:
 
     /** Resolve the `TileCode` to an actual `PixelBuf`.
      *
+     * If loading fails, the result is an empty (transparent) tile.
      * This function must not be called more than once.
      */
     void operator()() {
         assert(m_already_called.exchange(true) == false);
         if (!m_abort) {
-            m_pixels = m_tilecode.GetTile();
+            try {
+                m_pixels = m_tilecode.LoadTile();
+            } catch (const std::exception &e) {
+                // Show an empty tile instead of waiting forever.
+                std::cerr << "Failed to load tile: " << e.what()
+                          << std::endl;
+                int reduction = m_tilecode.GetReduction();
+                const MapPixelDeltaInt &size = m_tilecode.GetTileSize();
+                m_pixels = PixelBuf(size.x / reduction, size.y / reduction);
+            }
             m_done = true;
         }
     }
 
+    /** Complete the worker with already available pixel data.
+     *
+     * This is used instead of `operator()`, e.g. for cached tiles.
+     */
+    void SetPixels(const PixelBuf &pixels) {
+        assert(m_already_called.exchange(true) == false);
+        m_pixels = pixels;
+        m_done = true;
+    }
+
     /** Get the desired `PixelBuf`.
      *
      * If it is not yet available (i.e. `operator()` has not yet finished),
@@ -104,25 +198,48 @@ private:
 
 PixelPromiseTiledAsync::PixelPromiseTiledAsync(
         const TileCode& tilecode,
-        const std::function<void()>& refresh)
-    : PixelPromise(), m_tilecode(tilecode), m_worker(new AsyncWorker(tilecode))
+        const std::function<void()>& refresh,
+        double priority)
+    : PixelPromise(), m_tilecode(tilecode), m_worker(new AsyncWorker(tilecode)),
+      m_task()
 {
-    // Use the local, static ThreadedTaskGroupRunner to run a lambda function
-    // on a different thread. First resolve the TileCode using the AsyncWorker,
+    // Tiles from the TileCache are available immediately, no need to bother
+    // a background thread. No refresh necessary, either.
+    PixelBuf cached;
+    if (TileCache::Instance().Get(tilecode, &cached)) {
+        m_worker->SetPixels(cached);
+        return;
+    }
+
+    // Use the process-wide ThreadPool to run a lambda function on a
+    // different thread. First resolve the TileCode using the AsyncWorker,
     // then call the refresh function to update the display.
+    //
+    // Tiles of maps not supporting concurrent GetRegion() calls are loaded
+    // one at a time, everything else is spread across all workers.
+    const GeoDrawable *map = tilecode.GetMap().get();
+    ThreadPool::GroupID group = map->SupportsConcurrentGetRegion() ?
+            nullptr : const_cast<GeoDrawable*>(map);
     std::shared_ptr<AsyncWorker> worker = m_worker;
-    TGRunner.Enqueue(tilecode.GetMap().get(), [worker, refresh](){
+    m_task = ThreadPool::Instance().Enqueue(group, [worker, refresh](){
         (*worker)();
         refresh();
-    });
+    }, priority);
 }
 
 PixelPromiseTiledAsync::~PixelPromiseTiledAsync() {
     // Do not resolve the TileCode if the work has not yet started.
-    // We are not interested in the result any more.
+    // We are not interested in the result any more. Removing the task from
+    // the queue lets other tiles go first; if it was picked up just now,
+    // the abort flag makes it return quickly.
+    m_task.Cancel();
     m_worker->Abort();
 }
 
+void PixelPromiseTiledAsync::SetPriority(double priority) {
+    m_task.SetPriority(priority);
+}
+
 PixelBuf PixelPromiseTiledAsync::GetPixels() const {
     return m_worker->GetPixels();
 }
@@ -139,3 +256,40 @@ const TileCode* PixelPromiseTiledAsync::GetCacheKey() const {
         return nullptr;
     }
 }
+
+
+// Below the priority of any visible tile.
+const double TilePrefetcher::PRIORITY = -1e9;
+
+TilePrefetcher::TilePrefetcher()
+    : m_tasks()
+{}
+
+TilePrefetcher::~TilePrefetcher() {
+    Cancel();
+}
+
+void TilePrefetcher::Prefetch(const std::vector<TileCode> &tiles) {
+    Cancel();
+    double priority = PRIORITY;
+    for (auto it = tiles.cbegin(); it != tiles.cend(); ++it) {
+        if (TileCache::Instance().Contains(*it)) {
+            continue;
+        }
+        const TileCode tilecode = *it;
+        m_tasks.push_back(ThreadPool::Instance().Enqueue([tilecode]() {
+            if (!TileCache::Instance().Contains(tilecode)) {
+                tilecode.LoadTile();
+            }
+        }, priority));
+        // Keep the order of the prediction.
+        priority -= 1;
+    }
+}
+
+void TilePrefetcher::Cancel() {
+    for (auto it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+        it->Cancel();
+    }
+    m_tasks.clear();
+}
@@ -0,0 +1,407 @@
+#include "tilestore.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <Windows.h>
+
+#include "tiles.h"
+#include "rastermap.h"
+
+
+static const char TILE_FILE_MAGIC[4] = { 'O', 'D', 'M', 'T' };
+static const uint32_t TILE_FILE_VERSION = 1;
+static const wchar_t TILE_FILE_PATTERN[] = L"*.tile";
+static const wchar_t TMP_FILE_PATTERN[] = L"*.tmp";
+
+/** Header of a tile file.
+ *
+ * The header is followed by the tile key (`key_chars` wide characters) and
+ * the pixel data (`width * height` values, in `PixelBuf` order).
+ */
+struct TileFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t key_chars;
+};
+
+/** Close a Win32 handle when going out of scope. */
+class ScopedHandle {
+public:
+    explicit ScopedHandle(HANDLE handle) : m_handle(handle) {}
+    ~ScopedHandle() {
+        if (IsValid()) {
+            CloseHandle(m_handle);
+        }
+    }
+    HANDLE Get() const { return m_handle; }
+    bool IsValid() const {
+        return m_handle && m_handle != INVALID_HANDLE_VALUE;
+    }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedHandle);
+    HANDLE m_handle;
+};
+
+/** Unmap a view of a file mapping when going out of scope. */
+class ScopedView {
+public:
+    explicit ScopedView(const void *view) : m_view(view) {}
+    ~ScopedView() {
+        if (m_view) {
+            UnmapViewOfFile(m_view);
+        }
+    }
+    const char *Get() const { return static_cast<const char*>(m_view); }
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedView);
+    const void *m_view;
+};
+
+/** A file found in the store directory. */
+struct StoredFile {
+    std::wstring name;
+    size_t size;
+    uint64_t mtime;
+};
+
+static bool CompareMtime(const StoredFile &lhs, const StoredFile &rhs) {
+    return lhs.mtime < rhs.mtime;
+}
+
+static std::vector<StoredFile>
+ListFiles(const std::wstring &directory, const wchar_t *pattern) {
+    std::vector<StoredFile> result;
+    std::wstring search = directory + ODM_PathSep_wchar + pattern;
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileW(search.c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return result;
+    }
+    do {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+        StoredFile file;
+        file.name = data.cFileName;
+        file.size = static_cast<size_t>(
+                (static_cast<uint64_t>(data.nFileSizeHigh) << 32) |
+                data.nFileSizeLow);
+        file.mtime = (static_cast<uint64_t>(
+                          data.ftLastWriteTime.dwHighDateTime) << 32) |
+                     data.ftLastWriteTime.dwLowDateTime;
+        result.push_back(file);
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+    return result;
+}
+
+static void DeleteFiles(const std::wstring &directory,
+                        const std::vector<std::wstring> &filenames)
+{
+    for (auto it = filenames.cbegin(); it != filenames.cend(); ++it) {
+        std::wstring path = directory + ODM_PathSep_wchar + *it;
+        // Tiles being read by another thread can't be deleted. They are
+        // picked up again by the directory scan of a later session.
+        DeleteFileW(path.c_str());
+    }
+}
+
+/** Build the unique identifier of a tile, which is stored in its file.
+ *
+ * Returns an empty string if the map file can't be accessed.
+ */
+static std::wstring MakeKey(const TileCode &tilecode) {
+    const GeoDrawable &map = *tilecode.GetMap();
+    const std::wstring &fname = map.GetFname();
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (fname.empty() ||
+        !GetFileAttributesExW(fname.c_str(), GetFileExInfoStandard,
+                              &attributes))
+    {
+        return std::wstring();
+    }
+
+    const MapPixelCoordInt &pos = tilecode.GetPosition();
+    const MapPixelDeltaInt &size = tilecode.GetTileSize();
+    std::wostringstream key;
+    key << fname << L"|"
+        << attributes.ftLastWriteTime.dwHighDateTime << L":"
+        << attributes.ftLastWriteTime.dwLowDateTime << L"|"
+        << map.GetType() << L"|"
+        << map.GetCacheIdentity() << L"|"
+        << pos.x << L"," << pos.y << L"|"
+        << size.x << L"," << size.y << L"|"
+        << tilecode.GetReduction();
+    return key.str();
+}
+
+/** Derive the file name of a tile from the 64 bit FNV-1a hash of its key.
+ *
+ * Hash collisions are detected when reading the tile, as the full key is
+ * stored in the file.
+ */
+static std::wstring MakeFilename(const std::wstring &key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto it = key.cbegin(); it != key.cend(); ++it) {
+        hash ^= static_cast<uint64_t>(*it);
+        hash *= 1099511628211ULL;
+    }
+    std::wostringstream filename;
+    filename << std::hex << std::setw(16) << std::setfill(L'0') << hash
+             << L".tile";
+    return filename.str();
+}
+
+static size_t TileFileSize(const std::wstring &key, const PixelBuf &pixels) {
+    return sizeof(TileFileHeader) + key.size() * sizeof(wchar_t) +
+           pixels.GetWidth() * pixels.GetHeight() *
+           sizeof(*pixels.GetRawData());
+}
+
+/** Read a tile file via a memory mapping.
+ *
+ * Returns `false` if the file can't be read, is corrupt, or belongs to a
+ * different key.
+ */
+static bool ReadTileFile(const std::wstring &path, const std::wstring &key,
+                         PixelBuf *result)
+{
+    ScopedHandle file(CreateFileW(path.c_str(), GENERIC_READ,
+                                  FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  nullptr, OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+    LARGE_INTEGER filesize;
+    if (!file.IsValid() || !GetFileSizeEx(file.Get(), &filesize) ||
+        filesize.QuadPart < static_cast<long long>(sizeof(TileFileHeader)))
+    {
+        return false;
+    }
+    ScopedHandle mapping(CreateFileMappingW(file.Get(), nullptr,
+                                            PAGE_READONLY, 0, 0, nullptr));
+    if (!mapping.IsValid()) {
+        return false;
+    }
+    ScopedView view(MapViewOfFile(mapping.Get(), FILE_MAP_READ, 0, 0, 0));
+    if (!view.Get()) {
+        return false;
+    }
+
+    TileFileHeader header;
+    memcpy(&header, view.Get(), sizeof(header));
+    const uint64_t key_bytes = key.size() * sizeof(wchar_t);
+    const uint64_t pixel_bytes = static_cast<uint64_t>(header.width) *
+                                 header.height * sizeof(unsigned int);
+    if (memcmp(header.magic, TILE_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TILE_FILE_VERSION ||
+        header.key_chars != key.size() ||
+        static_cast<uint64_t>(filesize.QuadPart) !=
+                sizeof(header) + key_bytes + pixel_bytes)
+    {
+        return false;
+    }
+    const char *stored_key = view.Get() + sizeof(header);
+    if (memcmp(stored_key, key.c_str(), static_cast<size_t>(key_bytes))) {
+        return false;
+    }
+
+    PixelBuf pixels(header.width, header.height);
+    memcpy(pixels.GetRawData(), stored_key + key_bytes,
+           static_cast<size_t>(pixel_bytes));
+    *result = pixels;
+    return true;
+}
+
+static bool WriteTileFile(const std::wstring &path, const std::wstring &key,
+                          const PixelBuf &pixels)
+{
+    using std::ios;
+    TileFileHeader header;
+    memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TILE_FILE_VERSION;
+    header.width = pixels.GetWidth();
+    header.height = pixels.GetHeight();
+    header.key_chars = static_cast<uint32_t>(key.size());
+
+    std::ofstream file(path, ios::out | ios::trunc | ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(key.c_str()),
+               key.size() * sizeof(wchar_t));
+    file.write(reinterpret_cast<const char*>(pixels.GetRawData()),
+               pixels.GetWidth() * pixels.GetHeight() *
+               sizeof(*pixels.GetRawData()));
+    file.close();
+    return !file.fail();
+}
+
+/** Mark a file as recently used by updating its modification time. */
+static void TouchFile(const std::wstring &path) {
+    ScopedHandle file(CreateFileW(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                  FILE_SHARE_DELETE,
+                                  nullptr, OPEN_EXISTING, 0, nullptr));
+    if (!file.IsValid()) {
+        return;
+    }
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file.Get(), nullptr, nullptr, &now);
+}
+
+
+static PersistentTileStore TileStoreInstance(
+        PersistentTileStore::DEFAULT_BUDGET);
+
+PersistentTileStore &PersistentTileStore::Instance() {
+    return TileStoreInstance;
+}
+
+PersistentTileStore::PersistentTileStore(size_t budget_bytes)
+    : m_mutex(), m_directory(), m_files(budget_bytes), m_tmp_counter(0)
+{}
+
+void PersistentTileStore::SetDirectory(const std::wstring &directory) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_directory = directory;
+    m_files.Clear();
+    if (directory.empty()) {
+        return;
+    }
+    // Fails if the directory exists already, which is fine. Other errors
+    // make all writes fail, which effectively disables the store.
+    CreateDirectoryW(directory.c_str(), nullptr);
+
+    // Remove leftovers of interrupted writes.
+    std::vector<std::wstring> tmp_files;
+    auto tmp_list = ListFiles(directory, TMP_FILE_PATTERN);
+    for (auto it = tmp_list.cbegin(); it != tmp_list.cend(); ++it) {
+        tmp_files.push_back(it->name);
+    }
+    DeleteFiles(directory, tmp_files);
+
+    // Take over the tiles of previous sessions. Insert the oldest first,
+    // so the most recently used ones end up at the front of the LRU list.
+    auto files = ListFiles(directory, TILE_FILE_PATTERN);
+    std::sort(files.begin(), files.end(), CompareMtime);
+    std::vector<std::wstring> evicted;
+    for (auto it = files.cbegin(); it != files.cend(); ++it) {
+        m_files.Put(it->name, it->size, it->size, &evicted);
+    }
+    DeleteFiles(directory, evicted);
+    m_files.ResetStats();
+}
+
+std::wstring PersistentTileStore::GetDirectory() const {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    return m_directory;
+}
+
+bool PersistentTileStore::Supports(const TileCode &tilecode) const {
+    return !GetDirectory().empty() &&
+           tilecode.GetMap()->SupportsPersistentCache();
+}
+
+bool PersistentTileStore::Get(const TileCode &tilecode, PixelBuf *result) {
+    if (!Supports(tilecode)) {
+        return false;
+    }
+    std::wstring directory = GetDirectory();
+    std::wstring key = MakeKey(tilecode);
+    if (key.empty()) {
+        return false;
+    }
+    std::wstring filename = MakeFilename(key);
+    size_t filesize;
+    if (!m_files.Get(filename, &filesize)) {
+        return false;
+    }
+
+    std::wstring path = directory + ODM_PathSep_wchar + filename;
+    if (ReadTileFile(path, key, result)) {
+        TouchFile(path);
+        return true;
+    }
+    // The file is unreadable, outdated, or a hash collision. Drop it, the
+    // tile will be stored again once it has been loaded.
+    m_files.Erase(filename);
+    DeleteFileW(path.c_str());
+    return false;
+}
+
+void PersistentTileStore::Put(const TileCode &tilecode,
+                              const PixelBuf &pixels)
+{
+    if (!pixels.GetRawData() || !Supports(tilecode)) {
+        return;
+    }
+    std::wstring directory = GetDirectory();
+    std::wstring key = MakeKey(tilecode);
+    if (key.empty()) {
+        return;
+    }
+    size_t filesize = TileFileSize(key, pixels);
+    if (filesize > GetBudget()) {
+        return;
+    }
+
+    // Write to a private temporary file first, so that concurrent readers
+    // (in this or other processes) never see partially written tiles.
+    std::wstring filename = MakeFilename(key);
+    std::wstring path = directory + ODM_PathSep_wchar + filename;
+    std::wostringstream tmp_path;
+    tmp_path << path << L"." << GetCurrentProcessId() << L"."
+             << m_tmp_counter++ << L".tmp";
+    if (!WriteTileFile(tmp_path.str(), key, pixels) ||
+        !MoveFileExW(tmp_path.str().c_str(), path.c_str(),
+                     MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(tmp_path.str().c_str());
+        return;
+    }
+
+    std::vector<std::wstring> evicted;
+    m_files.Put(filename, filesize, filesize, &evicted);
+    DeleteFiles(directory, evicted);
+}
+
+void PersistentTileStore::Clear() {
+    std::wstring directory = GetDirectory();
+    m_files.Clear();
+    if (directory.empty()) {
+        return;
+    }
+    std::vector<std::wstring> filenames;
+    auto files = ListFiles(directory, TILE_FILE_PATTERN);
+    for (auto it = files.cbegin(); it != files.cend(); ++it) {
+        filenames.push_back(it->name);
+    }
+    DeleteFiles(directory, filenames);
+}
+
+size_t PersistentTileStore::GetBudget() const {
+    return m_files.GetBudget();
+}
+
+void PersistentTileStore::SetBudget(size_t budget_bytes) {
+    std::vector<std::wstring> evicted;
+    m_files.SetBudget(budget_bytes, &evicted);
+    DeleteFiles(GetDirectory(), evicted);
+}
+
+CacheStats PersistentTileStore::GetStats() const {
+    return m_files.GetStats();
+}
+
+void PersistentTileStore::ResetStats() {
+    m_files.ResetStats();
+}
@@ -20,6 +20,11 @@
 
 #include <boost/timer/timer.hpp>
 
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+#  include <intrin.h>
+#  include <immintrin.h>
+#endif
+
 #include "odm_config.h"
 
 int round_to_neg_inf(int value, int round_to) {
@@ -250,7 +255,7 @@ std::wstring string_format(const std::wstring fmt, ...) {
 
 
 #define SRC(xx, yy) src[(xx) + s_width * (yy)]
-#define DEST(xx, yy) dest[(xx + d_x) + s_width * (yy + d_y)]
+#define DEST(xx, yy) dest[((xx) + d_x) + d_width * ((yy) + d_y)]
 inline unsigned int sample_pixels(unsigned int *src,
                                   unsigned int s_x, unsigned int s_y,
                                   unsigned int s_width, unsigned int s_height,
@@ -524,3 +529,35 @@ bool FileExists(const std::wstring &name) {
     std::wifstream ifs(name, std::ifstream::in | std::ifstream::binary);
     return !ifs.fail();
 }
+
+static bool DetectAVX2() {
+#ifdef ODM_HAVE_AVX2_INTRINSICS
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // The OS has to save the YMM registers on context switches (OSXSAVE,
+    // and the SSE and AVX state bits in XCR0).
+    __cpuid(info, 1);
+    const int osxsave_avx = (1 << 27) | (1 << 28);
+    if ((info[2] & osxsave_avx) != osxsave_avx) {
+        return false;
+    }
+    if ((_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+// Initialized on module load, so no locking is required. Code running before
+// that sees `false` and falls back to non-AVX2 code.
+static const bool cpu_supports_avx2 = DetectAVX2();
+
+bool CPUSupportsAVX2() {
+    return cpu_supports_avx2;
+}
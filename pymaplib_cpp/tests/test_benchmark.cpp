@@ -0,0 +1,337 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+#include "../include/rastermap.h"
+#include "../include/map_geotiff.h"
+#include "../include/map_gvg.h"
+#include "../include/map_dhm_advanced.h"
+#include "../include/util.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/chrono/include.hpp>
+#include <boost/atomic.hpp>
+
+#include "tests.h"
+
+// Benchmarks take a while and are only run with `--benchmark`. They print
+// their timings and warn (but don't fail) if the expected speedup is not
+// reached, as that depends on the machine.
+BOOST_AUTO_TEST_SUITE(benchmark)
+
+static std::wstring get_benchmark_tif() {
+    return GetProgramDir_wchar() + L".." + ODM_PathSep_wchar +
+                                   L".." + ODM_PathSep_wchar +
+                                   L"mapsevolved" + ODM_PathSep_wchar +
+                                   L"data" + ODM_PathSep_wchar +
+                                   L"land_shallow_topo_8192.tif";
+}
+
+/** Run `job(i)` for all `i < num_jobs` on `num_threads` threads.
+ *
+ * Returns the wall time taken, in milliseconds.
+ */
+static double time_parallel(unsigned int num_threads, unsigned int num_jobs,
+                            const std::function<void(unsigned int)> &job)
+{
+    boost::atomic<unsigned int> next_job(0);
+    auto worker = [&next_job, num_jobs, &job]() {
+        for (unsigned int i = next_job++; i < num_jobs; i = next_job++) {
+            job(i);
+        }
+    };
+    auto start = boost::chrono::steady_clock::now();
+    std::vector<boost::thread> threads;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.push_back(boost::thread(worker));
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+    auto elapsed = boost::chrono::steady_clock::now() - start;
+    return boost::chrono::duration<double, boost::milli>(elapsed).count();
+}
+
+static void report(const std::string &name, unsigned int num_threads,
+                   double msecs, double base_msecs)
+{
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::setw(3) << num_threads << " threads: "
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << msecs << " ms  "
+              << std::setprecision(2) << base_msecs / msecs << "x"
+              << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(tiffmap_getregion_scaling)
+{
+    if (!testconfig.run_benchmarks()) {
+        return;
+    }
+    auto map = LoadMap(get_benchmark_tif());
+    const int tile_size = 256;
+    const int tiles_x = map->GetWidth() / tile_size;
+    const int tiles_y = map->GetHeight() / tile_size;
+    auto job = [&map, tile_size, tiles_x](unsigned int i) {
+        MapPixelCoordInt pos((i % tiles_x) * tile_size,
+                             (i / tiles_x) * tile_size);
+        map->GetRegion(pos, MapPixelDeltaInt(tile_size, tile_size));
+    };
+
+    const unsigned int num_jobs = tiles_x * tiles_y;
+    const unsigned int max_threads = boost::thread::hardware_concurrency();
+    double single = time_parallel(1, num_jobs, job);
+    report("TiffMap::GetRegion", 1, single, single);
+    for (unsigned int n = 2; n <= max_threads; n *= 2) {
+        double msecs = time_parallel(n, num_jobs, job);
+        report("TiffMap::GetRegion", n, msecs, single);
+        BOOST_WARN_MESSAGE(single / msecs > 0.6 * n,
+                           "TiffMap::GetRegion scales poorly with "
+                           << n << " threads");
+    }
+}
+
+// Pans over a wide stripped TIFF in display tiles, with and without the
+// decoded strip cache.
+BOOST_AUTO_TEST_CASE(tiffmap_stripped_pan)
+{
+    if (!testconfig.run_benchmarks()) {
+        return;
+    }
+    // Wide and stripped, similar to a scanned map sheet.
+    TempFile file;
+    WriteStrippedTif(file.GetFname(), 10240, 2048, 16);
+    TiffMap map(file.GetFname().c_str());
+    const int tile_size = 512;
+    const int tiles_x = map.GetWidth() / tile_size;
+    const int tiles_y = map.GetHeight() / tile_size;
+    // Row by row, as when panning horizontally.
+    auto job = [&map, tile_size, tiles_x](unsigned int i) {
+        MapPixelCoordInt pos((i % tiles_x) * tile_size,
+                             (i / tiles_x) * tile_size);
+        map.GetRegion(pos, MapPixelDeltaInt(tile_size, tile_size));
+    };
+    const unsigned int num_jobs = tiles_x * tiles_y;
+
+    TiffMap::SetStripCacheBudget(0);
+    double uncached = time_parallel(1, num_jobs, job);
+    TiffMap::SetStripCacheBudget(TiffMap::STRIP_CACHE_BUDGET);
+    auto before = TiffMap::GetStripCacheStats();
+    double cached = time_parallel(1, num_jobs, job);
+    auto stats = TiffMap::GetStripCacheStats();
+    report("TiffMap::GetRegion stripped, no cache", 1, uncached, uncached);
+    report("TiffMap::GetRegion stripped, cached", 1, cached, uncached);
+    std::cout << "    " << stats.misses - before.misses << " bands decoded, "
+              << stats.hits - before.hits << " decodes avoided" << std::endl;
+    // Every band is decoded once for the first tile of its row.
+    BOOST_CHECK_EQUAL(stats.hits - before.hits,
+                      (stats.misses - before.misses) * (tiles_x - 1));
+}
+
+// Compares reading and decoding GMP tiles via freshly allocated strings
+// (`LoadCompressedTile()`) against decrypting into a reused buffer
+// (`ReadCompressedTile()`). GVG maps can't be shipped with the tests, so
+// this only runs if one is specified via `--benchmark-gvg=<path>`.
+BOOST_AUTO_TEST_CASE(gmp_compressed_tile_reads)
+{
+    if (!testconfig.run_benchmarks() || !testconfig.benchmark_gvg()) {
+        return;
+    }
+    GVGFile gvgfile(WStringFromString(*testconfig.benchmark_gvg(), "utf-8"));
+    GMPImage image = MakeBestResolutionGmpImage(gvgfile);
+    const unsigned int tiles_x = image.NumTilesX();
+    const unsigned int num_jobs = tiles_x * image.NumTilesY();
+
+    auto alloc_read = [&image, tiles_x](unsigned int i) {
+        image.LoadCompressedTile(i % tiles_x, i / tiles_x);
+    };
+    boost::thread_specific_ptr<std::vector<unsigned char>> buf;
+    auto scratch_read = [&image, tiles_x, &buf](unsigned int i) {
+        if (!buf.get()) {
+            buf.reset(new std::vector<unsigned char>());
+        }
+        image.ReadCompressedTile(i % tiles_x, i / tiles_x, buf.get());
+    };
+    auto decode = [&image, tiles_x](unsigned int i) {
+        image.LoadTile(i % tiles_x, i / tiles_x);
+    };
+
+    // Warm the OS file cache, we're not interested in disk speed.
+    time_parallel(1, num_jobs, alloc_read);
+
+    const unsigned int max_threads = boost::thread::hardware_concurrency();
+    for (unsigned int n = 1; n <= max_threads; n *= 2) {
+        double alloc = time_parallel(n, num_jobs, alloc_read);
+        double scratch = time_parallel(n, num_jobs, scratch_read);
+        report("GMPImage::LoadCompressedTile", n, alloc, alloc);
+        report("GMPImage::ReadCompressedTile", n, scratch, alloc);
+        std::cout << "    " << std::setprecision(0)
+                  << num_jobs / scratch * 1000 << " tiles/s" << std::endl;
+    }
+    double single = time_parallel(1, num_jobs, decode);
+    report("GMPImage::LoadTile", 1, single, single);
+    for (unsigned int n = 2; n <= max_threads; n *= 2) {
+        double msecs = time_parallel(n, num_jobs, decode);
+        report("GMPImage::LoadTile", n, msecs, single);
+        BOOST_WARN_MESSAGE(single / msecs > 0.6 * n,
+                           "GMPImage::LoadTile scales poorly with "
+                           << n << " threads");
+    }
+}
+
+// Compares zoomed-out views decoded at reduced size by libjpeg against the
+// generic full decode followed by shrinking. Needs `--benchmark-gvg=<path>`.
+BOOST_AUTO_TEST_CASE(gvgmap_getregionreduced)
+{
+    if (!testconfig.run_benchmarks() || !testconfig.benchmark_gvg()) {
+        return;
+    }
+    GVGMap map(WStringFromString(*testconfig.benchmark_gvg(), "utf-8"));
+    const int region_size = 2048;
+    const int regions_x = std::max(1u, map.GetWidth() / region_size);
+    const int regions_y = std::max(1u, map.GetHeight() / region_size);
+    const unsigned int num_jobs = regions_x * regions_y;
+    for (unsigned int reduction = 2; reduction <= 8; reduction *= 2) {
+        auto shrink = [&map, region_size, regions_x, reduction](unsigned int i) {
+            MapPixelCoordInt pos((i % regions_x) * region_size,
+                                 (i / regions_x) * region_size);
+            MapPixelDeltaInt size(region_size, region_size);
+            map.RasterMap::GetRegionReduced(pos, size, reduction);
+        };
+        auto native = [&map, region_size, regions_x, reduction](unsigned int i) {
+            MapPixelCoordInt pos((i % regions_x) * region_size,
+                                 (i / regions_x) * region_size);
+            MapPixelDeltaInt size(region_size, region_size);
+            map.GetRegionReduced(pos, size, reduction);
+        };
+        double base = time_parallel(1, num_jobs, shrink);
+        double msecs = time_parallel(1, num_jobs, native);
+        std::ostringstream name;
+        name << "GVGMap::GetRegionReduced(" << reduction << ")";
+        report(name.str() + " shrink", 1, base, base);
+        report(name.str() + " jpeg", 1, msecs, base);
+        BOOST_WARN_MESSAGE(base / msecs > 1.5,
+                           name.str() << " is not faster than shrinking");
+    }
+}
+
+// Pans over a screen full of display tiles. GMP tiles along the display
+// tile borders must come from the tile cache instead of being decoded again.
+BOOST_AUTO_TEST_CASE(gvgmap_tile_cache)
+{
+    if (!testconfig.run_benchmarks() || !testconfig.benchmark_gvg()) {
+        return;
+    }
+    GVGMap map(WStringFromString(*testconfig.benchmark_gvg(), "utf-8"));
+    const int view_tile = 512;
+    const int screen_w = std::min(4 * view_tile, (int)map.GetWidth());
+    const int screen_h = std::min(3 * view_tile, (int)map.GetHeight());
+    auto start = boost::chrono::steady_clock::now();
+    for (int y = 0; y < screen_h; y += view_tile) {
+        for (int x = 0; x < screen_w; x += view_tile) {
+            map.GetRegion(MapPixelCoordInt(x, y),
+                          MapPixelDeltaInt(view_tile, view_tile));
+        }
+    }
+    auto elapsed = boost::chrono::steady_clock::now() - start;
+    double msecs = boost::chrono::duration<double, boost::milli>(
+            elapsed).count();
+
+    const GMPImage &image = map.GetGMPImage();
+    int tiles_x = (screen_w + image.TileWidth() - 1) / image.TileWidth();
+    int tiles_y = (screen_h + image.TileHeight() - 1) / image.TileHeight();
+    auto stats = map.GetTileCacheStats();
+    report("GVGMap::GetRegion pan", 1, msecs, msecs);
+    std::cout << "    " << stats.misses << " GMP tiles decoded, "
+              << stats.hits << " decodes avoided" << std::endl;
+    BOOST_CHECK_EQUAL(stats.misses, static_cast<uint64_t>(tiles_x * tiles_y));
+}
+
+/** Synthetic heights of a 2048x2048 DHM tile, plus a one pixel border. */
+static ElevationBuf16 get_benchmark_heights() {
+    const int tile_size = 2048;
+    ElevationBuf16 heights(tile_size + 2, tile_size + 2);
+    for (int y = 0; y < heights.GetHeight(); y++) {
+        for (int x = 0; x < heights.GetWidth(); x++) {
+            *heights.GetValuePtr(x, y) = static_cast<int16_t>(
+                    1000 + (7 * x + 3 * y) % 500 + (x * y) % 37);
+        }
+    }
+    return heights;
+}
+
+// Times `kernel(impl)` with the reference, vectorized, and threaded
+// implementations.
+static void benchmark_dhm_kernel(
+        const std::string &name,
+        const std::function<void(DHMKernelImpl)> &kernel)
+{
+    const unsigned int num_jobs = 5;
+    auto run = [&kernel](DHMKernelImpl impl) {
+        return time_parallel(1, num_jobs,
+                             [&kernel, impl](unsigned int) { kernel(impl); });
+    };
+    double reference = run(DHM_KERNEL_REFERENCE);
+    double vectorized = run(DHM_KERNEL_VECTORIZED);
+    double threaded = run(DHM_KERNEL_THREADED);
+    report(name + " reference", 1, reference, reference);
+    report(name + " vectorized", 1, vectorized, reference);
+    report(name + " threaded", 1, threaded, reference);
+    BOOST_WARN_MESSAGE(reference / vectorized > 4,
+                       name << " vectorized is not much faster");
+}
+
+BOOST_AUTO_TEST_CASE(gradient_kernel)
+{
+    if (!testconfig.run_benchmarks()) {
+        return;
+    }
+    ElevationBuf16 heights = get_benchmark_heights();
+    benchmark_dhm_kernel("ColorGradient", [&heights](DHMKernelImpl impl) {
+        ColorGradient(heights, impl);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(steepness_kernel)
+{
+    if (!testconfig.run_benchmarks()) {
+        return;
+    }
+    ElevationBuf16 heights = get_benchmark_heights();
+    benchmark_dhm_kernel("ColorSteepness", [&heights](DHMKernelImpl impl) {
+        ColorSteepness(heights, 10.0, impl);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(hillshade_kernel)
+{
+    if (!testconfig.run_benchmarks()) {
+        return;
+    }
+    ElevationBuf16 heights = get_benchmark_heights();
+    benchmark_dhm_kernel("ColorHillshade", [&heights](DHMKernelImpl impl) {
+        ColorHillshade(heights, 10.0, 315, 45, impl);
+    });
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -18,10 +18,14 @@
 
 #include "../include/rastermap.h"
 #include "../include/util.h"
+#include "../include/threading.h"
+#include "../include/display.h"
+#include "../include/mapdisplay.h"
 
 #include <boost/test/unit_test.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/chrono/include.hpp>
+#include <boost/atomic.hpp>
 
 #include "tests.h"
 
@@ -95,4 +99,241 @@ BOOST_AUTO_TEST_CASE(rastermap_getregion_multiple_maps)
     }
 }
 
+/** Wait until `counter` reaches `target`, return `false` on timeout. */
+static bool wait_for_count(const boost::atomic<unsigned int> &counter,
+                           unsigned int target)
+{
+    auto end_time = boost::chrono::system_clock::now() +
+                    boost::chrono::seconds(10);
+    while (counter < target) {
+        if (boost::chrono::system_clock::now() > end_time) {
+            return false;
+        }
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_runs_all_tasks)
+{
+    const unsigned int num_tasks = 1000;
+    boost::atomic<unsigned int> done(0);
+    ThreadPool pool(4);
+    BOOST_CHECK_EQUAL(pool.GetNumThreads(), 4U);
+    for (unsigned int i = 0; i < num_tasks; i++) {
+        // Half of the tasks are spawned from within the pool.
+        pool.Enqueue([&pool, &done]() {
+            pool.Enqueue([&done]() { ++done; });
+            ++done;
+        });
+    }
+    BOOST_CHECK(wait_for_count(done, 2 * num_tasks));
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_serial_group)
+{
+    const unsigned int num_tasks = 200;
+    boost::atomic<unsigned int> done(0);
+    boost::atomic<bool> running(false);
+    boost::atomic<bool> overlapped(false);
+    std::vector<unsigned int> order;
+    int group_tag;
+
+    ThreadPool pool(4);
+    for (unsigned int i = 0; i < num_tasks; i++) {
+        pool.Enqueue(&group_tag, [&, i]() {
+            if (running.exchange(true)) {
+                overlapped = true;
+            }
+            order.push_back(i);
+            boost::this_thread::yield();
+            running = false;
+            ++done;
+        });
+        // Unrelated tasks to keep the other workers busy.
+        pool.Enqueue([]() { boost::this_thread::yield(); });
+    }
+    BOOST_REQUIRE(wait_for_count(done, num_tasks));
+    BOOST_CHECK(!overlapped);
+    BOOST_REQUIRE_EQUAL(order.size(), num_tasks);
+    for (unsigned int i = 0; i < num_tasks; i++) {
+        BOOST_CHECK_EQUAL(order[i], i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_survives_exceptions)
+{
+    boost::atomic<unsigned int> done(0);
+    int group_tag;
+
+    ThreadPool pool(1);
+    pool.Enqueue([]() { throw std::runtime_error("task failed"); });
+    pool.Enqueue([&done]() { ++done; });
+    // A failing task must not leave its serial group stuck.
+    pool.Enqueue(&group_tag, []() { throw std::runtime_error("failed"); });
+    pool.Enqueue(&group_tag, [&done]() { ++done; });
+    BOOST_CHECK(wait_for_count(done, 2));
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_priorities)
+{
+    boost::atomic<bool> release(false);
+    boost::atomic<unsigned int> started(0);
+    boost::atomic<unsigned int> done(0);
+    std::vector<int> order;
+
+    // Block the only worker, so that everything else queues up.
+    ThreadPool pool(1);
+    pool.Enqueue([&release, &started, &done]() {
+        ++started;
+        while (!release) {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+        }
+        ++done;
+    });
+    BOOST_REQUIRE(wait_for_count(started, 1));
+    auto record = [&order, &done](int id) {
+        return [&order, &done, id]() { order.push_back(id); ++done; };
+    };
+    pool.Enqueue(record(1), 1.0);
+    TaskHandle cancelled = pool.Enqueue(record(2), 5.0);
+    pool.Enqueue(record(3), 3.0);
+    TaskHandle raised = pool.Enqueue(record(4), 0.0);
+    pool.Enqueue(record(5), 3.0);
+
+    BOOST_CHECK(cancelled.Cancel());
+    BOOST_CHECK(!cancelled.Cancel());
+    BOOST_CHECK(!cancelled.SetPriority(10.0));
+    BOOST_CHECK(raised.SetPriority(4.0));
+    release = true;
+
+    BOOST_REQUIRE(wait_for_count(done, 5));
+    BOOST_REQUIRE_EQUAL(order.size(), 4U);
+    BOOST_CHECK_EQUAL(order[0], 4);
+    BOOST_CHECK_EQUAL(order[1], 3);
+    BOOST_CHECK_EQUAL(order[2], 5);
+    BOOST_CHECK_EQUAL(order[3], 1);
+    // Finished tasks can neither be cancelled nor reprioritized.
+    BOOST_CHECK(!raised.Cancel());
+    BOOST_CHECK(!raised.SetPriority(1.0));
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_group_priorities)
+{
+    boost::atomic<bool> release(false);
+    boost::atomic<unsigned int> started(0);
+    boost::atomic<unsigned int> done(0);
+    std::vector<int> order;
+    int group_a, group_b;
+
+    // Block the only worker, so that everything else queues up.
+    ThreadPool pool(1);
+    pool.Enqueue([&release, &started, &done]() {
+        ++started;
+        while (!release) {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(1));
+        }
+        ++done;
+    });
+    BOOST_REQUIRE(wait_for_count(started, 1));
+    auto record = [&order, &done](int id) {
+        return [&order, &done, id]() { order.push_back(id); ++done; };
+    };
+    pool.Enqueue(record(1), 2.0);
+    // Raising a grouped task must move the whole group ahead.
+    TaskHandle raised = pool.Enqueue(&group_a, record(2), 0.0);
+    BOOST_CHECK(raised.SetPriority(5.0));
+    // So must adding an urgent task to a group that is already queued.
+    pool.Enqueue(&group_b, record(3), 0.0);
+    pool.Enqueue(&group_b, record(4), 4.0);
+    release = true;
+
+    BOOST_REQUIRE(wait_for_count(done, 5));
+    BOOST_REQUIRE_EQUAL(order.size(), 4U);
+    BOOST_CHECK_EQUAL(order[0], 2);
+    BOOST_CHECK_EQUAL(order[1], 4);
+    BOOST_CHECK_EQUAL(order[2], 1);
+    BOOST_CHECK_EQUAL(order[3], 3);
+}
+
+BOOST_AUTO_TEST_CASE(threadpool_run_all)
+{
+    ThreadPool pool(2);
+    boost::atomic<unsigned int> count(0);
+    std::vector<Task> tasks;
+    for (int i = 0; i < 16; i++) {
+        tasks.push_back([&count]() { ++count; });
+    }
+    pool.RunAll(tasks);
+    BOOST_CHECK_EQUAL(count, 16U);
+
+    // Nested use from within pool tasks must not deadlock, even when every
+    // worker is waiting in RunAll().
+    boost::atomic<unsigned int> done(0);
+    for (int i = 0; i < 2; i++) {
+        pool.Enqueue([&pool, &tasks, &done]() {
+            pool.RunAll(tasks);
+            ++done;
+        });
+    }
+    BOOST_REQUIRE(wait_for_count(done, 2));
+    BOOST_CHECK_EQUAL(count, 48U);
+
+    // Exceptions are passed on to the caller, after all tasks completed.
+    tasks.push_back([]() { throw std::runtime_error("task failed"); });
+    BOOST_CHECK_THROW(pool.RunAll(tasks), std::runtime_error);
+    BOOST_CHECK_EQUAL(count, 64U);
+}
+
+/** A display that only counts `ForceRepaint()` calls. */
+class RepaintCountingDisplay : public Display {
+public:
+    RepaintCountingDisplay() : m_repaints(0) {};
+    virtual unsigned int GetDisplayWidth() const { return 0; }
+    virtual unsigned int GetDisplayHeight() const { return 0; }
+    virtual DisplayDeltaInt GetDisplaySize() const {
+        return DisplayDeltaInt(0, 0);
+    }
+    virtual void SetDisplaySize(const DisplayDeltaInt &new_size) {}
+    virtual void Render(
+            const std::list<std::shared_ptr<DisplayOrder>> &orders) {}
+    virtual void Redraw() {}
+    virtual void ForceRepaint() { ++m_repaints; }
+    virtual PixelBuf
+    RenderToBuffer(ODMPixelFormat format,
+                   unsigned int width, unsigned int height,
+                   std::list<std::shared_ptr<DisplayOrder>> &orders)
+    {
+        return PixelBuf();
+    }
+
+    boost::atomic<unsigned int> m_repaints;
+};
+
+BOOST_AUTO_TEST_CASE(repaint_coalescer)
+{
+    auto display = std::make_shared<RepaintCountingDisplay>();
+    RepaintCoalescer coalescer(display, 300);
+
+    // After an idle period, the display is repainted right away.
+    coalescer.TileLoaded();
+    BOOST_REQUIRE(wait_for_count(display->m_repaints, 1));
+    BOOST_CHECK_EQUAL(coalescer.GetStats().last_absorbed, 1U);
+
+    // A burst within the interval is merged into a single repaint.
+    const unsigned int num_completions = 40;
+    for (unsigned int i = 0; i < num_completions; i++) {
+        coalescer.TileLoaded();
+    }
+    BOOST_REQUIRE(wait_for_count(display->m_repaints, 2));
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(50));
+    BOOST_CHECK_EQUAL(display->m_repaints, 2U);
+
+    auto stats = coalescer.GetStats();
+    BOOST_CHECK_EQUAL(stats.repaints, 2U);
+    BOOST_CHECK_EQUAL(stats.completions, num_completions + 1);
+    BOOST_CHECK_EQUAL(stats.last_absorbed, num_completions);
+    BOOST_CHECK_EQUAL(stats.max_absorbed, num_completions);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,332 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "../include/rastermap.h"
+#include "../include/map_geotiff.h"
+#include "../include/util.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include "tiffio.h"
+#include "libxtiff/xtiffio.h"
+#include "geotiffio.h"
+#include "geovalues.h"
+
+#include "tests.h"
+
+BOOST_AUTO_TEST_SUITE(geotiff)
+
+// Test images are 100x70 pixels in tiles of 32x32, so the last column and
+// row of tiles are partial.
+static const int TIF_WIDTH = 100;
+static const int TIF_HEIGHT = 70;
+static const int TIF_TILE_SIZE = 32;
+
+/** Sample values of the test images, different in every channel. */
+static unsigned char Sample(int x, int y, int channel) {
+    switch (channel) {
+        case 0: return static_cast<unsigned char>(3 * x);
+        case 1: return static_cast<unsigned char>(5 * y);
+        case 2: return static_cast<unsigned char>(x ^ y);
+        default: return static_cast<unsigned char>(255 - (x + y) % 64);
+    }
+}
+
+/** Heights of the test DHM, including negative ones. */
+static int16_t Height(int x, int y) {
+    return static_cast<int16_t>(37 * x - 101 * y);
+}
+
+enum TestTifLayout {
+    TIF_RGB,
+    TIF_RGBA_ASSOCIATED,
+    TIF_YCBCR_JPEG,
+    TIF_DHM,
+};
+
+/** Write a tiled test image, `Sample()` colors or `Height()` heights. */
+static void WriteTiledTif(const std::wstring &fname, TestTifLayout layout) {
+    TIFF *tif = XTIFFOpenW(fname.c_str(), "w");
+    if (!tif) {
+        throw std::runtime_error("Could not create tiled TIFF.");
+    }
+    int samples = (layout == TIF_RGBA_ASSOCIATED) ? 4 :
+                  (layout == TIF_DHM) ? 1 : 3;
+    int bytes_per_sample = (layout == TIF_DHM) ? 2 : 1;
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, TIF_WIDTH);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, TIF_HEIGHT);
+    TIFFSetField(tif, TIFFTAG_TILEWIDTH, TIF_TILE_SIZE);
+    TIFFSetField(tif, TIFFTAG_TILELENGTH, TIF_TILE_SIZE);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8 * bytes_per_sample);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, samples);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    switch (layout) {
+        case TIF_RGB:
+            TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+            break;
+        case TIF_RGBA_ASSOCIATED: {
+            uint16 extra = EXTRASAMPLE_ASSOCALPHA;
+            TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+            TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+            break;
+        }
+        case TIF_YCBCR_JPEG:
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
+            TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+            // Pass RGB in, libjpeg converts to subsampled YCbCr.
+            TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+            TIFFSetField(tif, TIFFTAG_JPEGQUALITY, 90);
+            break;
+        case TIF_DHM: {
+            TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+            TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_INT);
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+            const double tiepoints[6] = { 0, 0, 0, 13.0, 47.0, 0 };
+            const double pixscale[3] = { 1.0 / 1200, 1.0 / 1200, 0 };
+            TIFFSetField(tif, TIFFTAG_GEOTIEPOINTS, 6, tiepoints);
+            TIFFSetField(tif, TIFFTAG_GEOPIXELSCALE, 3, pixscale);
+            GTIF *gtif = GTIFNew(tif);
+            GTIFKeySet(gtif, GTModelTypeGeoKey, TYPE_SHORT, 1,
+                       ModelTypeGeographic);
+            GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1,
+                       RasterPixelIsArea);
+            GTIFKeySet(gtif, GeographicTypeGeoKey, TYPE_SHORT, 1,
+                       GCS_WGS_84);
+            GTIFKeySet(gtif, VerticalUnitsGeoKey, TYPE_SHORT, 1,
+                       Linear_Meter);
+            GTIFWriteKeys(gtif);
+            GTIFFree(gtif);
+            break;
+        }
+    }
+
+    const int bpp = samples * bytes_per_sample;
+    std::vector<unsigned char> tile(TIF_TILE_SIZE * TIF_TILE_SIZE * bpp);
+    for (int ty = 0; ty < TIF_HEIGHT; ty += TIF_TILE_SIZE) {
+        for (int tx = 0; tx < TIF_WIDTH; tx += TIF_TILE_SIZE) {
+            // Pixels beyond the image are written as well, they must not
+            // show up in the output.
+            for (int y = 0; y < TIF_TILE_SIZE; y++) {
+                for (int x = 0; x < TIF_TILE_SIZE; x++) {
+                    unsigned char *dest =
+                            &tile[(y * TIF_TILE_SIZE + x) * bpp];
+                    if (layout == TIF_DHM) {
+                        int16_t height = Height(tx + x, ty + y);
+                        memcpy(dest, &height, sizeof(height));
+                        continue;
+                    }
+                    for (int c = 0; c < samples; c++) {
+                        dest[c] = Sample(tx + x, ty + y, c);
+                    }
+                }
+            }
+            if (TIFFWriteTile(tif, &tile[0], tx, ty, 0, 0) < 0) {
+                XTIFFClose(tif);
+                throw std::runtime_error("Could not write TIFF tile.");
+            }
+        }
+    }
+    XTIFFClose(tif);
+}
+
+static bool PixelsEqual(const PixelBuf &a, const PixelBuf &b) {
+    return a.GetWidth() == b.GetWidth() && a.GetHeight() == b.GetHeight() &&
+           memcmp(a.GetRawData(), b.GetRawData(),
+                  a.GetWidth() * a.GetHeight() * sizeof(*a.GetRawData())) == 0;
+}
+
+/** Regions covering whole, partial and edge tiles, and the map border. */
+static const MapPixelCoordInt REGION_POS[] = {
+    MapPixelCoordInt(0, 0), MapPixelCoordInt(5, 7),
+    MapPixelCoordInt(31, 33), MapPixelCoordInt(70, 50),
+    MapPixelCoordInt(-10, -5),
+};
+static const MapPixelDeltaInt REGION_SIZE[] = {
+    MapPixelDeltaInt(TIF_WIDTH, TIF_HEIGHT), MapPixelDeltaInt(50, 40),
+    MapPixelDeltaInt(2, 30), MapPixelDeltaInt(40, 30),
+    MapPixelDeltaInt(30, 20),
+};
+
+/** Return `map.GetRegion()` via the direct and the TIFFRGBAImage path. */
+static void ReadBothWays(const TiffMap &map, int region,
+                         PixelBuf *direct, PixelBuf *generic)
+{
+    *direct = map.GetRegion(REGION_POS[region], REGION_SIZE[region]);
+    TiffMap::SetDirectTileReads(false);
+    try {
+        *generic = map.GetRegion(REGION_POS[region], REGION_SIZE[region]);
+    } catch (...) {
+        TiffMap::SetDirectTileReads(true);
+        throw;
+    }
+    TiffMap::SetDirectTileReads(true);
+}
+
+static void CheckDirectMatchesGeneric(TestTifLayout layout, int channels) {
+    TempFile file;
+    WriteTiledTif(file.GetFname(), layout);
+    TiffMap map(file.GetFname().c_str());
+    BOOST_REQUIRE_EQUAL(map.GetWidth(), static_cast<unsigned>(TIF_WIDTH));
+    BOOST_REQUIRE_EQUAL(map.GetHeight(), static_cast<unsigned>(TIF_HEIGHT));
+    for (int i = 0; i < ARRAY_SIZE(REGION_POS); i++) {
+        PixelBuf direct, generic;
+        ReadBothWays(map, i, &direct, &generic);
+        BOOST_CHECK(PixelsEqual(direct, generic));
+        if (layout == TIF_YCBCR_JPEG) {
+            continue;  // Lossy, only the paths can be compared.
+        }
+        // Spot check against the written image. Rows are bottom-up.
+        MapPixelCoordInt pos = REGION_POS[i];
+        MapPixelDeltaInt size = REGION_SIZE[i];
+        int x = std::max(-pos.x, 0), y = std::max(-pos.y, 0);
+        unsigned int expected = 0xff000000;
+        for (int c = 0; c < channels; c++) {
+            expected &= ~(0xffU << (8 * c));
+            expected |= Sample(pos.x + x, pos.y + y, c) << (8 * c);
+        }
+        BOOST_CHECK_EQUAL(direct.GetPixel(x, size.y - 1 - y), expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(direct_tiles_rgb)
+{
+    CheckDirectMatchesGeneric(TIF_RGB, 3);
+}
+
+BOOST_AUTO_TEST_CASE(direct_tiles_rgba_associated)
+{
+    CheckDirectMatchesGeneric(TIF_RGBA_ASSOCIATED, 4);
+}
+
+BOOST_AUTO_TEST_CASE(direct_tiles_ycbcr_jpeg)
+{
+    CheckDirectMatchesGeneric(TIF_YCBCR_JPEG, 3);
+}
+
+BOOST_AUTO_TEST_CASE(direct_tiles_dhm)
+{
+    TempFile file;
+    WriteTiledTif(file.GetFname(), TIF_DHM);
+    TiffMap map(file.GetFname().c_str());
+    BOOST_REQUIRE_EQUAL(map.GetType(), GeoDrawable::TYPE_DHM);
+    for (int i = 0; i < ARRAY_SIZE(REGION_POS); i++) {
+        PixelBuf direct, generic;
+        ReadBothWays(map, i, &direct, &generic);
+        BOOST_CHECK(PixelsEqual(direct, generic));
+
+        // Heights are sign-extended into the pixels, rows are bottom-up.
+        MapPixelCoordInt pos = REGION_POS[i];
+        MapPixelDeltaInt size = REGION_SIZE[i];
+        int x = std::max(-pos.x, 0), y = std::max(-pos.y, 0);
+        BOOST_CHECK_EQUAL(static_cast<int>(direct.GetPixel(
+                                  x, size.y - 1 - y)),
+                          Height(pos.x + x, pos.y + y));
+
+        ElevationBuf16 heights = map.GetElevationRegion(pos, size);
+        TiffMap::SetDirectTileReads(false);
+        ElevationBuf16 generic_heights = map.GetElevationRegion(pos, size);
+        TiffMap::SetDirectTileReads(true);
+        BOOST_REQUIRE_EQUAL(heights.GetWidth(), size.x);
+        BOOST_REQUIRE_EQUAL(heights.GetHeight(), size.y);
+        BOOST_CHECK(memcmp(heights.GetRawData(),
+                           generic_heights.GetRawData(),
+                           size.x * size.y * sizeof(int16_t)) == 0);
+    }
+}
+
+/** Compare `map.GetRegion()` with the pattern of `WriteStrippedTif()`. */
+static void CheckStrippedRegion(const TiffMap &map,
+                                const MapPixelCoordInt &pos,
+                                const MapPixelDeltaInt &size)
+{
+    PixelBuf region = map.GetRegion(pos, size);
+    BOOST_REQUIRE_EQUAL(region.GetWidth(), size.x);
+    BOOST_REQUIRE_EQUAL(region.GetHeight(), size.y);
+    int mismatches = 0;
+    for (int y = 0; y < size.y; y++) {
+        for (int x = 0; x < size.x; x++) {
+            int map_x = pos.x + x, map_y = pos.y + y;
+            if (map_x < 0 || map_y < 0 ||
+                map_x >= static_cast<int>(map.GetWidth()) ||
+                map_y >= static_cast<int>(map.GetHeight()))
+            {
+                continue;
+            }
+            unsigned int expected = (map_x & 0xff) |
+                                    (map_y & 0xff) << 8 |
+                                    ((map_x ^ map_y) & 0xff) << 16 |
+                                    0xff000000;
+            // PixelBufs are stored bottom-up.
+            if (region.GetPixel(x, size.y - 1 - y) != expected) {
+                mismatches++;
+            }
+        }
+    }
+    BOOST_CHECK_MESSAGE(mismatches == 0,
+                        mismatches << " wrong pixels in the region at ("
+                        << pos.x << ", " << pos.y << ") of size ("
+                        << size.x << ", " << size.y << ")");
+}
+
+BOOST_AUTO_TEST_CASE(stripped_regions)
+{
+    // 23 rows per strip and a height of 150: bands of 69 rows, the last
+    // band and strip are partial.
+    TempFile file;
+    WriteStrippedTif(file.GetFname(), 300, 150, 23);
+    TiffMap map(file.GetFname().c_str());
+    // Unaligned to strips and bands, across band boundaries, beyond the
+    // map edges, and the full image. Every region twice, the second time
+    // from the strip cache.
+    const MapPixelCoordInt positions[] = {
+        MapPixelCoordInt(3, 5), MapPixelCoordInt(101, 60),
+        MapPixelCoordInt(17, 130), MapPixelCoordInt(250, 120),
+        MapPixelCoordInt(-7, -3), MapPixelCoordInt(0, 0),
+    };
+    const MapPixelDeltaInt sizes[] = {
+        MapPixelDeltaInt(50, 37), MapPixelDeltaInt(97, 80),
+        MapPixelDeltaInt(64, 20), MapPixelDeltaInt(80, 50),
+        MapPixelDeltaInt(30, 100), MapPixelDeltaInt(300, 150),
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < ARRAY_SIZE(positions); i++) {
+            CheckStrippedRegion(map, positions[i], sizes[i]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stripped_single_strip)
+{
+    // ROWSPERSTRIP is 2^32-1 for images stored in a single strip, the strip
+    // height must be clamped to the image.
+    TempFile file;
+    WriteStrippedTif(file.GetFname(), 200, 90, 0xffffffff);
+    TiffMap map(file.GetFname().c_str());
+    CheckStrippedRegion(map, MapPixelCoordInt(11, 7),
+                        MapPixelDeltaInt(45, 33));
+    CheckStrippedRegion(map, MapPixelCoordInt(150, 70),
+                        MapPixelDeltaInt(64, 64));
+    CheckStrippedRegion(map, MapPixelCoordInt(0, 0),
+                        MapPixelDeltaInt(200, 90));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
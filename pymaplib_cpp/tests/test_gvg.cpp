@@ -0,0 +1,144 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <random>
+#include <stdexcept>
+
+#include "../include/map_gvg.h"
+#include "../include/util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(gvg)
+
+static std::vector<unsigned char> decrypt(const std::vector<unsigned char> &src,
+                                          unsigned long long int salt,
+                                          GVGDecryptImpl impl)
+{
+    // One spare byte to detect writes beyond the end.
+    std::vector<unsigned char> dest(src.size() + 1, 0xAA);
+    if (!src.empty()) {
+        GVGDecrypt(&src[0], &dest[0], src.size(), salt, impl);
+    }
+    BOOST_CHECK_EQUAL(dest.back(), 0xAA);
+    dest.pop_back();
+    return dest;
+}
+
+BOOST_AUTO_TEST_CASE(decrypt_implementations_match)
+{
+    const GVGDecryptImpl impls[] = {
+        GVG_DECRYPT_UNROLLED, GVG_DECRYPT_AVX2, GVG_DECRYPT_BEST
+    };
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> byte_dist(0, 255);
+    std::uniform_int_distribution<size_t> size_dist(0, 200);
+    for (int round = 0; round < 1000; round++) {
+        // Sizes around and beyond the vector widths, plus full tiles.
+        size_t size = (round % 10 == 0) ? 20000 + round : size_dist(rng);
+        unsigned long long int salt =
+            (static_cast<unsigned long long int>(rng()) << 32) | rng();
+        std::vector<unsigned char> src(size);
+        for (size_t i = 0; i < size; i++) {
+            src[i] = static_cast<unsigned char>(byte_dist(rng));
+        }
+        auto expected = decrypt(src, salt, GVG_DECRYPT_SCALAR);
+        for (size_t i = 0; i < ARRAY_SIZE(impls); i++) {
+            if (!GVGDecryptSupported(impls[i])) {
+                continue;
+            }
+            BOOST_REQUIRE(decrypt(src, salt, impls[i]) == expected);
+        }
+        // In-place decryption.
+        if (size) {
+            GVGDecrypt(&src[0], &src[0], size, salt);
+        }
+        BOOST_REQUIRE(src == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(decrypt_unsupported)
+{
+    if (GVGDecryptSupported(GVG_DECRYPT_AVX2)) {
+        return;
+    }
+    unsigned char buf[64] = {0};
+    BOOST_CHECK_THROW(GVGDecrypt(buf, buf, sizeof(buf), 0, GVG_DECRYPT_AVX2),
+                      std::runtime_error);
+}
+
+/** Decodes a tile filled with `value`, counting the calls. */
+struct CountingDecoder {
+    CountingDecoder(unsigned int value, int *calls)
+        : m_value(value), m_calls(calls)
+    {};
+    PixelBuf operator()() const {
+        (*m_calls)++;
+        PixelBuf tile(16, 16);
+        for (int i = 0; i < 16 * 16; i++) {
+            tile.GetRawData()[i] = m_value;
+        }
+        return tile;
+    }
+    unsigned int m_value;
+    int *m_calls;
+};
+
+BOOST_AUTO_TEST_CASE(tile_cache_maps)
+{
+    // Room for exactly two 16x16 tiles.
+    GMPTileCache cache(2 * 16 * 16 * sizeof(unsigned int));
+    int calls = 0;
+    PixelBuf a = cache.Get(1, 0, 0, 1, CountingDecoder(0xA, &calls));
+    PixelBuf b = cache.Get(2, 0, 0, 1, CountingDecoder(0xB, &calls));
+    BOOST_CHECK_EQUAL(calls, 2);
+
+    // Maps don't see each other's tiles, nor other reductions.
+    BOOST_CHECK_EQUAL(cache.Get(1, 0, 0, 1, CountingDecoder(0, &calls))
+                              .GetPixel(0, 0), 0xAu);
+    BOOST_CHECK_EQUAL(cache.Get(2, 0, 0, 1, CountingDecoder(0, &calls))
+                              .GetPixel(0, 0), 0xBu);
+    BOOST_CHECK_EQUAL(calls, 2);
+    BOOST_CHECK_EQUAL(cache.GetStats().hits, 2u);
+
+    // Erasing a map keeps the tiles of the others.
+    cache.EraseMap(1);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 1u);
+    cache.Get(2, 0, 0, 1, CountingDecoder(0, &calls));
+    BOOST_CHECK_EQUAL(calls, 2);
+    cache.Get(1, 0, 0, 1, CountingDecoder(0xA, &calls));
+    BOOST_CHECK_EQUAL(calls, 3);
+
+    // The budget is shared, a third tile evicts the least recently used.
+    cache.Get(3, 5, 7, 2, CountingDecoder(0xC, &calls));
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 2u);
+    BOOST_CHECK_EQUAL(cache.GetStats().evictions, 1u);
+    cache.Get(2, 0, 0, 1, CountingDecoder(0xB, &calls));
+    BOOST_CHECK_EQUAL(calls, 5);
+}
+
+BOOST_AUTO_TEST_CASE(tile_cache_failed_decode)
+{
+    // Tiles outside of the image decode to empty buffers, these aren't kept.
+    GMPTileCache cache(1024 * 1024);
+    int calls = 0;
+    auto decode_empty = [&calls]() { calls++; return PixelBuf(); };
+    BOOST_CHECK(!cache.Get(1, -1, 0, 1, decode_empty).GetData());
+    BOOST_CHECK(!cache.Get(1, -1, 0, 1, decode_empty).GetData());
+    BOOST_CHECK_EQUAL(calls, 2);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
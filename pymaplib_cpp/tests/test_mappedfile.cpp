@@ -0,0 +1,121 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#include "../include/mappedfile.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include "tests.h"
+
+BOOST_AUTO_TEST_SUITE(mappedfile)
+
+static const int64_t WINDOW = MappedFile::WINDOW_SIZE;
+// Two full windows and a partial one.
+static const int64_t FILE_SIZE = 2 * WINDOW + 1000;
+
+/** Content of the test file, not periodic in the window size. */
+static unsigned char FileByte(int64_t offset) {
+    return static_cast<unsigned char>(offset ^ (offset >> 8) ^
+                                      (offset >> 16));
+}
+
+static void WriteTestFile(const std::wstring &fname) {
+    std::vector<char> data(static_cast<size_t>(FILE_SIZE));
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(FileByte(i));
+    }
+    std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+    out.write(&data[0], data.size());
+    if (!out) {
+        throw std::runtime_error("Could not write test file.");
+    }
+}
+
+static bool ViewMatches(const MappedFile::View &view, int64_t offset) {
+    for (size_t i = 0; i < view.GetSize(); i++) {
+        if (view.GetData()[i] != FileByte(offset + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(window_boundaries)
+{
+    TempFile file;
+    WriteTestFile(file.GetFname());
+    MappedFile mapped(file.GetFname());
+    BOOST_REQUIRE_EQUAL(mapped.GetSize(), FILE_SIZE);
+
+    // Ranges up to, from, and across the window boundaries, and up to the
+    // end of the partial last window.
+    const int64_t offsets[] = {
+        0, WINDOW - 100, WINDOW, WINDOW - 10, 2 * WINDOW - 1,
+        2 * WINDOW - 500, FILE_SIZE - 1, 0, 1,
+    };
+    const size_t lengths[] = {
+        100, 100, 100, 20, 2,
+        1500, 1, static_cast<size_t>(FILE_SIZE),
+        static_cast<size_t>(WINDOW + 10),
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(offsets); i++) {
+        MappedFile::View view = mapped.Map(offsets[i], lengths[i]);
+        BOOST_REQUIRE_EQUAL(view.GetSize(), lengths[i]);
+        BOOST_CHECK_MESSAGE(ViewMatches(view, offsets[i]),
+                            "Wrong data at offset " << offsets[i]);
+
+        std::vector<unsigned char> buf(lengths[i]);
+        mapped.ReadAt(offsets[i], &buf[0], buf.size());
+        BOOST_CHECK(memcmp(&buf[0], view.GetData(), buf.size()) == 0);
+    }
+
+    BOOST_CHECK_EQUAL(mapped.Map(FILE_SIZE, 0).GetSize(), 0u);
+    BOOST_CHECK_THROW(mapped.Map(FILE_SIZE - 10, 11), std::runtime_error);
+    BOOST_CHECK_THROW(mapped.Map(-1, 10), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(window_budget)
+{
+    TempFile file;
+    WriteTestFile(file.GetFname());
+    size_t mapped_before = MappedFile::GetMappedBytes();
+    MappedFile::SetWindowBudget(static_cast<size_t>(WINDOW));
+    try {
+        MappedFile first(file.GetFname());
+        MappedFile second(file.GetFname());
+        MappedFile::View held = first.Map(10, 100);
+        first.Map(WINDOW + 10, 100);
+        // The budget is shared, windows of other files are evicted too.
+        second.Map(2 * WINDOW, 100);
+        BOOST_CHECK_LE(MappedFile::GetMappedBytes(),
+                       static_cast<size_t>(WINDOW));
+        // Views stay valid after their window was evicted.
+        BOOST_CHECK(ViewMatches(held, 10));
+        BOOST_CHECK(ViewMatches(first.Map(20, 100), 20));
+    } catch (...) {
+        MappedFile::SetWindowBudget(MappedFile::DEFAULT_WINDOW_BUDGET);
+        throw;
+    }
+    MappedFile::SetWindowBudget(MappedFile::DEFAULT_WINDOW_BUDGET);
+    // Windows are unmapped with their files.
+    BOOST_CHECK_LE(MappedFile::GetMappedBytes(), mapped_before);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,121 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+#include "../include/memjpeg.h"
+#include "../include/pixelbuf.h"
+
+#include <boost/test/unit_test.hpp>
+
+extern "C" {
+#include "jpeglib.h"
+}
+
+BOOST_AUTO_TEST_SUITE(memjpeg)
+
+METHODDEF(void)
+throw_on_error(j_common_ptr cinfo) {
+    throw std::runtime_error("Failed to compress test JPEG.");
+}
+
+/** Encode a `width` x `height` test pattern in `color_space`. */
+static std::vector<unsigned char>
+EncodeTestJpeg(int width, int height, J_COLOR_SPACE color_space) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr err_mgr;
+    cinfo.err = jpeg_std_error(&err_mgr);
+    err_mgr.error_exit = throw_on_error;
+    jpeg_create_compress(&cinfo);
+    auto deleter = [](j_compress_ptr p){ jpeg_destroy_compress(p); };
+    std::unique_ptr<jpeg_compress_struct, decltype(deleter)>
+            cleanup_cinfo(&cinfo, deleter);
+
+    unsigned char *outbuf = nullptr;
+    unsigned long outsize = 0;
+    auto outbuf_deleter = [](unsigned char **p){ free(*p); };
+    std::unique_ptr<unsigned char*, decltype(outbuf_deleter)>
+            cleanup_outbuf(&outbuf, outbuf_deleter);
+    jpeg_mem_dest(&cinfo, &outbuf, &outsize);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    // RGB-coded JPEGs are stored without subsampling.
+    jpeg_set_colorspace(&cinfo, color_space);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<unsigned char> row(3 * width);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        int y = cinfo.next_scanline;
+        for (int x = 0; x < width; x++) {
+            // Distinct, non-flat channels, so that a swap is visible.
+            row[3*x + 0] = static_cast<unsigned char>(10 * x);
+            row[3*x + 1] = static_cast<unsigned char>(7 * y + 3 * x);
+            row[3*x + 2] = static_cast<unsigned char>(255 - 12 * y);
+        }
+        JSAMPROW rowptr = &row[0];
+        jpeg_write_scanlines(&cinfo, &rowptr, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    return std::vector<unsigned char>(outbuf, outbuf + outsize);
+}
+
+BOOST_AUTO_TEST_CASE(swap_rb_lossless)
+{
+    // Sizes that aren't multiples of the 8x8 DCT blocks.
+    const int width = 21, height = 13;
+    auto jpeg = EncodeTestJpeg(width, height, JCS_RGB);
+    std::vector<unsigned char> swapped;
+    BOOST_REQUIRE(jpeg_swap_rb_lossless(&jpeg[0], jpeg.size(), &swapped));
+
+    PixelBuf orig = decompress_jpeg(&jpeg[0], jpeg.size());
+    PixelBuf result = decompress_jpeg(&swapped[0], swapped.size());
+    BOOST_REQUIRE_EQUAL(result.GetWidth(), width);
+    BOOST_REQUIRE_EQUAL(result.GetHeight(), height);
+    int mismatches = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned int o = orig.GetPixel(x, y);
+            unsigned int r = result.GetPixel(x, y);
+            // The coefficients are moved, not recomputed: R and B are
+            // exchanged exactly, G is bit-identical.
+            if ((r & 0xff) != ((o >> 16) & 0xff) ||
+                ((r >> 8) & 0xff) != ((o >> 8) & 0xff) ||
+                ((r >> 16) & 0xff) != (o & 0xff))
+            {
+                mismatches++;
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
+BOOST_AUTO_TEST_CASE(swap_rb_lossless_ycbcr)
+{
+    // With a color transform, the swap would need re-encoding.
+    auto jpeg = EncodeTestJpeg(16, 16, JCS_YCbCr);
+    std::vector<unsigned char> swapped(1, 0xAA);
+    BOOST_CHECK(!jpeg_swap_rb_lossless(&jpeg[0], jpeg.size(), &swapped));
+    BOOST_REQUIRE_EQUAL(swapped.size(), 1u);
+    BOOST_CHECK_EQUAL(swapped[0], 0xAA);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
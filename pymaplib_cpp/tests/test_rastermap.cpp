@@ -14,8 +14,13 @@
 
 #include <string>
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 
 #include "../include/rastermap.h"
+#include "../include/map_dhm_advanced.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -114,4 +119,247 @@ BOOST_AUTO_TEST_CASE(MapCoordToMapCoord)
 }
 
 
+// A geographic DHM of `size` x `size` pixels, about 7.5 x 11 meters each.
+// Heights are returned in packed pixels, as from GetRegion() of DHMs.
+class MockDHM : public RasterMap {
+public:
+    explicit MockDHM(int size = 640) : m_size(size) {};
+    virtual DrawableType GetType() const { return TYPE_DHM; }
+    virtual unsigned int GetWidth() const { return m_size; }
+    virtual unsigned int GetHeight() const { return m_size; }
+    virtual MapPixelDeltaInt GetSize() const {
+        return MapPixelDeltaInt(m_size, m_size);
+    }
+    virtual PixelBuf GetRegion(const MapPixelCoordInt &pos,
+                               const MapPixelDeltaInt &size) const
+    {
+        // PixelBufs are stored bottom-up.
+        PixelBuf result(size.x, size.y);
+        for (int y = 0; y < size.y; y++) {
+            for (int x = 0; x < size.x; x++) {
+                int height = Height(pos.x + x, pos.y + size.y - 1 - y);
+                *result.GetPixelPtr(x, y) = static_cast<unsigned int>(height);
+            }
+        }
+        return result;
+    }
+    virtual bool
+    PixelToLatLon(const MapPixelCoord &pos, LatLon *result) const {
+        result->lat = 47 - pos.y * 1e-4;
+        result->lon = 11 + pos.x * 1e-4;
+        return true;
+    }
+    virtual bool
+    LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const {
+        result->x = (pos.lon - 11) / 1e-4;
+        result->y = (47 - pos.lat) / 1e-4;
+        return true;
+    }
+    virtual Projection GetProj() const {
+        return Projection("+proj=latlong +datum=WGS84");
+    }
+    virtual const std::wstring &GetFname() const { return empty_wstr; }
+    virtual const std::wstring &GetTitle() const { return empty_wstr; }
+    virtual const std::wstring &GetDescription() const { return empty_wstr; }
+    virtual ODMPixelFormat GetPixelFormat() const { return ODM_PIX_INVALID; }
+    virtual bool SupportsConcurrentGetRegion() const { return true; }
+
+    static int Height(int x, int y) { return 3 * x - 5 * y + (x * y) % 7; }
+private:
+    int m_size;
+};
+
+BOOST_AUTO_TEST_CASE(elevation_region)
+{
+    MockDHM dhm;
+    auto heights = dhm.GetElevationRegion(MapPixelCoordInt(3, 2),
+                                          MapPixelDeltaInt(5, 4));
+    BOOST_REQUIRE_EQUAL(heights.GetWidth(), 5);
+    BOOST_REQUIRE_EQUAL(heights.GetHeight(), 4);
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 5; x++) {
+            BOOST_CHECK_EQUAL(heights.GetValue(x, y),
+                              MockDHM::Height(3 + x, 5 - y));
+        }
+    }
+
+    MockGeoDrawable map;
+    BOOST_CHECK_THROW(map.GetElevationRegion(MapPixelCoordInt(0, 0),
+                                             MapPixelDeltaInt(2, 2)),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(elevation_region_bounds)
+{
+    MockDHM dhm(64);
+    auto heights = GetElevationRegion_BoundsHelper(
+            dhm, MapPixelCoordInt(-2, 62), MapPixelDeltaInt(4, 4));
+    BOOST_REQUIRE(heights.GetRawData());
+    // Rows are stored bottom-up, only the top two are inside the map.
+    for (int x = 0; x < 4; x++) {
+        BOOST_CHECK_EQUAL(heights.GetValue(x, 0), 0);
+        BOOST_CHECK_EQUAL(heights.GetValue(x, 1), 0);
+    }
+    BOOST_CHECK_EQUAL(heights.GetValue(0, 3), 0);
+    BOOST_CHECK_EQUAL(heights.GetValue(2, 3), MockDHM::Height(0, 62));
+    BOOST_CHECK_EQUAL(heights.GetValue(3, 2), MockDHM::Height(1, 63));
+}
+
+// Random heights, including extremes, with an odd width to exercise the
+// scalar tail of the vectorized rows.
+static ElevationBuf16 RandomHeights() {
+    ElevationBuf16 heights(1027, 600);
+    srand(42);
+    int16_t *data = heights.GetRawData();
+    for (int i = 0; i < heights.GetWidth() * heights.GetHeight(); i++) {
+        switch (rand() % 4) {
+            case 0: data[i] = (rand() % 2) ? 32767 : -32768; break;
+            case 1: data[i] = static_cast<int16_t>(rand() % 65536 - 32768);
+                    break;
+            default: data[i] = static_cast<int16_t>(500 + rand() % 200);
+        }
+    }
+    return heights;
+}
+
+static bool PixelsEqual(const PixelBuf &a, const PixelBuf &b) {
+    return a.GetWidth() == b.GetWidth() && a.GetHeight() == b.GetHeight() &&
+           memcmp(a.GetRawData(), b.GetRawData(),
+                  a.GetWidth() * a.GetHeight() * sizeof(*a.GetRawData())) == 0;
+}
+
+BOOST_AUTO_TEST_CASE(gradient_implementations_match)
+{
+    ElevationBuf16 heights = RandomHeights();
+    PixelBuf reference = ColorGradient(heights, DHM_KERNEL_REFERENCE);
+    BOOST_REQUIRE_EQUAL(reference.GetWidth(), 1025);
+    BOOST_REQUIRE_EQUAL(reference.GetHeight(), 598);
+    BOOST_CHECK(PixelsEqual(
+            reference, ColorGradient(heights, DHM_KERNEL_VECTORIZED)));
+    BOOST_CHECK(PixelsEqual(
+            reference, ColorGradient(heights, DHM_KERNEL_THREADED)));
+
+    // Flat terrain has the hue of its height. It is computed with unsigned
+    // arithmetic, which wraps around for negative heights.
+    const int16_t flat_heights[] = { -32768, -4000, -100, -1, 0, 4000 };
+    const DHMKernelImpl impls[] = { DHM_KERNEL_REFERENCE,
+                                    DHM_KERNEL_VECTORIZED,
+                                    DHM_KERNEL_THREADED };
+    for (int i = 0; i < 6; i++) {
+        ElevationBuf16 flat(34, 3);
+        std::fill(flat.GetRawData(), flat.GetRawData() + 34 * 3,
+                  flat_heights[i]);
+        unsigned int elevation = static_cast<unsigned int>(flat_heights[i]);
+        unsigned int expected = HSV_to_RGB(
+                static_cast<unsigned char>(170 - elevation*255/4000),
+                255, 128);
+        for (int j = 0; j < 3; j++) {
+            PixelBuf pixels = ColorGradient(flat, impls[j]);
+            BOOST_CHECK_EQUAL(pixels.GetPixel(0, 0), expected);
+            BOOST_CHECK_EQUAL(pixels.GetPixel(31, 0), expected);
+        }
+    }
+
+    BOOST_CHECK_THROW(ColorGradient(ElevationBuf16(1, 5)),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(steepness_implementations_match)
+{
+    ElevationBuf16 heights = RandomHeights();
+    const double mpps[] = { 1, 23.7, 90, 5000 };
+    for (int i = 0; i < 4; i++) {
+        PixelBuf reference = ColorSteepness(heights, mpps[i],
+                                            DHM_KERNEL_REFERENCE);
+        BOOST_CHECK(PixelsEqual(
+                reference,
+                ColorSteepness(heights, mpps[i], DHM_KERNEL_VECTORIZED)));
+        BOOST_CHECK(PixelsEqual(
+                reference,
+                ColorSteepness(heights, mpps[i], DHM_KERNEL_THREADED)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hillshade_implementations_match)
+{
+    ElevationBuf16 heights = RandomHeights();
+    PixelBuf reference = ColorHillshade(heights, 23.7, 315, 45,
+                                        DHM_KERNEL_REFERENCE);
+    PixelBuf threaded = ColorHillshade(heights, 23.7, 315, 45,
+                                       DHM_KERNEL_THREADED);
+    BOOST_REQUIRE_EQUAL(threaded.GetWidth(), reference.GetWidth());
+    BOOST_REQUIRE_EQUAL(threaded.GetHeight(), reference.GetHeight());
+    int max_diff = 0;
+    for (int y = 0; y < reference.GetHeight(); y++) {
+        for (int x = 0; x < reference.GetWidth(); x++) {
+            int ref = *reference.GetPixelPtr(x, y);
+            int value = *threaded.GetPixelPtr(x, y);
+            BOOST_REQUIRE_EQUAL(value, makeRGB(value, value, value));
+            max_diff = std::max(max_diff, std::abs((ref & 0xff) -
+                                                   (value & 0xff)));
+        }
+    }
+    BOOST_CHECK_LE(max_diff, 1);
+}
+
+BOOST_AUTO_TEST_CASE(hillshade_lighting)
+{
+    // Rises towards the east (increasing x) in the left half, falls in
+    // the right half. Rows are bottom-up.
+    ElevationBuf16 heights(12, 3);
+    for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 12; x++) {
+            *heights.GetValuePtr(x, y) =
+                static_cast<int16_t>(x < 6 ? 10 * x : 100 - 10 * x);
+        }
+    }
+    // Light from the west shines onto the slope rising to the east.
+    PixelBuf west = ColorHillshade(heights, 10, 270, 45);
+    BOOST_CHECK_GT(*west.GetPixelPtr(1, 0) & 0xff,
+                   *west.GetPixelPtr(8, 0) & 0xff);
+    PixelBuf east = ColorHillshade(heights, 10, 90, 45);
+    BOOST_CHECK_LT(*east.GetPixelPtr(1, 0) & 0xff,
+                   *east.GetPixelPtr(8, 0) & 0xff);
+
+    // Flat terrain is lit fully by light from straight above.
+    ElevationBuf16 flat(10, 10);
+    PixelBuf shade = ColorHillshade(flat, 10, 315, 90);
+    BOOST_CHECK_EQUAL(*shade.GetPixelPtr(3, 3), makeRGB(255, 255, 255));
+}
+
+BOOST_AUTO_TEST_CASE(terrain_info_batch)
+{
+    std::shared_ptr<RasterMap> dhm(new MockDHM());
+    std::vector<LatLon> positions;
+    for (int i = 0; i < 50; i++) {
+        // Spread over several blocks, some points share a pixel.
+        positions.push_back(LatLon(47 - (i * 13 % 631 + 0.3) * 1e-4,
+                                   11 + (i * 37 % 629 + 0.6) * 1e-4));
+    }
+    positions.push_back(LatLon(48, 12));
+    positions.push_back(LatLon(47 - 1e-5, 11 + 1e-5));
+
+    std::vector<TerrainInfo> results;
+    std::vector<int> valid = CalcTerrainInfoBatch(dhm, positions, &results);
+    BOOST_REQUIRE_EQUAL(valid.size(), positions.size());
+    BOOST_REQUIRE_EQUAL(results.size(), positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+        TerrainInfo expected;
+        bool ok = CalcTerrainInfo(dhm, positions[i], &expected);
+        BOOST_REQUIRE_EQUAL(valid[i] != 0, ok);
+        if (!ok) {
+            continue;
+        }
+        BOOST_CHECK_CLOSE(results[i].height_m, expected.height_m, 1e-9);
+        // The pixel size is computed once per block.
+        BOOST_CHECK_CLOSE(results[i].steepness_deg, expected.steepness_deg,
+                          0.1);
+        BOOST_CHECK_CLOSE(results[i].slope_face_deg, expected.slope_face_deg,
+                          0.1);
+    }
+    // Outside of the map, and right at its corner.
+    BOOST_CHECK(!valid[50]);
+    BOOST_CHECK(valid[51]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
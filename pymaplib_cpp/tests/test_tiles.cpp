@@ -0,0 +1,259 @@
+// Copyright 2015 Christian Aichinger <Greek0@gmx.net>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <iostream>
+
+#include "../include/rastermap.h"
+#include "../include/tiles.h"
+#include "../include/tilestore.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/atomic.hpp>
+
+BOOST_AUTO_TEST_SUITE(tiles)
+
+static std::wstring empty_wstr(L"");
+
+/** A map that fills each region with its x coordinate and counts calls. */
+class CountingGeoDrawable : public GeoDrawable {
+public:
+    CountingGeoDrawable() : m_calls(0) {};
+    virtual ~CountingGeoDrawable() {};
+    virtual bool
+    PixelToLatLon(const MapPixelCoord &pos, LatLon *result) const {
+        return false;
+    }
+    virtual bool
+    LatLonToPixel(const LatLon &pos, MapPixelCoord *result) const {
+        return false;
+    }
+
+    virtual DrawableType GetType() const { return TYPE_MAP; }
+    virtual unsigned int GetWidth() const { return 4096; }
+    virtual unsigned int GetHeight() const { return 4096; }
+    virtual MapPixelDeltaInt GetSize() const {
+        return MapPixelDeltaInt(4096, 4096);
+    }
+
+    virtual PixelBuf GetRegion(const MapPixelCoordInt &pos,
+                               const MapPixelDeltaInt &size) const
+    {
+        ++m_calls;
+        return PixelBuf(size.x, size.y, pos.x);
+    }
+
+    virtual Projection GetProj() const { return Projection(""); }
+    virtual const std::wstring &GetFname() const { return empty_wstr; }
+    virtual const std::wstring &GetTitle() const { return empty_wstr; }
+    virtual const std::wstring &GetDescription() const { return empty_wstr; }
+
+    virtual ODMPixelFormat GetPixelFormat() const { return ODM_PIX_RGBX4; }
+
+    unsigned int GetCalls() const { return m_calls; }
+private:
+    mutable boost::atomic<unsigned int> m_calls;
+};
+
+/** A `CountingGeoDrawable` eligible for the `PersistentTileStore`. */
+class PersistentGeoDrawable : public CountingGeoDrawable {
+public:
+    explicit PersistentGeoDrawable(const std::wstring &fname,
+                                   const std::wstring &identity = L"")
+        : m_fname(fname), m_identity(identity) {};
+    virtual const std::wstring &GetFname() const { return m_fname; }
+    virtual bool SupportsPersistentCache() const { return true; }
+    virtual std::wstring GetCacheIdentity() const { return m_identity; }
+private:
+    std::wstring m_fname;
+    std::wstring m_identity;
+};
+
+BOOST_AUTO_TEST_CASE(lru_cache_budget)
+{
+    LRUCache<int, int> cache(100);
+    cache.Put(1, 10, 40);
+    cache.Put(2, 20, 40);
+    int value = 0;
+    BOOST_CHECK(cache.Get(1, &value));
+    BOOST_CHECK_EQUAL(value, 10);
+
+    // Exceeding the budget evicts the least recently used entry (2).
+    cache.Put(3, 30, 40);
+    BOOST_CHECK(cache.Contains(1));
+    BOOST_CHECK(!cache.Contains(2));
+    BOOST_CHECK(cache.Contains(3));
+
+    // Entries larger than the whole budget are never stored.
+    cache.Put(4, 40, 101);
+    BOOST_CHECK(!cache.Contains(4));
+
+    auto stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.hits, 1U);
+    BOOST_CHECK_EQUAL(stats.entries, 2U);
+    BOOST_CHECK_EQUAL(stats.bytes, 80U);
+    BOOST_CHECK_EQUAL(stats.evictions, 1U);
+
+    // Shrinking the budget evicts in LRU order as well.
+    cache.SetBudget(50);
+    BOOST_CHECK_EQUAL(cache.GetStats().entries, 1U);
+    BOOST_CHECK(cache.Contains(3));
+}
+
+BOOST_AUTO_TEST_CASE(tilecache_shared)
+{
+    auto map = std::make_shared<CountingGeoDrawable>();
+    TileCache &cache = TileCache::Instance();
+    cache.ResetStats();
+
+    TileCode tc1(map, MapPixelCoordInt(512, 0), MapPixelDeltaInt(512, 512));
+    TileCode tc2(map, MapPixelCoordInt(512, 0), MapPixelDeltaInt(512, 512));
+    auto pixels = tc1.GetTile();
+    BOOST_CHECK_EQUAL(map->GetCalls(), 1U);
+    BOOST_CHECK_EQUAL(pixels.GetPixel(0, 0), 512U);
+
+    // An equal TileCode must be served from the cache.
+    auto cached = tc2.GetTile();
+    BOOST_CHECK_EQUAL(map->GetCalls(), 1U);
+    BOOST_CHECK(cached.GetRawData() == pixels.GetRawData());
+
+    auto stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.hits, 1U);
+    BOOST_CHECK_EQUAL(stats.misses, 1U);
+
+    cache.EvictDrawable(map.get());
+    tc2.GetTile();
+    BOOST_CHECK_EQUAL(map->GetCalls(), 2U);
+    cache.EvictDrawable(map.get());
+}
+
+BOOST_AUTO_TEST_CASE(reduced_tiles)
+{
+    auto map = std::make_shared<CountingGeoDrawable>();
+    TileCode full(map, MapPixelCoordInt(1024, 0), MapPixelDeltaInt(1024, 1024));
+    TileCode reduced(map, MapPixelCoordInt(1024, 0),
+                     MapPixelDeltaInt(1024, 1024), 2);
+    BOOST_CHECK(full != reduced);
+
+    // The default GetRegionReduced() averages full-resolution pixels.
+    auto pixels = reduced.GetTile();
+    BOOST_CHECK_EQUAL(pixels.GetWidth(), 512U);
+    BOOST_CHECK_EQUAL(pixels.GetHeight(), 512U);
+    BOOST_CHECK_EQUAL(pixels.GetPixel(0, 0), 1024U);
+    BOOST_CHECK_EQUAL(pixels.GetPixel(511, 511), 1024U);
+
+    // Regions must be aligned to the reduction.
+    BOOST_CHECK_THROW(map->GetRegionReduced(MapPixelCoordInt(1, 0),
+                                            MapPixelDeltaInt(512, 512), 2),
+                      std::runtime_error);
+    TileCache::Instance().EvictDrawable(map.get());
+}
+
+/** A DHM whose heights encode their position. */
+class PositionDHM : public CountingGeoDrawable {
+public:
+    virtual DrawableType GetType() const { return TYPE_DHM; }
+    virtual PixelBuf GetRegion(const MapPixelCoordInt &pos,
+                               const MapPixelDeltaInt &size) const
+    {
+        // PixelBufs are stored bottom-up.
+        PixelBuf result(size.x, size.y);
+        for (int y = 0; y < size.y; y++) {
+            for (int x = 0; x < size.x; x++) {
+                *result.GetPixelPtr(x, y) =
+                    Height(pos.x + x, pos.y + size.y - 1 - y);
+            }
+        }
+        return result;
+    }
+    static unsigned int Height(int x, int y) { return x + 10000 * y; }
+};
+
+// Zoomed-out views of DHMs request reduced tiles, too.
+BOOST_AUTO_TEST_CASE(reduced_dhm_tiles)
+{
+    auto map = std::make_shared<PositionDHM>();
+    TileCode reduced(map, MapPixelCoordInt(1024, 512),
+                     MapPixelDeltaInt(1024, 1024), 4);
+    auto pixels = reduced.GetTile();
+    BOOST_REQUIRE_EQUAL(pixels.GetWidth(), 256U);
+    BOOST_REQUIRE_EQUAL(pixels.GetHeight(), 256U);
+    // Heights are subsampled, not averaged.
+    BOOST_CHECK_EQUAL(pixels.GetPixel(0, 255), PositionDHM::Height(1024, 512));
+    BOOST_CHECK_EQUAL(pixels.GetPixel(3, 254), PositionDHM::Height(1036, 516));
+    BOOST_CHECK_EQUAL(pixels.GetPixel(255, 0),
+                      PositionDHM::Height(2044, 1532));
+    TileCache::Instance().EvictDrawable(map.get());
+}
+
+BOOST_AUTO_TEST_CASE(persistent_tile_store)
+{
+    // Any existing file will do as the map file, use the test executable.
+    auto map = std::make_shared<PersistentGeoDrawable>(GetProgramPath_wchar());
+    const std::wstring directory(L"test_tilestore");
+    const MapPixelDeltaInt tilesize(256, 256);
+
+    // Room for three tiles of 256 KiB plus file headers.
+    PersistentTileStore store(1024 * 1024);
+    store.SetDirectory(directory);
+    store.Clear();
+
+    TileCode tc(map, MapPixelCoordInt(256, 0), tilesize);
+    PixelBuf result;
+    BOOST_CHECK(!store.Get(tc, &result));
+    store.Put(tc, map->GetRegion(tc.GetPosition(), tilesize));
+    BOOST_CHECK(store.Get(tc, &result));
+    BOOST_CHECK_EQUAL(result.GetWidth(), 256U);
+    BOOST_CHECK_EQUAL(result.GetHeight(), 256U);
+    BOOST_CHECK_EQUAL(result.GetPixel(0, 0), 256U);
+    BOOST_CHECK_EQUAL(result.GetPixel(255, 255), 256U);
+
+    // Tiles are identified by position, size and reduction.
+    TileCode reduced(map, MapPixelCoordInt(256, 0), tilesize, 2);
+    BOOST_CHECK(!store.Get(reduced, &result));
+    // Further data files of the map count, too.
+    auto other_data = std::make_shared<PersistentGeoDrawable>(
+            GetProgramPath_wchar(), L"other.gmp");
+    TileCode other_data_tc(other_data, MapPixelCoordInt(256, 0), tilesize);
+    BOOST_CHECK(!store.Get(other_data_tc, &result));
+
+    // Stored tiles are taken over by later sessions.
+    PersistentTileStore later(1024 * 1024);
+    later.SetDirectory(directory);
+    BOOST_CHECK_EQUAL(later.GetStats().entries, 1U);
+    BOOST_CHECK(later.Get(tc, &result));
+    BOOST_CHECK_EQUAL(result.GetPixel(0, 0), 256U);
+
+    // Exceeding the budget deletes the least recently used tile.
+    for (int i = 1; i <= 3; i++) {
+        TileCode other(map, MapPixelCoordInt(256 * i, 256), tilesize);
+        later.Put(other, map->GetRegion(other.GetPosition(), tilesize));
+    }
+    auto stats = later.GetStats();
+    BOOST_CHECK_EQUAL(stats.entries, 3U);
+    BOOST_CHECK_EQUAL(stats.evictions, 1U);
+    BOOST_CHECK(stats.bytes <= stats.budget);
+    BOOST_CHECK(!later.Get(tc, &result));
+
+    // Maps not supporting the store are ignored.
+    auto plain = std::make_shared<CountingGeoDrawable>();
+    TileCode plain_tc(plain, MapPixelCoordInt(0, 0), tilesize);
+    later.Put(plain_tc, plain->GetRegion(plain_tc.GetPosition(), tilesize));
+    BOOST_CHECK(!later.Get(plain_tc, &result));
+
+    later.Clear();
+    BOOST_CHECK_EQUAL(later.GetStats().entries, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
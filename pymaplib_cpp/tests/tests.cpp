@@ -18,6 +18,8 @@
 #include <cstdlib>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 
 #define BOOST_TEST_NO_MAIN
 #define BOOST_TEST_MODULE Master Test Suite
@@ -27,6 +29,10 @@
 #include <boost/test/debug.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include <Windows.h>
+
+#include "tiffio.h"
+
 #include "../include/util.h"
 
 
@@ -61,6 +67,68 @@ boost::optional<unsigned int> TestConfig::concurrency_test_msecs() const {
         return boost::optional<unsigned int>();
     }
 };
+bool TestConfig::run_benchmarks() const {
+    return m_args.find("--benchmark") != m_args.cend();
+}
+boost::optional<std::string> TestConfig::benchmark_gvg() const {
+    auto cname = std::string("--benchmark-gvg=");
+    auto it = std::find_if(m_args.cbegin(), m_args.cend(),
+        [cname](const std::string &s) -> bool {
+            return boost::starts_with(s, cname);
+    });
+    if (it == m_args.cend()) {
+        return boost::optional<std::string>();
+    }
+    return boost::make_optional(boost::erase_first_copy(*it, cname));
+}
+
+
+TempFile::TempFile() : m_fname() {
+    wchar_t dir[MAX_PATH + 1];
+    wchar_t fname[MAX_PATH + 1];
+    DWORD len = GetTempPathW(MAX_PATH + 1, dir);
+    if (len == 0 || len > MAX_PATH ||
+        !GetTempFileNameW(dir, L"odm", 0, fname))
+    {
+        throw std::runtime_error("Could not create temporary file.");
+    }
+    m_fname = fname;
+}
+
+TempFile::~TempFile() {
+    DeleteFileW(m_fname.c_str());
+}
+
+void WriteStrippedTif(const std::wstring &fname,
+                      unsigned int width, unsigned int height,
+                      unsigned int rows_per_strip)
+{
+    TIFF *tif = TIFFOpenW(fname.c_str(), "w");
+    if (!tif) {
+        throw std::runtime_error("Could not create stripped TIFF.");
+    }
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+    std::vector<unsigned char> row(width * 3);
+    for (uint32 y = 0; y < height; y++) {
+        for (uint32 x = 0; x < width; x++) {
+            row[3*x + 0] = static_cast<unsigned char>(x);
+            row[3*x + 1] = static_cast<unsigned char>(y);
+            row[3*x + 2] = static_cast<unsigned char>(x ^ y);
+        }
+        if (TIFFWriteScanline(tif, &row[0], y, 0) < 0) {
+            TIFFClose(tif);
+            throw std::runtime_error("Could not write stripped TIFF.");
+        }
+    }
+    TIFFClose(tif);
+}
 
 
 struct test_tree_reporter : boost::unit_test::test_tree_visitor {
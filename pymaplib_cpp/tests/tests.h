@@ -32,6 +32,10 @@ public:
 
     bool want_test_list() const;
     boost::optional<unsigned int> concurrency_test_msecs() const;
+    /** Return `true` if the (slow) benchmarks should run (`--benchmark`). */
+    bool run_benchmarks() const;
+    /** Return the GVG map to benchmark with (`--benchmark-gvg=<path>`). */
+    boost::optional<std::string> benchmark_gvg() const;
 
 private:
     /** Initialization method to be called by main() */
@@ -43,3 +47,26 @@ private:
     friend int main(int, char*[]);
 };
 
+/** A unique file in the temporary directory, deleted on destruction.
+ *
+ * The file is created empty, tests may overwrite it freely.
+ */
+class TempFile {
+public:
+    TempFile();
+    ~TempFile();
+    const std::wstring &GetFname() const { return m_fname; }
+private:
+    TempFile(const TempFile&);
+    void operator=(const TempFile&);
+
+    std::wstring m_fname;
+};
+
+/** Write an RGB TIFF in strips of `rows_per_strip` rows.
+ *
+ * The pixel at (x, y) has the color (x, y, x ^ y), truncated to 8 bits.
+ */
+void WriteStrippedTif(const std::wstring &fname,
+                      unsigned int width, unsigned int height,
+                      unsigned int rows_per_strip);
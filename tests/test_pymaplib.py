@@ -1,6 +1,7 @@
 import sys
 import os
 import copy
+import types
 
 import pytest
 
@@ -25,3 +26,77 @@ def test_copy_handler():
     cc.y = 40
     assert c.x == 20
     assert c.y == 10
+
+
+class FakeDHM:
+    """A square geographic DHM, with heights only where ``valid(pos)``"""
+
+    def __init__(self, name, lat, lon, size, deg_per_pixel,
+                 valid=lambda pos: True):
+        self.name = name
+        self.lat = lat
+        self.lon = lon
+        self.size = size
+        self.deg_per_pixel = deg_per_pixel
+        self.valid = valid
+
+    def GetType(self):
+        return pymaplib.GeoDrawable.TYPE_DHM
+
+    def GetSize(self):
+        return pymaplib.MapPixelDeltaInt(self.size, self.size)
+
+    def LatLonToPixel(self, latlon):
+        return True, pymaplib.MapPixelCoord(
+            (latlon.lon - self.lon) / self.deg_per_pixel,
+            (self.lat - latlon.lat) / self.deg_per_pixel)
+
+    def terrain_info(self, latlon):
+        info = types.SimpleNamespace(height_m=self.name,
+                                     slope_face_deg=0, steepness_deg=0)
+        if not self.valid(latlon):
+            info.height_m = pymaplib.HeightFinder.INVALID_DHM_VALUE
+        return True, info
+
+def test_calc_terrain_batch_picks_best_dhm(monkeypatch):
+    mpp_calls = []
+    def meters_per_pixel(dhm, coord):
+        mpp_calls.append(dhm)
+        # Slightly varying within a DHM, but never reordering them.
+        return True, dhm.deg_per_pixel * 111000 * (1 + coord.y * 1e-6)
+    def calc_terrain_info_batch(dhm, latlons):
+        infos = [dhm.terrain_info(latlon)[1] for latlon in latlons]
+        return [True] * len(infos), infos
+    monkeypatch.setattr(pymaplib, 'MetersPerPixel', meters_per_pixel)
+    monkeypatch.setattr(pymaplib.maplib_sip, 'CalcTerrainInfo',
+                        lambda dhm, latlon: dhm.terrain_info(latlon))
+    monkeypatch.setattr(pymaplib.maplib_sip, 'CalcTerrainInfoBatch',
+                        calc_terrain_info_batch)
+
+    # The fine DHM overlaps the center of the coarse one, and has no data
+    # in its northern half. The coarse one is listed first.
+    coarse = FakeDHM('coarse', 48, 11, 1000, 1e-3)
+    fine = FakeDHM('fine', 47.8, 11.2, 3000, 1e-4,
+                   valid=lambda latlon: latlon.lat < 47.65)
+    finder = pymaplib.HeightFinder([types.SimpleNamespace(drawable=coarse),
+                                    types.SimpleNamespace(drawable=fine)])
+
+    latlons = [pymaplib.LatLon(47.05 + 0.9 * y / 40, 11.05 + 0.9 * x / 40)
+               for y in range(41) for x in range(41)]
+    latlons.append(pymaplib.LatLon(50, 11.5))
+    mpp_calls.clear()
+    batch = finder.calc_terrain_batch(latlons)
+    batch_mpp_calls = len(mpp_calls)
+
+    picked = set()
+    for latlon, info in zip(latlons, batch):
+        ok, expected = finder.calc_terrain(latlon)
+        if not ok:
+            assert info is None
+            continue
+        assert info.height_m == expected.height_m
+        picked.add(info.height_m)
+    assert picked == {'coarse', 'fine'}
+    assert batch[-1] is None
+    # One resolution per block of each DHM, not one per location and DHM.
+    assert batch_mpp_calls < len(latlons) / 4